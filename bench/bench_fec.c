@@ -0,0 +1,156 @@
+/*
+ * Microbenchmark: FEC encode + decode of one frame with zfec's fec_encode /
+ * fec_decode versus rs_fec with every kernel available on this CPU, and with
+ * the best kernel on [workers] FEC worker threads. The output of all kernels
+ * is checked to be identical to zfec.
+ *
+ *     make bench && ./bench/bench_fec [k] [m] [block size] [iterations] \
+ *         [workers]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rs_fec.h"
+#include "rs_port_layer.h"
+
+/* The port layer packet codec is linked in, but not used */
+void rs_port_setup_tx_fec(struct rs_port *port, int k, int m) {}
+void rs_port_setup_rx_fec(struct rs_port *port, int k, int m) {}
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+struct frame {
+    int k;
+    int m;
+    size_t sz;
+
+    uint8_t *primary[256];
+    uint8_t *secondary[256];
+    unsigned int block_nums[256];
+
+    /* decode input: first m - k primary blocks lost */
+    const uint8_t *input[256];
+    unsigned int index[256];
+    uint8_t *output[256];
+};
+
+static void frame_init(struct frame *f, int k, int m, size_t sz) {
+    f->k = k;
+    f->m = m;
+    f->sz = sz;
+    for (int i = 0; i < k; i++) {
+        f->primary[i] = malloc(sz);
+        for (size_t j = 0; j < sz; j++)
+            f->primary[i][j] = rand();
+        f->output[i] = malloc(sz);
+    }
+    for (int i = 0; i < m - k; i++) {
+        f->secondary[i] = malloc(sz);
+        f->block_nums[i] = k + i;
+    }
+
+    int lost = m - k < k ? m - k : k;
+    for (int i = 0; i < k; i++) {
+        if (i < lost) {
+            f->input[i] = f->secondary[i];
+            f->index[i] = k + i;
+        } else {
+            f->input[i] = f->primary[i];
+            f->index[i] = i;
+        }
+    }
+}
+
+static void run(fec_t *code, struct frame *f, int zfec) {
+    if (zfec) {
+        fec_encode(code, (const gf **)f->primary, f->secondary, f->block_nums,
+                   f->m - f->k, f->sz);
+        fec_decode(code, (const gf **)f->input, f->output, f->index, f->sz);
+    } else {
+        rs_fec_encode(code, (const uint8_t **)f->primary, f->secondary,
+                      f->block_nums, f->m - f->k, f->sz);
+        rs_fec_decode(code, f->input, f->output, f->index, f->sz);
+    }
+}
+
+int main(int argc, char **argv) {
+    int k = argc > 1 ? atoi(argv[1]) : 10;
+    int m = argc > 2 ? atoi(argv[2]) : 15;
+    size_t sz = argc > 3 ? atol(argv[3]) : 1400;
+    long n = argc > 4 ? atol(argv[4]) : 20000;
+    int n_workers = argc > 5 ? atoi(argv[5]) : 0;
+
+    fec_t *code = fec_new(k, m);
+    struct frame f;
+    frame_init(&f, k, m, sz);
+
+    /* Reference output */
+    run(code, &f, 1);
+    int n_out = m - k < k ? m - k : k;
+    uint8_t *ref = malloc((m - k + n_out) * sz);
+    for (int i = 0; i < m - k; i++)
+        memcpy(ref + i * sz, f.secondary[i], sz);
+    for (int i = 0; i < n_out; i++) {
+        memcpy(ref + (m - k + i) * sz, f.output[i], sz);
+        if (memcmp(f.output[i], f.primary[i], sz)) {
+            fprintf(stderr, "zfec decode failed\n");
+            return 1;
+        }
+    }
+
+    printf("k=%d m=%d block size %zu, iterations: %ld\n", k, m, sz, n);
+
+    double t0 = now_ns();
+    for (long i = 0; i < n; i++)
+        run(code, &f, 1);
+    double t = now_ns() - t0;
+    printf("%-8s %8.2f us/frame %8.1f MB/s\n", "zfec", t / n / 1e3,
+           (double)k * sz * n / t * 1e3);
+
+    const char *names[] = {"scalar", "ssse3", "avx2", "neon", "workers"};
+    for (int j = 0; j < sizeof(names) / sizeof(names[0]); j++) {
+        if (!strcmp(names[j], "workers")) {
+            if (n_workers <= 0)
+                continue;
+            rs_fec_select_kernel(NULL);
+            if (rs_fec_workers_start(n_workers) < 0)
+                continue;
+        } else if (rs_fec_select_kernel(names[j]) < 0) {
+            continue;
+        }
+
+        for (int i = 0; i < m - k; i++)
+            memset(f.secondary[i], 0, sz);
+        run(code, &f, 0);
+        for (int i = 0; i < m - k; i++) {
+            if (memcmp(ref + i * sz, f.secondary[i], sz)) {
+                fprintf(stderr, "%s: encode differs from zfec\n", names[j]);
+                return 1;
+            }
+        }
+        for (int i = 0; i < n_out; i++) {
+            if (memcmp(ref + (m - k + i) * sz, f.output[i], sz)) {
+                fprintf(stderr, "%s: decode differs from zfec\n", names[j]);
+                return 1;
+            }
+        }
+
+        t0 = now_ns();
+        for (long i = 0; i < n; i++)
+            run(code, &f, 0);
+        t = now_ns() - t0;
+        printf("%-8s %8.2f us/frame %8.1f MB/s\n", names[j], t / n / 1e3,
+               (double)k * sz * n / t * 1e3);
+    }
+
+    rs_fec_workers_stop();
+    fec_free(code);
+    return 0;
+}
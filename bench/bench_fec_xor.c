@@ -0,0 +1,205 @@
+/*
+ * Microbenchmark: single parity block (m = k + 1) with zfec's fec_encode,
+ * rs_fec_encode (GF(2^8) kernel) and the XOR parity of rs_fec_xor, for several
+ * k on the same block size. Recovery of a lost primary block from the XOR
+ * parity is checked, as is a receiver getting XOR and zfec parity blocks mixed
+ * (the latter from peers without RS_CHANNEL_CAP_XOR).
+ *
+ *     make bench && ./bench/bench_fec_xor [block size] [iterations]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rs_fec.h"
+#include "rs_packet.h"
+#include "rs_port_layer.h"
+#include "rs_port_layer_packet.h"
+
+/* As in rs_port_layer.c, only split / join of the port layer are used */
+void rs_port_setup_tx_fec(struct rs_port *port, int k, int m) {
+    if (!port->tx_fec || port->tx_fec_k != k || port->tx_fec_m != m) {
+        port->tx_fec_m = m;
+        port->tx_fec_k = k;
+        rs_fec_release(port->tx_fec);
+        port->tx_fec = rs_fec_acquire(k, m);
+    }
+}
+void rs_port_setup_rx_fec(struct rs_port *port, int k, int m) {
+    if (!port->rx_fec || port->rx_fec_k != k || port->rx_fec_m != m) {
+        port->rx_fec_m = m;
+        port->rx_fec_k = k;
+        rs_fec_release(port->rx_fec);
+        port->rx_fec = rs_fec_acquire(k, m);
+    }
+}
+
+/*
+ * Send a frame as one block of m = k + 1 in both header formats, once with
+ * zfec and once with XOR parity, through the header codec and join it without
+ * primary fragment 0. The receiver picks the decoder from the header of each
+ * block. Returns 0 if all blocks are recovered
+ */
+static int check_mixed(int k, size_t sz) {
+    struct rs_port port;
+    memset(&port, 0, sizeof(port));
+    rs_port_setup_tx_fec(&port, k, k + 1);
+
+    int len = k * sz;
+    uint8_t *frame = malloc(len);
+    for (int i = 0; i < len; i++)
+        frame[i] = rand();
+
+    int res = 0;
+    for (int run = 0; run < 4 && !res; run++) {
+        int compact = run / 2;
+        int xor_parity = run % 2;
+        struct rs_port_layer_packet packet;
+        rs_port_layer_packet_init(&packet, NULL, NULL, frame, len);
+        rs_port_layer_packet_set_format(&packet, compact, 1);
+
+        struct rs_port_layer_packet *split[RS_PORT_LAYER_MAX_FRAGMENTS];
+        int n_split = rs_port_layer_packet_split(&packet, &port, split, sz,
+                                                 (k + 1.) / k, xor_parity);
+
+        /* Over the wire, fragment 0 is lost */
+        struct rs_port_layer_packet *received[RS_PORT_LAYER_MAX_FRAGMENTS];
+        int n_received = 0;
+        for (int i = 0; i < n_split; i++) {
+            if (i > 0) {
+                int wire_len = rs_packet_len(&split[i]->super);
+                struct rs_buffer *wire = rs_buffer_new(wire_len);
+                uint8_t *b = wire->data;
+                int bl = wire_len;
+                rs_packet_pack(&split[i]->super, &b, &bl);
+
+                struct rs_packet *from = rs_packet_alloc();
+                rs_packet_init(from, wire, NULL, wire->data, wire_len);
+                struct rs_port_layer_packet *unpacked =
+                    rs_port_layer_packet_alloc();
+                if (rs_port_layer_packet_unpack(unpacked, from)) {
+                    rs_packet_destroy(from);
+                    rs_port_layer_packet_free(unpacked);
+                    res = -1;
+                } else {
+                    received[n_received++] = unpacked;
+                }
+                rs_packet_free(from);
+            }
+            rs_packet_destroy(&split[i]->super);
+            rs_port_layer_packet_free(split[i]);
+        }
+        rs_packet_destroy(&packet.super);
+
+        struct rs_port_layer_packet joined;
+        if (!res &&
+            (received[n_received - 1]->xor_parity != xor_parity ||
+             rs_port_layer_packet_join(&joined, &port, received, n_received)))
+            res = -1;
+        if (!res) {
+            struct rs_packet_iov *iov = rs_packet_iov(joined.super.payload_iov);
+            int off = 0;
+            for (int i = 0; i < iov->n && !res; i++) {
+                if (memcmp(frame + off, iov->iov[i].iov_base,
+                           iov->iov[i].iov_len))
+                    res = -1;
+                off += iov->iov[i].iov_len;
+            }
+            if (off != len)
+                res = -1;
+            rs_packet_destroy(&joined.super);
+        }
+        if (res)
+            fprintf(stderr, "k=%d: recovery of the %s block failed (%s)\n", k,
+                    xor_parity ? "XOR" : "zfec",
+                    compact ? "compact header" : "full header");
+
+        for (int i = 0; i < n_received; i++) {
+            rs_packet_destroy(&received[i]->super);
+            rs_port_layer_packet_free(received[i]);
+        }
+    }
+
+    rs_fec_release(port.tx_fec);
+    rs_fec_release(port.rx_fec);
+    free(frame);
+    return res;
+}
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, double t, int k, size_t sz, long n) {
+    printf("%-8s %8.2f us/block %8.1f MB/s\n", name, t / n / 1e3,
+           (double)k * sz * n / t * 1e3);
+}
+
+int main(int argc, char **argv) {
+    size_t sz = argc > 1 ? atol(argv[1]) : 1400;
+    long n = argc > 2 ? atol(argv[2]) : 20000;
+
+    printf("kernel: %s, block size %zu, iterations: %ld\n",
+           rs_fec_kernel_name(), sz, n);
+
+    const int ks[] = {2, 4, 8, 16, 32};
+    for (int x = 0; x < sizeof(ks) / sizeof(ks[0]); x++) {
+        int k = ks[x];
+        fec_t *code = fec_new(k, k + 1);
+
+        uint8_t *primary[32];
+        for (int i = 0; i < k; i++) {
+            primary[i] = malloc(sz);
+            for (size_t j = 0; j < sz; j++)
+                primary[i][j] = rand();
+        }
+        uint8_t *parity = malloc(sz);
+        uint8_t *recovered = malloc(sz);
+        unsigned int block_num = k;
+
+        /* Lose primary block 0 */
+        rs_fec_xor((const uint8_t **)primary, k, parity, sz);
+        const uint8_t *input[32];
+        input[0] = parity;
+        for (int i = 1; i < k; i++)
+            input[i] = primary[i];
+        rs_fec_xor(input, k, recovered, sz);
+        if (memcmp(recovered, primary[0], sz)) {
+            fprintf(stderr, "k=%d: XOR recovery failed\n", k);
+            return 1;
+        }
+
+        if (check_mixed(k, sz))
+            return 1;
+
+        printf("k=%d m=%d\n", k, k + 1);
+
+        double t0 = now_ns();
+        for (long i = 0; i < n; i++)
+            fec_encode(code, (const gf **)primary, &parity, &block_num, 1, sz);
+        report("zfec", now_ns() - t0, k, sz, n);
+
+        t0 = now_ns();
+        for (long i = 0; i < n; i++)
+            rs_fec_encode(code, (const uint8_t **)primary, &parity,
+                          &block_num, 1, sz);
+        report("rs_fec", now_ns() - t0, k, sz, n);
+
+        t0 = now_ns();
+        for (long i = 0; i < n; i++)
+            rs_fec_xor((const uint8_t **)primary, k, parity, sz);
+        report("xor", now_ns() - t0, k, sz, n);
+
+        for (int i = 0; i < k; i++)
+            free(primary[i]);
+        free(parity);
+        free(recovered);
+        fec_free(code);
+    }
+
+    return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * Microbenchmark: pack + unpack of channel and port layer headers, byte-wise
+ * PACK / UNPACK (as used before the fixed-layout codec) versus the current
+ * codec.
+ *
+ *     make bench && ./bench/bench_header_codec [iterations]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rs_channel_layer_packet.h"
+#include "rs_packet.h"
+#include "rs_port_layer.h"
+#include "rs_port_layer_packet.h"
+#include "rs_util.h"
+
+/* split / join are not benchmarked */
+void rs_port_setup_tx_fec(struct rs_port *port, int k, int m) {}
+void rs_port_setup_rx_fec(struct rs_port *port, int k, int m) {}
+
+/* Reference implementation */
+
+static int old_stats_pack(struct rs_stats_packed *packed, uint8_t **buffer,
+                          int *buffer_len) {
+    PACK(buffer, buffer_len, uint16_t, packed->tx_bits);
+    PACK(buffer, buffer_len, uint16_t, packed->rx_bits);
+    PACK(buffer, buffer_len, uint16_t, packed->rx_missed);
+    return 0;
+pack_err:
+    return -1;
+}
+
+static int old_stats_unpack(struct rs_stats_packed *unpacked, uint8_t **buffer,
+                            int *buffer_len) {
+    UNPACK(buffer, buffer_len, uint16_t, &unpacked->tx_bits);
+    UNPACK(buffer, buffer_len, uint16_t, &unpacked->rx_bits);
+    UNPACK(buffer, buffer_len, uint16_t, &unpacked->rx_missed);
+    return 0;
+unpack_err:
+    return -1;
+}
+
+static int old_pack(struct rs_channel_layer_packet *ch,
+                    struct rs_port_layer_packet *port, uint8_t **buffer,
+                    int *buffer_len) {
+    PACK(buffer, buffer_len, rs_channel_t, ch->channel);
+    PACK(buffer, buffer_len, rs_channel_layer_seq_t, ch->seq);
+    if (old_stats_pack(&ch->stats, buffer, buffer_len))
+        goto pack_err;
+    PACK(buffer, buffer_len, uint8_t, ch->command);
+
+    PACK(buffer, buffer_len, uint8_t, port->command);
+    PACK(buffer, buffer_len, rs_port_id_t, port->port);
+    PACK(buffer, buffer_len, rs_port_layer_seq_t, port->seq);
+    PACK(buffer, buffer_len, uint32_t, port->payload_len);
+    PACK(buffer, buffer_len, rs_port_layer_frag_t, port->frag);
+    PACK(buffer, buffer_len, rs_port_layer_frag_t, port->n_frag_decoded);
+    PACK(buffer, buffer_len, rs_port_layer_frag_t, port->n_frag_encoded);
+    if (old_stats_pack(&port->stats, buffer, buffer_len))
+        goto pack_err;
+    return 0;
+pack_err:
+    return -1;
+}
+
+static int old_unpack(struct rs_channel_layer_packet *ch,
+                      struct rs_port_layer_packet *port, uint8_t **buffer,
+                      int *buffer_len) {
+    UNPACK(buffer, buffer_len, rs_channel_t, &ch->channel);
+    UNPACK(buffer, buffer_len, rs_channel_layer_seq_t, &ch->seq);
+    if (old_stats_unpack(&ch->stats, buffer, buffer_len))
+        goto unpack_err;
+    UNPACK(buffer, buffer_len, uint8_t, &ch->command);
+
+    UNPACK(buffer, buffer_len, uint8_t, &port->command);
+    UNPACK(buffer, buffer_len, rs_port_id_t, &port->port);
+    UNPACK(buffer, buffer_len, rs_port_layer_seq_t, &port->seq);
+    UNPACK(buffer, buffer_len, uint32_t, &port->payload_len);
+    UNPACK(buffer, buffer_len, rs_port_layer_frag_t, &port->frag);
+    UNPACK(buffer, buffer_len, rs_port_layer_frag_t, &port->n_frag_decoded);
+    UNPACK(buffer, buffer_len, rs_port_layer_frag_t, &port->n_frag_encoded);
+    if (old_stats_unpack(&port->stats, buffer, buffer_len))
+        goto unpack_err;
+    return 0;
+unpack_err:
+    return -1;
+}
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return 1e9 * ts.tv_sec + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    long n = argc > 1 ? atol(argv[1]) : 10000000;
+
+    uint8_t payload[1024] = {0};
+    uint8_t buf[2048];
+    volatile uint32_t sink = 0;
+
+    struct rs_port_layer_packet port;
+    rs_port_layer_packet_init(&port, NULL, NULL, payload, sizeof(payload));
+    port.port = 3;
+    port.seq = 4711;
+    port.frag = 2;
+    port.n_frag_decoded = 4;
+    port.n_frag_encoded = 6;
+    port.stats = (struct rs_stats_packed){1234, 5678, 42};
+
+    struct rs_channel_layer_packet ch;
+    rs_channel_layer_packet_init(&ch, NULL, &port.super, NULL, 0);
+    ch.channel = 0x105;
+    ch.seq = 999;
+    ch.stats = (struct rs_stats_packed){4321, 8765, 24};
+
+    int len_header = rs_packet_len_header(&ch.super) +
+                     rs_packet_len_header(&port.super);
+
+    /* Both codecs need to agree on the wire */
+    uint8_t ref[2048];
+    uint8_t *b = ref;
+    int bl = sizeof(ref);
+    old_pack(&ch, &port, &b, &bl);
+    b = buf;
+    bl = sizeof(buf);
+    rs_packet_pack_header(&ch.super, &b, &bl);
+    rs_packet_pack_header(&port.super, &b, &bl);
+    if (b - buf != len_header || memcmp(ref, buf, len_header)) {
+        fprintf(stderr, "header codecs disagree\n");
+        return 1;
+    }
+
+    struct rs_channel_layer_packet ch2 = {0};
+    struct rs_port_layer_packet port2 = {0};
+
+    double t0 = now_ns();
+    for (long i = 0; i < n; i++) {
+        ch.seq = i;
+        b = buf;
+        bl = sizeof(buf);
+        old_pack(&ch, &port, &b, &bl);
+
+        b = buf;
+        bl = sizeof(buf);
+        old_unpack(&ch2, &port2, &b, &bl);
+        sink += ch2.seq + port2.payload_len;
+    }
+    double t1 = now_ns();
+    for (long i = 0; i < n; i++) {
+        ch.seq = i;
+        b = buf;
+        bl = sizeof(buf);
+        rs_packet_pack_header(&ch.super, &b, &bl);
+        rs_packet_pack_header(&port.super, &b, &bl);
+
+        rs_channel_layer_packet_unpack(&ch2, NULL, buf, len_header);
+        rs_port_layer_packet_unpack(&port2, &ch2.super);
+        sink += ch2.seq + port2.payload_len;
+    }
+    double t2 = now_ns();
+
+    printf("header bytes: %d, iterations: %ld\n", len_header, n);
+    printf("PACK/UNPACK:  %6.2f ns/packet\n", (t1 - t0) / n);
+    printf("fixed-layout: %6.2f ns/packet\n", (t2 - t1) / n);
+
+    return sink == 0xFFFFFFFF;
+}
@@ -3,6 +3,7 @@
 
 #include <arpa/inet.h>
 #include <libconfig.h>
+#include <time.h>
 
 #include "rs_port_layer.h"
 #include "rs_stat.h"
@@ -28,14 +29,28 @@ void rs_app_connection_destroy(struct rs_app_connection *connection);
 void rs_app_layer_main(struct rs_app_layer *layer, struct rs_packet *received,
                        rs_port_id_t received_port);
 
+/* Whether complete frames are waiting to be sent (one is sent per
+ * connection and rs_app_layer_main call) */
+int rs_app_layer_pending(struct rs_app_layer *layer);
+
+/* Threaded mode: a frame of port was dropped by the radio thread as it
+ * exceeded the latency budget (may be called from any thread) */
+void rs_app_layer_expired(struct rs_app_layer *layer, rs_port_id_t port);
+
 #define RS_FRAME_BUFFER_MAX_SIZE 10000000
 
+/*
+ * Frames start at buffer + RS_PACKET_HEADROOM at the earliest, which leaves
+ * room to prepend headers in front of any frame
+ */
 struct rs_frame_buffer {
     uint8_t *buffer;
     int buffer_at;
     int buffer_size;
 
     int *frame_start;
+    /* When frame i was complete */
+    struct timespec *frame_ts;
     int n_frames;
     int n_frames_max;
 
@@ -70,6 +85,8 @@ struct rs_app_connection {
 
     struct rs_stat stat_in;
     struct rs_stat stat_skipped;
+    /* see rs_app_layer_expired, registered in stat_skipped */
+    int n_expired;
 
     int socket;
     struct sockaddr_in addr_server;
@@ -20,6 +20,7 @@ typedef uint16_t rs_channel_layer_seq_t;
 
 #include "rs_channel_layer_packet.h"
 #include "rs_stat.h"
+#include "rs_timer.h"
 
 struct rs_server_state;
 struct rs_packet;
@@ -33,6 +34,15 @@ struct rs_channel_layer {
 
     struct rs_channel_info *channels;
 
+    /* channel with frames queued by _transmit but not yet flushed */
+    struct rs_channel_info *tx_pending;
+
+    /* announce / use the compact header format (config compact_header) */
+    int compact_header;
+
+    /* header length used for the last transmitted packet */
+    int tx_last_len_header;
+
     uint8_t ch_base;
 };
 
@@ -48,6 +58,25 @@ int rs_channel_layer_owns_channel(struct rs_channel_layer *layer,
  */
 int rs_channel_layer_transmit(struct rs_channel_layer *layer,
                               struct rs_packet *packet, rs_channel_t channel);
+
+/*
+ * Hand all packets queued by rs_channel_layer_transmit to the device (no-op
+ * for implementations which send immediately). Called after each batch, e.g.
+ * all fragments of a frame
+ */
+int rs_channel_layer_flush(struct rs_channel_layer *layer);
+
+/*
+ * Transmit n packets on channel with the per call overhead (ownership check,
+ * timing, device setup) paid once per RS_CHANNEL_LAYER_BATCH packets.
+ * len_header (may be NULL) receives the header length used for each packet.
+ * Returns the total number of bytes or negative values if any packet failed
+ */
+#define RS_CHANNEL_LAYER_BATCH 32
+int rs_channel_layer_transmit_batch(struct rs_channel_layer *layer,
+                                    struct rs_packet **packets, int n,
+                                    rs_channel_t channel, int *len_header);
+
 /*
  * (*channel) can either be 0 (must be a valid pointer) to receive on last
  * channel, or can be set to define the channel on whicht to listen.
@@ -58,16 +87,83 @@ int rs_channel_layer_transmit(struct rs_channel_layer *layer,
  *
  *  RS_CHANNEL_LAYER_IRR: Received packet we don't care about
  *  RS_CHANNEL_LAYER_BADFCS: Received packet with bad checksum
+ *
+ * The payload of the received packet may be borrowed from the implementation
+ * (payload_ownership == NULL, e.g. a slot in a receive ring). It is only valid
+ * until the next call to rs_channel_layer_receive on the same layer and has to
+ * be copied if it is needed for longer
  */
 int rs_channel_layer_receive(struct rs_channel_layer *layer,
                              struct rs_packet **packet, rs_channel_t *channel);
 
 /*
- * Handle channel layer communication (heartbeats)
+ * Receive up to (*n) packets listening on channel (0 for last channel),
+ * (*n) is set to the number of packets / channels placed in the args.
+ * Packets we don't care about or with bad checksum are skipped.
+ * Return values:
+ *  negative: errors
+ *  0: device might have more packets
+ *  RS_CHANNEL_LAYER_EOF: No more packets for now
+ *
+ * Borrowed payloads of all packets are valid until the next receive call on
+ * the same layer
+ */
+int rs_channel_layer_receive_batch(struct rs_channel_layer *layer,
+                                   struct rs_packet **packets,
+                                   rs_channel_t *channels, int *n,
+                                   rs_channel_t channel);
+
+/*
+ * Whether the other side understands the compact header format on channel
+ */
+int rs_channel_layer_compact(struct rs_channel_layer *layer,
+                             rs_channel_t channel);
+
+/*
+ * Whether the other side splits aggregated port layer packets on channel
+ */
+int rs_channel_layer_aggregate(struct rs_channel_layer *layer,
+                               rs_channel_t channel);
+
+/*
+ * Whether the other side decodes XOR parity blocks (marked in the port layer
+ * header) on channel
+ */
+int rs_channel_layer_xor(struct rs_channel_layer *layer, rs_channel_t channel);
+
+/*
+ * Whether the other side reassembles frames sent in several segments on
+ * channel
+ */
+int rs_channel_layer_segment(struct rs_channel_layer *layer,
+                             rs_channel_t channel);
+
+/*
+ * Whether the other side recognises fragments of cross-frame groups on channel
+ */
+int rs_channel_layer_group(struct rs_channel_layer *layer,
+                           rs_channel_t channel);
+
+/*
+ * Handle channel layer communication (flush queued packets)
+ *
+ * Heartbeats are sent on idle channels and at least every
+ * RS_CHANNEL_CMD_HEARTBEAT_MAX_MSEC, their payload announces capabilities.
+ * They are driven by a timer per channel on server->timers
  */
 #define RS_CHANNEL_CMD_DUMMY_SIZE 1
 #define RS_CHANNEL_CMD_HEARTBEAT 0xFD
 #define RS_CHANNEL_CMD_HEARTBEAT_MSEC 50
+#define RS_CHANNEL_CMD_HEARTBEAT_MAX_MSEC 1000
+
+#define RS_CHANNEL_CAP_COMPACT 0x01
+#define RS_CHANNEL_CAP_AGGREGATE 0x02
+#define RS_CHANNEL_CAP_XOR 0x04
+#define RS_CHANNEL_CAP_SEGMENT 0x08
+#define RS_CHANNEL_CAP_GROUP 0x10
+
+/* Interval to publish stats in the compact format */
+#define RS_CHANNEL_STATS_MSEC 100
 
 void rs_channel_layer_main(struct rs_channel_layer *layer);
 
@@ -77,13 +173,36 @@ struct rs_channel_layer_vtable {
     int (*_transmit)(struct rs_channel_layer *layer, struct rs_packet *packet,
                      rs_channel_t channel);
 
+    /* optional, may be NULL */
+    int (*_flush)(struct rs_channel_layer *layer);
+
     int (*_receive)(struct rs_channel_layer *layer,
                     struct rs_channel_layer_packet **packet,
                     rs_channel_t channel);
 
+    /* optional, may be NULL: transmit n <= RS_CHANNEL_LAYER_BATCH packets,
+     * returns the total number of bytes */
+    int (*_transmit_batch)(struct rs_channel_layer *layer,
+                           struct rs_packet **packets, int n,
+                           rs_channel_t channel);
+
+    /* optional, may be NULL: as rs_channel_layer_receive_batch with
+     * (*n) <= RS_CHANNEL_LAYER_BATCH, skipped packets are not placed */
+    int (*_receive_batch)(struct rs_channel_layer *layer,
+                          struct rs_channel_layer_packet **packets, int *n,
+                          rs_channel_t channel);
+
     int (*ch_n)(struct rs_channel_layer *layer);
 
+    /* optional, may be NULL: fd which is readable when packets arrive */
+    int (*fd)(struct rs_channel_layer *layer);
+
     int (*max_packet_size)(struct rs_channel_layer *layer, rs_channel_t cannel);
+
+    /* optional, may be NULL: channel on the same frequency with the next
+     * higher (dir > 0) or lower (dir < 0) rate, 0 if there is none */
+    rs_channel_t (*rate_step)(struct rs_channel_layer *layer,
+                              rs_channel_t channel, int dir);
 };
 
 static inline void rs_channel_layer_destroy(struct rs_channel_layer *layer) {
@@ -94,12 +213,26 @@ static inline int rs_channel_layer_ch_n(struct rs_channel_layer *layer) {
     return (layer->vtable->ch_n)(layer);
 }
 
+static inline int rs_channel_layer_fd(struct rs_channel_layer *layer) {
+    if (!layer->vtable->fd)
+        return -1;
+    return (layer->vtable->fd)(layer);
+}
+
 static inline int
 rs_channel_layer_max_packet_size(struct rs_channel_layer *layer,
                                  rs_channel_t channel) {
     return (layer->vtable->max_packet_size)(layer, channel);
 }
 
+static inline rs_channel_t
+rs_channel_layer_rate_step(struct rs_channel_layer *layer, rs_channel_t channel,
+                           int dir) {
+    if (!layer->vtable->rate_step)
+        return 0;
+    return (layer->vtable->rate_step)(layer, channel, dir);
+}
+
 rs_channel_t rs_channel_layer_ch(struct rs_channel_layer *layer, int i);
 uint16_t rs_channel_layer_extract(struct rs_channel_layer *layer,
                                   rs_channel_t channel);
@@ -115,6 +248,25 @@ struct rs_channel_info {
     int is_in_use;
 
     struct timespec tx_last_ts;
+    struct timespec tx_heartbeat_last_ts;
+    struct timespec tx_stats_last_ts;
+
+    struct rs_timer heartbeat_timer;
+
+    /* other side announced RS_CHANNEL_CAP_COMPACT */
+    int tx_compact;
+
+    /* other side announced RS_CHANNEL_CAP_AGGREGATE */
+    int tx_aggregate;
+
+    /* other side announced RS_CHANNEL_CAP_XOR */
+    int tx_xor;
+
+    /* other side announced RS_CHANNEL_CAP_SEGMENT */
+    int tx_segment;
+
+    /* other side announced RS_CHANNEL_CAP_GROUP */
+    int tx_group;
 
     rs_channel_layer_seq_t tx_last_seq;
     rs_channel_layer_seq_t rx_last_seq;
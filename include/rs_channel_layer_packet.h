@@ -5,12 +5,35 @@
 #include "rs_packet.h"
 #include "rs_stat.h"
 
+/*
+ * Header: channel (2), seq (2), stats (RS_STATS_PACKED_LEN), command (1), all
+ * big-endian
+ */
+#define RS_CHANNEL_LAYER_PACKET_HEADER_LEN (2 + 2 + RS_STATS_PACKED_LEN + 1)
+
+/*
+ * Compact header (only sent once the other side announced
+ * RS_CHANNEL_CAP_COMPACT): channel | RS_CHANNEL_LAYER_PACKET_COMPACT (2),
+ * flags (1), lower 8 bits of seq (1), then command (1) and stats
+ * (RS_STATS_PACKED_LEN) if the respective flag is set
+ */
+#define RS_CHANNEL_LAYER_PACKET_COMPACT 0x0800
+#define RS_CHANNEL_LAYER_PACKET_COMPACT_LEN 4
+
+#define RS_CHANNEL_LAYER_COMPACT_COMMAND 0x01
+#define RS_CHANNEL_LAYER_COMPACT_STATS 0x02
+
 struct rs_channel_layer_packet {
     struct rs_packet super;
 
     rs_channel_t channel;
+
+    /* Only the lower 8 bits are valid after unpacking the compact format */
     rs_channel_layer_seq_t seq;
 
+    /* Compact format may omit stats */
+    uint8_t compact;
+    uint8_t has_stats;
     struct rs_stats_packed stats;
 
     /*
@@ -23,12 +46,26 @@ struct rs_channel_layer_packet {
 void rs_channel_layer_packet_pack_header(struct rs_packet *super,
                                          uint8_t **buffer, int *buffer_len);
 void rs_channel_layer_packet_init(struct rs_channel_layer_packet *packet,
-                                  void *payload_ownership,
+                                  struct rs_buffer *payload_ownership,
                                   struct rs_packet *payload_packet,
                                   uint8_t *payload_data, int payload_data_len);
 
 int rs_channel_layer_packet_unpack(struct rs_channel_layer_packet *packet,
-                                   void *payload_ownership,
+                                   struct rs_buffer *payload_ownership,
                                    uint8_t *payload_data, int payload_data_len);
 
+/* Select header format, needs to be called once command is set */
+void rs_channel_layer_packet_set_format(struct rs_channel_layer_packet *packet,
+                                        int compact, int has_stats);
+
+/* Pooled allocation, rs_channel_layer_packet_free does not destroy */
+static inline struct rs_channel_layer_packet *rs_channel_layer_packet_alloc() {
+    return rs_pool_alloc(&rs_pools[RS_POOL_CHANNEL_LAYER_PACKET]);
+}
+
+static inline void
+rs_channel_layer_packet_free(struct rs_channel_layer_packet *packet) {
+    rs_pool_free(&rs_pools[RS_POOL_CHANNEL_LAYER_PACKET], packet);
+}
+
 #endif
@@ -12,6 +12,20 @@
 
 #define RS_PCAP_TX_BUFSIZE 2048
 
+/* PACKET_MMAP TX ring defaults (see rs_channel_layer_pcap_init) */
+#define RS_PCAP_TX_RING_FRAMES 64
+
+/* PACKET_MMAP TPACKET_V3 RX ring defaults */
+#define RS_PCAP_RX_RING_BLOCKS 16
+#define RS_PCAP_RX_RING_BLOCK_SIZE (1 << 16)
+/* Nominal frame size (frames are packed into blocks by their actual length),
+ * only determines tp_frame_nr */
+#define RS_PCAP_RX_RING_FRAME_SIZE 2048
+#define RS_PCAP_RX_RING_BLOCK_TOV_MSEC 1
+
+/* Highest MCS used by rate adaptation (single spatial stream) */
+#define RS_PCAP_MCS_MAX 7
+
 struct nl_sock;
 struct nl_cb;
 
@@ -46,7 +60,43 @@ struct rs_channel_layer_pcap {
 
     struct {
         int use_short_gi;
+        int mcs_max;
     } phy_conf;
+
+    /*
+     * Optional AF_PACKET TX_RING: frames are written directly into ring slots
+     * and handed to the kernel in batches by _flush. fd < 0 indicates
+     * pcap_inject is used instead
+     */
+    struct {
+        int fd;
+        uint8_t *map;
+        size_t map_len;
+
+        int frame_size;
+        int frame_nr;
+        int frame_at;
+        int n_pending;
+    } tx_ring;
+
+    /*
+     * Optional AF_PACKET TPACKET_V3 RX_RING: frames are parsed in place, the
+     * block holding the last received frame is returned to the kernel on the
+     * next _receive. fd < 0 indicates pcap_next is used instead
+     */
+    struct {
+        int fd;
+        uint8_t *map;
+        size_t map_len;
+
+        int block_size;
+        int block_nr;
+        int block_at;
+
+        int block_held;
+        int n_left;
+        uint8_t *frame;
+    } rx_ring;
 };
 
 /*
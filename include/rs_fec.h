@@ -0,0 +1,89 @@
+#ifndef RS_FEC_H
+#define RS_FEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "zfec/zfec/fec.h"
+
+/*
+ * Drop-in replacements for zfec's fec_encode / fec_decode.
+ *
+ * The code itself (fec_t, created by fec_new) is zfec's, only the GF(2^8)
+ * multiply-accumulate over the blocks is done here with nibble-table kernels
+ * (pshufb / tbl), so that the output is byte-identical to zfec and both ends
+ * stay wire-compatible regardless of the kernel in use.
+ *
+ * The kernel is selected at runtime from what the CPU supports: AVX2, SSSE3
+ * (x86), NEON (ARM) or a scalar fallback.
+ */
+
+/* Build GF tables and select the best kernel, called implicitly */
+void rs_fec_init();
+
+/* Force a kernel by name ("scalar", "ssse3", "avx2", "neon"), NULL selects the
+ * best one. Returns -1 if the kernel is not available */
+int rs_fec_select_kernel(const char *name);
+const char *rs_fec_kernel_name();
+
+/* Same semantics as fec_encode */
+void rs_fec_encode(const fec_t *code, const uint8_t *const *src,
+                   uint8_t *const *fecs, const unsigned int *block_nums,
+                   size_t num_block_nums, size_t sz);
+
+/* Same semantics as fec_decode: primary blocks at their own index, one output
+ * per missing primary block in order */
+void rs_fec_decode(const fec_t *code, const uint8_t *const *inpkts,
+                   uint8_t *const *outpkts, const unsigned int *index,
+                   size_t sz);
+
+/*
+ * Optional worker pool for large blocks: encode and decode split the block
+ * into byte-column stripes computed by n worker threads and the caller, if
+ * (output blocks * k * block size) is at least RS_FEC_PARALLEL_MIN bytes.
+ * Smaller blocks, or n = 0 (default), stay on the calling thread
+ */
+#define RS_FEC_MAX_WORKERS 8
+#define RS_FEC_PARALLEL_MIN (256 * 1024)
+
+int rs_fec_workers_start(int n);
+void rs_fec_workers_stop();
+
+/*
+ * dst = src[0] ^ ... ^ src[n - 1] over sz bytes. Blocks with a single parity
+ * block (m = k + 1) use this as parity instead of zfec's code row if the other
+ * side announced it (RS_CHANNEL_CAP_XOR, marked per block by
+ * RS_PORT_LAYER_COMPACT_XOR in the compact header or the flags byte of the full
+ * one): encoding XORs the k primary blocks, decoding XORs the k received
+ * blocks to get the missing one
+ */
+void rs_fec_xor(const uint8_t *const *src, int n, uint8_t *dst, size_t sz);
+
+/* dst ^= c * src over len bytes with the selected kernel */
+void rs_fec_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+
+/*
+ * Process-wide cache of codes keyed by (k, m), shared by all ports and both
+ * directions, as fec_new rebuilds the encoding matrix. Acquired codes are
+ * pinned until released, the least recently used unpinned code is evicted
+ */
+#define RS_FEC_CACHE_SIZE 32
+
+struct rs_fec_cache_stats {
+    long hits;
+    long misses;
+    long evictions;
+    int n_entries;
+};
+
+fec_t *rs_fec_acquire(int k, int m);
+
+/* NULL is ignored */
+void rs_fec_release(fec_t *code);
+
+void rs_fec_cache_stats(struct rs_fec_cache_stats *stats);
+
+/* Free all cached codes, none may be acquired */
+void rs_fec_cache_destroy();
+
+#endif
@@ -4,7 +4,7 @@
 #include <stdint.h>
 
 #define RS_MESSAGE_CMD_REPORT 1
-#define RS_MESSAGE_CMD_REPORT_N 11
+#define RS_MESSAGE_CMD_REPORT_N 13
 
 #define RS_MESSAGE_CMD_SWITCH_CHANNEL 2
 #define RS_MESSAGE_CMD_UPDATE_PORT 3
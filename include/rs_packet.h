@@ -2,31 +2,67 @@
 #define RS_PACKET_H
 
 #include <stdint.h>
+#include <sys/uio.h>
+
+#include "rs_pool.h"
+
+/*
+ * Space reserved in front of payload data on TX, so that all layer headers
+ * (port, channel, IEEE802.11, radiotap) can be prepended in place
+ */
+#define RS_PACKET_HEADROOM 128
 
 struct rs_packet_vtable;
 
+/*
+ * Payload scattered over several buffers, e.g. the fragments of a joined
+ * packet, which can be handed to writev. Lives in the data of an rs_buffer
+ * (see rs_packet_iov_new), every entry holds a reference in ownership
+ */
+struct rs_packet_iov {
+    int n;
+    struct rs_buffer **ownership;
+    struct iovec iov[];
+};
+
 struct rs_packet {
     /*
      * Either payload_packet or payload_data and payload_data_len can be set
      * (not both)
      *
-     * nonnull payload_ownership indicates that memory will be freed on destroy
-     * (either a packed packet or data, in the latter case payload_ownership
-     * should point to the allocated memory)
+     * nonnull payload_ownership is a reference on the buffer containing
+     * payload_data, which is released on destroy. payload_packet is never
+     * owned
+     *
+     * During unpacking payload_data may advance past the start of
+     * payload_ownership->data
      *
-     * During unpacking payload_data may advance past payload_ownership, freeing
-     * payload_data will then result in a segfault
+     * payload_data without payload_ownership is borrowed, the owner defines
+     * how long it stays valid (see rs_channel_layer_receive)
+     *
+     * payload_data_headroom is the number of bytes in front of payload_data
+     * which may be overwritten by rs_packet_pack_inplace
+     *
+     * Alternatively to payload_data the payload may be scattered:
+     * payload_iov is owned, payload_data is NULL and payload_data_len is the
+     * total length then. Such packets can not be packed in place
      */
-    void *payload_ownership;
+    struct rs_buffer *payload_ownership;
     struct rs_packet *payload_packet;
+    struct rs_buffer *payload_iov;
 
     uint8_t *payload_data;
     int payload_data_len;
+    int payload_data_headroom;
+
+    /* Length of the header written by pack_header, maintained by subclass */
+    int len_header;
 
     struct rs_packet_vtable *vtable;
 };
 
-void rs_packet_init(struct rs_packet *packet, void *payload_ownerhip,
+void rs_packet_init(struct rs_packet *packet,
+                    struct rs_buffer *payload_ownership,
                     struct rs_packet *payload_packet, uint8_t *payload_data,
                     int payload_data_len);
 
@@ -36,7 +72,6 @@ struct rs_packet_vtable {
     void (*pack_header)(struct rs_packet *packet, uint8_t **buffer,
                         int *buffer_len);
     int (*len)(struct rs_packet *packet);
-    int (*len_header)(struct rs_packet *packet);
 };
 
 void rs_packet_base_destroy(struct rs_packet *packet);
@@ -45,7 +80,39 @@ void rs_packet_base_pack(struct rs_packet *packet, uint8_t **buffer,
 void rs_packet_base_pack_header(struct rs_packet *packet, uint8_t **buffer,
                                 int *buffer_len);
 int rs_packet_base_len(struct rs_packet *packet);
-int rs_packet_base_len_header(struct rs_packet *packet);
+
+/*
+ * Headroom left in front of the packed packet if packed in place, negative if
+ * the packet can not be packed in place
+ */
+int rs_packet_headroom(struct rs_packet *packet);
+
+/*
+ * Prepend headers of the packet chain in front of the innermost payload_data,
+ * returns the start of the packed packet (of length rs_packet_len). Requires
+ * rs_packet_headroom(packet) >= 0
+ */
+uint8_t *rs_packet_pack_inplace(struct rs_packet *packet);
+
+/* Buffer holding an empty rs_packet_iov with space for n entries */
+struct rs_buffer *rs_packet_iov_new(int n);
+
+static inline struct rs_packet_iov *rs_packet_iov(struct rs_buffer *iov) {
+    return (struct rs_packet_iov *)iov->data;
+}
+
+/* Append data, ownership is transferred (pass rs_buffer_ref to share) */
+void rs_packet_iov_append(struct rs_buffer *iov, struct rs_buffer *ownership,
+                          uint8_t *data, int len);
+
+/* Pooled allocation, rs_packet_free does not destroy */
+static inline struct rs_packet *rs_packet_alloc() {
+    return rs_pool_alloc(&rs_pools[RS_POOL_PACKET]);
+}
+
+static inline void rs_packet_free(struct rs_packet *packet) {
+    rs_pool_free(&rs_pools[RS_POOL_PACKET], packet);
+}
 
 static inline void rs_packet_destroy(struct rs_packet *packet) {
     (packet->vtable->destroy)(packet);
@@ -66,7 +133,7 @@ static inline int rs_packet_len(struct rs_packet *packet) {
 }
 
 static inline int rs_packet_len_header(struct rs_packet *packet) {
-    return (packet->vtable->len_header)(packet);
+    return packet->len_header;
 }
 
 #endif
@@ -0,0 +1,106 @@
+#ifndef RS_PIPELINE_H
+#define RS_PIPELINE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "rs_port_layer.h"
+
+struct rs_server_state;
+struct rs_packet;
+
+/*
+ * Optional threaded mode (config threads): the port and channel layers run on
+ * a radio thread, while the app layer and the command loop stay on the main
+ * thread. Frames to send and received packets are handed over as packet
+ * handles through bounded single producer / single consumer rings, a
+ * consumer about to sleep is woken up through an eventfd.
+ *
+ * The radio thread holds lock while it works on the layers, the main thread
+ * takes it to access layer state (commands, REPORT stats).
+ */
+#define RS_PIPELINE_RING_SIZE 256
+
+struct rs_pipeline_item {
+    struct rs_packet *packet;
+    rs_port_id_t port;
+    struct timespec ts;
+};
+
+/* Lock-free, head is only written by the producer and tail by the consumer */
+struct rs_pipeline_ring {
+    struct rs_pipeline_item items[RS_PIPELINE_RING_SIZE];
+
+    unsigned int head __attribute__((aligned(64)));
+    unsigned int tail __attribute__((aligned(64)));
+
+    /* set by the consumer before it sleeps, eventfd signalled on push then */
+    int waiting;
+    int wakeup_fd;
+};
+
+struct rs_pipeline {
+    struct rs_server_state *server;
+
+    pthread_t radio_thread;
+    int started;
+    pthread_mutex_t lock;
+
+    /* radio devices and tx.wakeup_fd */
+    int radio_epoll_fd;
+
+    /* main -> radio: frames to send */
+    struct rs_pipeline_ring tx;
+    /* radio -> main: received packets */
+    struct rs_pipeline_ring rx;
+};
+
+int rs_pipeline_init(struct rs_pipeline *pipeline,
+                     struct rs_server_state *server);
+void rs_pipeline_destroy(struct rs_pipeline *pipeline);
+
+/* Wake up the radio thread whenever fd (a radio device) is readable */
+void rs_pipeline_watch_fd(struct rs_pipeline *pipeline, int fd);
+
+int rs_pipeline_start(struct rs_pipeline *pipeline);
+/* Waits for the radio thread, which exits once server->running is cleared */
+void rs_pipeline_join(struct rs_pipeline *pipeline);
+
+/*
+ * Main thread: queue packet (ownership is transferred in any case) to be sent
+ * through rs_port_layer_transmit on the radio thread, with ts as for
+ * rs_port_layer_transmit. Returns negative values if the ring is full
+ */
+int rs_pipeline_transmit(struct rs_pipeline *pipeline, struct rs_packet *packet,
+                         rs_port_id_t port, const struct timespec *ts);
+
+/*
+ * Main thread: next received packet (owned by the caller), returns 0 if one
+ * has been placed in the args, RS_PORT_LAYER_EOF otherwise
+ */
+int rs_pipeline_receive(struct rs_pipeline *pipeline, struct rs_packet **packet,
+                        rs_port_id_t *port);
+
+/* fd of the main thread which is readable when packets were received */
+static inline int rs_pipeline_receive_fd(struct rs_pipeline *pipeline) {
+    return pipeline->rx.wakeup_fd;
+}
+
+/*
+ * Main thread: call before sleeping on rs_pipeline_receive_fd, returns nonzero
+ * if packets arrived in the meantime (do not sleep then). Call
+ * rs_pipeline_wait_end after sleeping
+ */
+int rs_pipeline_wait_begin(struct rs_pipeline *pipeline);
+void rs_pipeline_wait_end(struct rs_pipeline *pipeline);
+
+static inline void rs_pipeline_lock(struct rs_pipeline *pipeline) {
+    pthread_mutex_lock(&pipeline->lock);
+}
+
+static inline void rs_pipeline_unlock(struct rs_pipeline *pipeline) {
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef RS_POOL_H
+#define RS_POOL_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * Packet arena: fixed-size object pools for the packet structs of the layer
+ * stack and size-classed, reference-counted payload buffers.
+ *
+ * Objects are carved out of slabs which are kept for the lifetime of the
+ * process, freed objects go onto a free list. In steady state no call to
+ * malloc happens per packet, which can be checked with the counters (n_malloc
+ * only grows with new slabs and oversized buffers).
+ *
+ * Once rs_pools_share has been called (threaded mode, see rs_pipeline.h)
+ * pools are locked and buffer refcounts are atomic, as packets are allocated
+ * and freed on different threads.
+ */
+
+#define RS_POOL_OBJECTS_PER_SLAB 64
+
+struct rs_pool {
+    const char *title;
+    int object_size;
+    int objects_per_slab;
+
+    pthread_mutex_t lock;
+
+    void *free_list;
+    void **slabs;
+    int n_slabs;
+
+    /* counters */
+    long n_alloc;
+    long n_in_use;
+    long n_malloc;
+};
+
+enum {
+    RS_POOL_PACKET,
+    RS_POOL_CHANNEL_LAYER_PACKET,
+    RS_POOL_PORT_LAYER_PACKET,
+
+    /* Payload buffers, size classes 2KB (MTU), 16KB, 128KB, 1MB */
+    RS_POOL_BUFFER_0,
+    RS_POOL_BUFFER_1,
+    RS_POOL_BUFFER_2,
+    RS_POOL_BUFFER_3,
+
+    /* Not a pool - counts buffers which are too large for any size class */
+    RS_POOL_BUFFER_OVERSIZED,
+
+    RS_POOL_N
+};
+
+#define RS_POOL_BUFFER_MIN_SIZE 2048
+#define RS_POOL_BUFFER_CLASS_SHIFT 3
+
+extern struct rs_pool rs_pools[RS_POOL_N];
+extern int rs_pools_shared;
+
+/* Zero-initialized object */
+void *rs_pool_alloc(struct rs_pool *pool);
+void rs_pool_free(struct rs_pool *pool, void *object);
+void rs_pools_destroy();
+
+/* Has to be called before a second thread uses the pools */
+void rs_pools_share();
+
+struct rs_buffer {
+    int refcount;
+    int size;
+    int pool;
+
+    uint8_t data[] __attribute__((aligned(16)));
+};
+
+/* New buffer with at least size bytes of (uninitialized) data and refcount 1 */
+struct rs_buffer *rs_buffer_new(int size);
+
+static inline struct rs_buffer *rs_buffer_ref(struct rs_buffer *buffer) {
+    if (rs_pools_shared)
+        __atomic_add_fetch(&buffer->refcount, 1, __ATOMIC_RELAXED);
+    else
+        buffer->refcount++;
+    return buffer;
+}
+
+void rs_buffer_unref(struct rs_buffer *buffer);
+
+#endif
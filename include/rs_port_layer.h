@@ -9,8 +9,24 @@
 #include "rs_channel_layer.h"
 #include "rs_packet.h"
 #include "rs_stat.h"
+#include "rs_timer.h"
 
 #define RS_PORT_LAYER_EOF 1
+#define RS_PORT_LAYER_EXPIRED -2
+
+/* Bound by rs_port_layer_frag_t */
+#define RS_PORT_LAYER_MAX_FRAGMENTS 255
+
+/* Bound by rs_port_id_t */
+#define RS_PORT_LAYER_N_IDS 256
+
+/*
+ * rs_port_layer_receive drains every distinct bound channel once per pass
+ * (until rs_port_layer_receive returns RS_PORT_LAYER_EOF), with at most
+ * RS_PORT_RX_BATCH channel layer packets per channel, which are received
+ * RS_CHANNEL_LAYER_BATCH at a time
+ */
+#define RS_PORT_RX_BATCH 64
 
 typedef uint8_t rs_port_id_t;
 
@@ -26,6 +42,43 @@ struct rs_port_layer {
 
     struct rs_port **ports;
     int n_ports;
+
+    /* NULL for unknown ids */
+    struct rs_port *ports_by_id[RS_PORT_LAYER_N_IDS];
+
+    /* Receive pass: channel drained at rx_channel_at (-1 between passes) */
+    rs_channel_t *rx_channels;
+    int n_rx_channels;
+    int rx_channel_at;
+    int rx_budget;
+    int rx_error;
+    /* a channel of the last pass was left with its budget used up */
+    int rx_pending;
+
+    /* One per channel used by an aggregating port */
+    struct rs_port_aggregate *tx_aggregates;
+    int n_tx_aggregates;
+
+    /* Received aggregate, the packets in it not yet handled start at next */
+    struct {
+        struct rs_buffer *buf;
+        uint8_t *next;
+        int left;
+        rs_channel_t channel;
+    } rx_aggregate;
+
+    /* Last channel layer receive batch, handled up to at before the channel
+     * layer receives again (payloads may be borrowed) */
+    struct {
+        struct rs_packet *packets[RS_CHANNEL_LAYER_BATCH];
+        rs_channel_t channels[RS_CHANNEL_LAYER_BATCH];
+        int n;
+        int at;
+    } rx_batch;
+
+    /* config tx_schedule, index of the port to start the next round at */
+    int tx_schedule;
+    int tx_schedule_rr;
 };
 
 void rs_port_layer_init(struct rs_port_layer *layer,
@@ -38,9 +91,20 @@ void rs_port_layer_destroy(struct rs_port_layer *layer);
 
 /*
  * Positive value indicates success, returns number of bytes
+ * RS_PORT_LAYER_EXPIRED: the latency budget of the port has passed since ts
+ * (when the frame became available, NULL for now), the rest of the frame has
+ * been dropped
  */
 int rs_port_layer_transmit(struct rs_port_layer *layer,
-                           struct rs_packet *packet, rs_port_id_t port);
+                           struct rs_packet *packet, rs_port_id_t port,
+                           const struct timespec *ts);
+
+/*
+ * Hand frames queued by rs_port_layer_transmit (tx_schedule) to the channel
+ * layers as far as the rate caps allow. Called after each batch, e.g. one
+ * frame per app connection, and from rs_port_layer_main
+ */
+void rs_port_layer_flush(struct rs_port_layer *layer);
 
 /*
  * (*port) is only set, not read
@@ -58,10 +122,22 @@ int rs_port_layer_receive(struct rs_port_layer *layer,
 void rs_port_layer_main(struct rs_port_layer *layer,
                         struct rs_port_layer_packet *received);
 
+/*
+ * Milliseconds until the port layer has work without new input (aggregates
+ * to flush, queued fragments, packets left by the last receive pass), -1 if
+ * there is none
+ */
+int rs_port_layer_timeout(struct rs_port_layer *layer);
+
 void rs_port_layer_stats_printf(struct rs_port_layer *layer);
 
 int rs_port_layer_switch_channel(struct rs_port_layer *layer, rs_port_id_t port,
                                  rs_channel_t new_channel);
+
+/*
+ * Set a fixed FEC factor on an owned port, which disables adaptive FEC
+ * (fec_adaptive) on it until restart
+ */
 int rs_port_layer_update_port(struct rs_port_layer *layer, rs_port_id_t port,
                               double fec_factor);
 
@@ -77,11 +153,155 @@ int rs_port_layer_update_port(struct rs_port_layer *layer, rs_port_id_t port,
 
 #define RS_PORT_CMD_MARKER_ROUTED 0x12
 
+/* Interval at which stats are published in the compact header format */
+#define RS_PORT_STATS_MSEC 100
+
+/*
+ * Reassembly window: number of FEC blocks (by seq) reassembled concurrently
+ * per port, and cap on the fragment bytes held
+ */
+#define RS_PORT_REASSEMBLY_WINDOW 4
+#define RS_PORT_REASSEMBLY_WINDOW_MAX 64
+#define RS_PORT_REASSEMBLY_MEMORY (4 << 20)
+
+/*
+ * Cross-frame FEC: up to group_frames consecutive frames (each fitting into
+ * one packet) form one FEC block, closed after group_latency_ms at the latest
+ * (checked in rs_port_layer_main). Frames are sent on their own while the
+ * other side has not announced RS_CHANNEL_CAP_GROUP
+ */
+#define RS_PORT_GROUP_MAX_FRAMES 64
+#define RS_PORT_GROUP_LATENCY_MSEC 50
+
+/*
+ * Adaptive FEC (config fec_adaptive): every RS_PORT_FEC_CONTROL_MSEC the
+ * smallest factor in [fec_min, fec_max] (steps of RS_PORT_FEC_CONTROL_STEP)
+ * is chosen for which independent losses at the fragment loss rate reported
+ * by the peer leave at most fec_target_loss of the blocks undecodable. The
+ * loss rate is scaled by a burst multiplier, raised while the frame loss
+ * reported by the peer exceeds the target and relaxed while it is well below.
+ * The factor rises at once and falls by one step per interval. A factor set by
+ * rs_port_layer_update_port disables the controller
+ */
+#define RS_PORT_FEC_CONTROL_MSEC RS_STAT_DT_MSEC
+#define RS_PORT_FEC_CONTROL_STEP 0.05
+#define RS_PORT_FEC_MIN 1.
+#define RS_PORT_FEC_MAX 3.
+#define RS_PORT_FEC_TARGET_LOSS 0.001
+#define RS_PORT_FEC_BURST_MAX 8.
+
+/*
+ * Rate adaptation (config rate_adaptive, owning ports only): every
+ * RS_PORT_RATE_CONTROL_MSEC the bound channel is stepped down (see
+ * rs_channel_layer_rate_step) once the fragment loss reported by the peer
+ * stayed above RS_PORT_RATE_LOSS_DOWN for RS_PORT_RATE_DOWN_N intervals, and
+ * probed one step up if loss is below RS_PORT_RATE_LOSS_UP while injecting
+ * keeps the channel busy (tx_stat_dt) for more than RS_PORT_RATE_BUSY of the
+ * time. A probe is reverted if loss rises or the throughput received by the
+ * peer drops, and the probe interval doubles up to RS_PORT_RATE_PROBE_MAX_MSEC.
+ * Nothing is decided for RS_PORT_RATE_SETTLE_MSEC after a switch
+ */
+#define RS_PORT_RATE_CONTROL_MSEC RS_STAT_DT_MSEC
+#define RS_PORT_RATE_SETTLE_MSEC                                               \
+    (RS_PORT_CMD_SWITCH_N_BROADCAST * RS_PORT_CMD_SWITCH_DT_BROADCAST_MSEC +  \
+     2 * RS_STAT_DT_MSEC)
+#define RS_PORT_RATE_PROBE_MSEC 5000
+#define RS_PORT_RATE_PROBE_MAX_MSEC 60000
+#define RS_PORT_RATE_LOSS_UP 0.02
+#define RS_PORT_RATE_LOSS_DOWN 0.15
+#define RS_PORT_RATE_DOWN_N 2
+#define RS_PORT_RATE_BUSY 0.5
+
+/*
+ * Aggregation (config aggregate_ms): packets of the port are collected per
+ * channel into one channel layer packet of up to max_packet_size plus one full
+ * port layer header, sent once the next one does not fit or aggregate_ms after
+ * the first one (checked in rs_port_layer_main). Packets of other ports to the
+ * same channel take the pending ones along
+ */
+#define RS_PORT_AGGREGATE_MAX_MSEC 1000
+
+/*
+ * Latency budget (config latency_ms): frames are dropped by the sender once
+ * latency_ms have passed since they became available, also between their
+ * fragments. The receiver abandons incomplete blocks latency_ms after their
+ * first fragment arrived
+ */
+#define RS_PORT_LATENCY_MAX_MSEC 10000
+
+/*
+ * TX scheduler (config tx_schedule): fragments of data frames are queued per
+ * port and sent by rs_port_layer_flush. Ports of higher priority are served
+ * first, ports of equal priority share in proportion to their weight (deficit
+ * round robin with weight * RS_PORT_SCHED_QUANTUM bytes per round), so the
+ * fragments of different ports are interleaved. rate_kbps caps a port by a
+ * token bucket holding RS_PORT_SCHED_BURST_MSEC worth of bytes. The oldest
+ * fragments are dropped once a queue exceeds queue_memory. Commands are sent
+ * right away
+ */
+#define RS_PORT_SCHED_QUANTUM 1500
+#define RS_PORT_SCHED_BURST_MSEC 20
+#define RS_PORT_SCHED_QUEUE_MEMORY (2 << 20)
+
+struct rs_port_sched_entry {
+    struct rs_port_layer_packet *fragment;
+    int len;
+    int has_deadline;
+    struct timespec deadline;
+};
+
+struct rs_port_aggregate {
+    rs_channel_t channel;
+
+    /* RS_PACKET_HEADROOM, marker, packets */
+    struct rs_buffer *buf;
+    int size;
+    int len;
+    int n;
+    struct timespec deadline;
+};
+
+struct rs_port_reassembly_block {
+    rs_port_layer_seq_t seq;
+    enum {
+        RS_PORT_BLOCK_FREE,
+        RS_PORT_BLOCK_INCOMPLETE,
+        /* joined, waiting for delivery */
+        RS_PORT_BLOCK_READY,
+        /* delivered or dropped, late fragments are ignored */
+        RS_PORT_BLOCK_DONE
+    } state;
+
+    int n_frag_decoded;
+    int n_frag_encoded;
+    int n_frag_received;
+    int bytes;
+
+    /* Arrival of the first fragment */
+    struct timespec first_ts;
+
+    /* Bitmap over frag */
+    uint64_t received[(RS_PORT_LAYER_MAX_FRAGMENTS + 63) / 64];
+    struct rs_port_layer_packet *fragments[RS_PORT_LAYER_MAX_FRAGMENTS];
+
+    /* Segmented frames: fragments are those of the segment currently
+     * reassembled, the ones before it are joined in segments */
+    int segment;
+    int n_segments;
+    struct rs_port_layer_packet **segments;
+
+    struct rs_port_layer_packet *joined;
+};
+
 struct rs_port {
     rs_port_id_t id;
     int owner;
 
     struct timespec tx_last_ts;
+    struct timespec tx_stats_last_ts;
+
+    /* Heartbeat once tx_last_ts is RS_PORT_CMD_HEARTBEAT_MSEC old */
+    struct rs_timer heartbeat_timer;
 
     rs_port_layer_seq_t tx_last_seq;
     rs_port_layer_seq_t rx_last_seq;
@@ -92,14 +312,106 @@ struct rs_port {
     struct rs_stat tx_stats_fec_factor;
     struct rs_stat rx_stats_fec_factor;
 
+    /* Fragments dropped as they do not fit their block, logged once */
+    struct rs_stat rx_stats_invalid;
+    int rx_invalid_logged;
+
+    /* Header bytes per fragment (port and channel layer), actually sent and
+     * as they would have been with the full format */
+    struct rs_stat tx_stats_header;
+    struct rs_stat tx_stats_header_full;
+
     struct {
+        /*
+         * latest: deliver blocks as soon as they are complete, blocks older
+         * than the last delivered one are dropped
+         * in_order: hold complete blocks until all older blocks in the window
+         * are delivered or evicted
+         */
+        enum {
+            RS_PORT_DELIVER_LATEST,
+            RS_PORT_DELIVER_IN_ORDER
+        } order;
+
+        /* Block for seq lives at blocks[seq % n_blocks] */
+        int n_blocks;
+        struct rs_port_reassembly_block *blocks;
+
+        long memory;
+        long memory_max;
+
+        int has_delivered;
+        rs_port_layer_seq_t delivered_seq;
+    } reassembly;
+
+    struct {
+        /* 0 if disabled */
+        int max_k;
+        int latency_msec;
+
+        /* Open group */
+        int k;
+        int block_len;
         rs_port_layer_seq_t seq;
-        int n_frag;
-        int n_frag_received;
-        struct rs_port_layer_packet **fragments;
-    } frag_buffer;
+        struct timespec opened;
+        /* Closes the group after latency_msec */
+        struct rs_timer timer;
+        struct rs_buffer *blocks[RS_PORT_GROUP_MAX_FRAMES];
+        int block_lens[RS_PORT_GROUP_MAX_FRAMES];
+    } group;
+
+    /* 0 if disabled */
+    int aggregate_msec;
+
+    /* 0 if disabled */
+    int latency_msec;
+
+    struct {
+        int priority;
+        int weight;
+
+        /* 0 if uncapped */
+        int rate_kbps;
+        double tokens;
+        struct timespec refill_ts;
+
+        long deficit;
+
+        /* Ring of queued fragments */
+        struct rs_port_sched_entry *queue;
+        int queue_size;
+        int queue_at;
+        int queue_n;
+        long bytes;
+        long bytes_max;
+    } sched;
 
     double tx_target_fec_factor;
+
+    struct {
+        /* 0 if disabled, tx_target_fec_factor is set by the controller */
+        int enabled;
+        double min_factor;
+        double max_factor;
+        double target_loss;
+
+        double burst;
+        struct rs_timer timer;
+    } fec_control;
+
+    struct {
+        int enabled;
+        int probe_msec;
+        struct rs_timer timer;
+        struct timespec switched_ts;
+        int n_bad;
+
+        /* Last switch was a step up from probe_from */
+        int probing;
+        rs_channel_t probe_from;
+        double probe_goodput;
+    } rate_control;
+
     unsigned short tx_fec_m;
     unsigned short tx_fec_k;
     fec_t *tx_fec;
@@ -131,6 +443,8 @@ struct rs_port {
         struct timespec at;
         int n_broadcasts;
         rs_channel_t new_channel;
+        /* Next broadcast or end of the switch */
+        struct rs_timer timer;
     } cmd_switch_state;
 };
 
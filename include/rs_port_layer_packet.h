@@ -9,11 +9,80 @@
 typedef uint16_t rs_port_layer_seq_t;
 typedef uint8_t rs_port_layer_frag_t;
 
+/*
+ * Header: command (1), port (1), seq (2), payload_len (4), frag (1),
+ * n_frag_decoded (1), n_frag_encoded (1), stats (RS_STATS_PACKED_LEN), all
+ * big-endian, followed by command_payload if command != 0
+ *
+ * The most significant byte of payload_len (payloads stay far below 2^24
+ * bytes) holds flags, with the bits of the compact format:
+ *  - RS_PORT_LAYER_COMPACT_SEGMENT: segment (1), n_segments (1) follow stats
+ *  - RS_PORT_LAYER_COMPACT_XOR: XOR parity (see below)
+ *  - RS_PORT_LAYER_COMPACT_GROUP: fragment of a cross-frame group
+ * A flag is only set if the other side announced the capability of the
+ * feature, towards older peers the header is unchanged
+ */
+#define RS_PORT_LAYER_PACKET_HEADER_LEN                                        \
+    (1 + 1 + 2 + 4 + 3 + RS_STATS_PACKED_LEN)
+
+/*
+ * Compact header (used if the channel negotiated the compact format):
+ * RS_PORT_LAYER_PACKET_COMPACT_MARKER (1) in place of command, flags (1),
+ * port (1), seq (2), then depending on flags
+ *  - RS_PORT_LAYER_COMPACT_COMMAND: command (1), command_payload
+ *  - RS_PORT_LAYER_COMPACT_FRAG: frag (1), n_frag_decoded (1),
+ *    n_frag_encoded (1)
+ *  - RS_PORT_LAYER_COMPACT_PAYLOAD_LEN: payload_len (varint)
+ *  - RS_PORT_LAYER_COMPACT_STATS: stats (RS_STATS_PACKED_LEN)
+ *  - RS_PORT_LAYER_COMPACT_SEGMENT: segment (1), n_segments (1)
+ *  - RS_PORT_LAYER_COMPACT_XOR: no field, the single parity fragment of the
+ *    block (m = k + 1) is the XOR of the primary ones instead of zfec's code
+ *    row. Only used if the other side announced RS_CHANNEL_CAP_XOR
+ *  - RS_PORT_LAYER_COMPACT_GROUP: no field, fragment of a cross-frame group
+ *
+ * Unfragmented packets derive payload_len from their length. payload_len and
+ * stats are needed once per packet and only sent on fragments
+ * frag <= n_frag_encoded - n_frag_decoded, as any n_frag_decoded fragments
+ * include at least one of those
+ */
+#define RS_PORT_LAYER_PACKET_COMPACT_MARKER 0xE1
+#define RS_PORT_LAYER_PACKET_COMPACT_LEN 5
+
+#define RS_PORT_LAYER_COMPACT_COMMAND 0x01
+#define RS_PORT_LAYER_COMPACT_FRAG 0x02
+#define RS_PORT_LAYER_COMPACT_PAYLOAD_LEN 0x04
+#define RS_PORT_LAYER_COMPACT_STATS 0x08
+#define RS_PORT_LAYER_COMPACT_SEGMENT 0x10
+#define RS_PORT_LAYER_COMPACT_XOR 0x20
+#define RS_PORT_LAYER_COMPACT_GROUP 0x40
+
+/*
+ * Aggregate: RS_PORT_LAYER_PACKET_AGGREGATE_MARKER (1) in place of command,
+ * followed by complete port layer packets (of any port), each prefixed by its
+ * length (varint). Only sent if the other side announced
+ * RS_CHANNEL_CAP_AGGREGATE, a single packet is sent without the framing
+ */
+#define RS_PORT_LAYER_PACKET_AGGREGATE_MARKER 0xA6
+
+/*
+ * Frames which need more than RS_PORT_LAYER_MAX_FRAGMENTS fragments are cut
+ * into n_segments independent FEC blocks of (almost) equal size, sent one
+ * after the other under the seq of the frame. payload_len is the length of
+ * the segment
+ *
+ * Only if the other side announced RS_CHANNEL_CAP_SEGMENT, otherwise frames
+ * which do not fit into RS_PORT_LAYER_MAX_FRAGMENTS fragments are refused and
+ * parity is reduced to fit
+ */
+#define RS_PORT_LAYER_MAX_SEGMENTS 255
+
 struct rs_port_layer_packet {
     struct rs_packet super;
 
     rs_port_id_t port;
     uint8_t command;
+
+    /* 0 on fragments of the compact format which do not carry it */
     uint32_t payload_len;
 
     /* Relevant for fragmented transmit */
@@ -22,6 +91,19 @@ struct rs_port_layer_packet {
     rs_port_layer_frag_t n_frag_decoded; /* equals FEC k */
     rs_port_layer_frag_t n_frag_encoded; /* equals FEC m */
 
+    /* Parity of the block is rs_fec_xor */
+    uint8_t xor_parity;
+
+    /* Relevant for segmented transmit */
+    uint8_t segment;
+    uint8_t n_segments;
+
+    /* Fragment of a cross-frame group, or frame recovered from one */
+    uint8_t group;
+
+    /* Compact format may omit stats */
+    uint8_t compact;
+    uint8_t has_stats;
     struct rs_stats_packed stats;
 
     /* Only if command != 0 */
@@ -29,20 +111,82 @@ struct rs_port_layer_packet {
 };
 
 void rs_port_layer_packet_init(struct rs_port_layer_packet *packet,
-                               void *payload_ownership,
+                               struct rs_buffer *payload_ownership,
                                struct rs_packet *payload_packet,
                                uint8_t *payload_data, int payload_data_len);
 int rs_port_layer_packet_unpack(struct rs_port_layer_packet *packet,
                                 struct rs_packet *from_packet);
 
+/* Sets command and the header length depending on it */
+void rs_port_layer_packet_set_command(struct rs_port_layer_packet *packet,
+                                      uint8_t command);
+
+/*
+ * Select header format, needs to be called once command and frag fields are
+ * set
+ */
+void rs_port_layer_packet_set_format(struct rs_port_layer_packet *packet,
+                                     int compact, int has_stats);
+
+/*
+ * split needs to provide space for RS_PORT_LAYER_MAX_FRAGMENTS packets,
+ * returns the number of fragments placed in split. All fragments share a
+ * reference on one encode buffer and have RS_PACKET_HEADROOM. If no splitting
+ * is necessary, split[0] is packet. xor_parity: the other side decodes XOR
+ * parity, used for m = k + 1. Returns 0 on errors, also if packet needs more
+ * than RS_PORT_LAYER_MAX_FRAGMENTS fragments
+ */
 int rs_port_layer_packet_split(struct rs_port_layer_packet *packet,
                                struct rs_port *port,
-                               struct rs_port_layer_packet ***split,
-                               int max_size_per_packet,
-                               double fec_factor);
+                               struct rs_port_layer_packet **split,
+                               int max_size_per_packet, double fec_factor,
+                               int xor_parity);
 
+/*
+ * Reassemble from at least n_frag_decoded fragments (with owned payload).
+ * Only missing primary blocks are decoded, the payload of joined is scattered
+ * over the fragments (payload_iov) and holds references on their buffers
+ */
 int rs_port_layer_packet_join(struct rs_port_layer_packet *joined,
                               struct rs_port *port,
                               struct rs_port_layer_packet **split, int n_split);
 
+/*
+ * Concatenate the joined segments of a frame into joined (scattered), which
+ * takes its own references on the segment buffers
+ */
+int rs_port_layer_packet_join_segments(struct rs_port_layer_packet *joined,
+                                       struct rs_port_layer_packet **segments,
+                                       int n_segments);
+
+/*
+ * Cross-frame groups: every primary block is one frame, prefixed by its
+ * length (RS_PORT_LAYER_GROUP_LEN_PREFIX bytes), and sent on its own as soon
+ * as the frame is available (n_frag_encoded = 0, n_frag_decoded = frag + 1).
+ * Once the group is closed, parity blocks over the zero padded primary blocks
+ * follow with the final k and m. All fragments are marked with
+ * RS_PORT_LAYER_COMPACT_GROUP (in either format), groups are only sent if the
+ * other side announced RS_CHANNEL_CAP_GROUP
+ */
+#define RS_PORT_LAYER_GROUP_LEN_PREFIX 2
+
+/*
+ * Recover the missing frames of a group from at least k fragments, including
+ * a parity fragment. joined only contains the recovered frames
+ */
+int rs_port_layer_packet_join_group(struct rs_port_layer_packet *joined,
+                                    struct rs_port *port,
+                                    struct rs_port_layer_packet **split,
+                                    int n_split, int k, int m);
+
+/* Pooled allocation, rs_port_layer_packet_free does not destroy */
+static inline struct rs_port_layer_packet *rs_port_layer_packet_alloc() {
+    return rs_pool_alloc(&rs_pools[RS_POOL_PORT_LAYER_PACKET]);
+}
+
+static inline void
+rs_port_layer_packet_free(struct rs_port_layer_packet *packet) {
+    rs_pool_free(&rs_pools[RS_POOL_PORT_LAYER_PACKET], packet);
+}
+
 #endif
@@ -3,25 +3,39 @@
 
 #include <libconfig.h>
 #include <stdint.h>
+#include <sys/epoll.h>
 
 #include "rs_stat.h"
 #include "rs_channel_layer.h"
+#include "rs_timer.h"
 
 struct rs_command_loop;
 struct rs_port_layer;
 struct rs_app_layer;
+struct rs_pipeline;
 
 /* "MAC" adress */
 typedef uint16_t rs_server_id_t;
 
-#define MAIN_LOOP_US_MIN 200
-#define MAIN_LOOP_US_MAX 100000
+/*
+ * The main loop sleeps in epoll_wait until a watched fd (radio devices, TCP
+ * and command sockets) is readable, a layer deadline is due or at most
+ * MAIN_LOOP_TIMEOUT_MSEC (channel / port layer housekeeping) have passed.
+ * Periodic work (heartbeats, switch broadcasts, control loops) is driven by
+ * timers, advanced by the thread running the port and channel layers
+ */
+#define MAIN_LOOP_TIMEOUT_MSEC 10
+#define MAIN_LOOP_MAX_EVENTS 16
 
 struct rs_server_state {
     int running;
 
+    /* share of time spent outside of epoll_wait */
     double usage;
-    int main_loop_us;
+
+    int epoll_fd;
+
+    struct rs_timer_wheel timers;
 
     config_t config;
 
@@ -34,6 +48,9 @@ struct rs_server_state {
     int n_channel_layers;
     struct rs_port_layer *port_layer;
     struct rs_app_layer *app_layer;
+
+    /* threaded mode (config threads), NULL otherwise */
+    struct rs_pipeline *pipeline;
 };
 
 inline struct rs_channel_layer *
@@ -48,4 +65,18 @@ rs_server_channel_layer_for_channel(struct rs_server_state *server,
     return NULL;
 }
 
+/* Wake up the main loop whenever fd is readable */
+static inline void rs_server_watch_fd(struct rs_server_state *server, int fd) {
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = fd};
+    if (server->epoll_fd >= 0 && fd >= 0)
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/* Has to be called before fd is closed */
+static inline void rs_server_unwatch_fd(struct rs_server_state *server,
+                                        int fd) {
+    if (server->epoll_fd >= 0 && fd >= 0)
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
 #endif
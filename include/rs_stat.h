@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <time.h>
 
+#include "rs_util.h"
+
 #define RS_STAT_N 10
 #define RS_STAT_DT_MSEC 500
 
@@ -70,6 +72,8 @@ struct rs_stats_packed {
     uint16_t rx_missed; /* normalized to 10000 */
 };
 
+#define RS_STATS_PACKED_LEN 6
+
 void rs_stats_packed_init(struct rs_stats_packed *packed,
                           struct rs_stats *from);
 int rs_stats_packed_len(struct rs_stats_packed *packed);
@@ -78,4 +82,19 @@ int rs_stats_packed_pack(struct rs_stats_packed *packed, uint8_t **buffer,
 int rs_stats_packed_unpack(struct rs_stats_packed *unpacked, uint8_t **buffer,
                            int *buffer_len);
 
+/* Fixed-layout variants without bounds check (RS_STATS_PACKED_LEN bytes) */
+static inline void rs_stats_packed_store(struct rs_stats_packed *packed,
+                                         uint8_t *buffer) {
+    rs_store_be16(buffer, packed->tx_bits);
+    rs_store_be16(buffer + 2, packed->rx_bits);
+    rs_store_be16(buffer + 4, packed->rx_missed);
+}
+
+static inline void rs_stats_packed_load(struct rs_stats_packed *unpacked,
+                                        const uint8_t *buffer) {
+    unpacked->tx_bits = rs_load_be16(buffer);
+    unpacked->rx_bits = rs_load_be16(buffer + 2);
+    unpacked->rx_missed = rs_load_be16(buffer + 4);
+}
+
 #endif
@@ -0,0 +1,83 @@
+#ifndef RS_TIMER_H
+#define RS_TIMER_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "rs_util.h"
+
+/*
+ * Hierarchical timer wheel with millisecond ticks on CLOCK_MONOTONIC (the
+ * time of the current loop iteration, see rs_clock_now).
+ *
+ * Layers register deadlines (heartbeats, switch broadcasts, control loops,
+ * group latencies) instead of scanning all channels and ports on every loop.
+ * Level l has RS_TIMER_WHEEL_SLOTS slots of RS_TIMER_WHEEL_SLOTS^l ticks,
+ * timers are cascaded down a level whenever the level below wraps, so that
+ * advancing the wheel only touches the slots of elapsed ticks and the timers
+ * in there. Deadlines further out than the wheel spans are clamped.
+ *
+ * A wheel is used by a single thread (the one running the port and channel
+ * layers), timers may be (re)scheduled or cancelled from within callbacks.
+ */
+#define RS_TIMER_WHEEL_BITS 6
+#define RS_TIMER_WHEEL_SLOTS (1 << RS_TIMER_WHEEL_BITS)
+#define RS_TIMER_WHEEL_LEVELS 4
+
+struct rs_timer;
+
+typedef void (*rs_timer_callback_t)(struct rs_timer *timer, void *arg);
+
+struct rs_timer {
+    /* Intrusive list of the slot, pprev == NULL if not scheduled */
+    struct rs_timer *next;
+    struct rs_timer **pprev;
+
+    /* tick (msec) at which the timer fires */
+    uint64_t expires;
+
+    rs_timer_callback_t callback;
+    void *arg;
+};
+
+struct rs_timer_wheel {
+    /* next tick to be processed, all earlier ones are done */
+    uint64_t tick;
+    int n_scheduled;
+
+    struct rs_timer *slots[RS_TIMER_WHEEL_LEVELS][RS_TIMER_WHEEL_SLOTS];
+};
+
+static inline uint64_t rs_timer_now_msec() {
+    struct timespec ts;
+    rs_clock_now(&ts);
+    return (uint64_t)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000L;
+}
+
+void rs_timer_wheel_init(struct rs_timer_wheel *wheel);
+
+/* Fire all timers which expired up to now */
+void rs_timer_wheel_advance(struct rs_timer_wheel *wheel);
+
+/*
+ * Milliseconds until the next timer may fire (never later than it does), -1
+ * if none is scheduled. Used as epoll timeout
+ */
+int rs_timer_wheel_timeout(struct rs_timer_wheel *wheel);
+
+void rs_timer_init(struct rs_timer *timer, rs_timer_callback_t callback,
+                   void *arg);
+
+/* Fire timer msec from now (0: on the next advance), reschedules if the timer
+ * is already scheduled */
+void rs_timer_schedule(struct rs_timer_wheel *wheel, struct rs_timer *timer,
+                       long msec);
+
+/* No-op if the timer is not scheduled */
+void rs_timer_cancel(struct rs_timer_wheel *wheel, struct rs_timer *timer);
+
+static inline int rs_timer_scheduled(struct rs_timer *timer) {
+    return timer->pprev != NULL;
+}
+
+#endif
@@ -3,8 +3,10 @@
 
 // #define __NO_TIMER__
 
-#include <time.h>
+#include <endian.h>
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
 
 #define rs_offset_of(_struct_, _member_)                                       \
     (size_t) & (((struct _struct_ *)0)->_member_)
@@ -14,6 +16,37 @@
     ((struct _subclass_ *)((unsigned char *)(_superclass_pt_)-rs_offset_of(    \
         _subclass_, super)))
 
+#define rs_container_of(_struct_, _member_, _member_pt_)                       \
+    ((struct _struct_ *)((unsigned char *)(_member_pt_)-rs_offset_of(          \
+        _struct_, _member_)))
+
+/*
+ * Time source on CLOCK_MONOTONIC, so that timing is not affected by steps of
+ * the wall clock. Event loops sample the clock once per iteration with
+ * rs_clock_update, rs_clock_now returns that sample on the same thread instead
+ * of reading the clock for every packet and stat (threads which never call
+ * rs_clock_update read the clock). rs_clock_precise always reads the clock,
+ * e.g. to measure how long an inject takes
+ */
+extern __thread struct timespec rs_clock_cached;
+extern __thread int rs_clock_cached_valid;
+
+static inline void rs_clock_precise(struct timespec *ts) {
+    clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static inline void rs_clock_update() {
+    rs_clock_precise(&rs_clock_cached);
+    rs_clock_cached_valid = 1;
+}
+
+static inline void rs_clock_now(struct timespec *ts) {
+    if (rs_clock_cached_valid)
+        *ts = rs_clock_cached;
+    else
+        rs_clock_precise(ts);
+}
+
 inline long msec_diff(struct timespec t1, struct timespec t2){
     return (t1.tv_sec - t2.tv_sec) * 1000L + (t1.tv_nsec - t2.tv_nsec) / 1000000L;
 }
@@ -21,7 +54,7 @@ inline long msec_diff(struct timespec t1, struct timespec t2){
 /* Two LSB of timestamp in millis */
 inline uint16_t cur_msec(){
     struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
     return (ts.tv_nsec / 1000000L) + (ts.tv_sec * 1000L);
 }
 
@@ -33,6 +66,64 @@ inline void timespec_plus_ms(struct timespec* in, double ms){
 }
 
 
+/*
+ * Unaligned big-endian loads / stores for fixed-layout headers, bounds are
+ * checked once per header by the caller
+ */
+static inline void rs_store_be16(uint8_t *p, uint16_t v) {
+    v = htobe16(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline void rs_store_be32(uint8_t *p, uint32_t v) {
+    v = htobe32(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline uint16_t rs_load_be16(const uint8_t *p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return be16toh(v);
+}
+
+static inline uint32_t rs_load_be32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return be32toh(v);
+}
+
+/* LEB128 varint, at most 5 bytes for 32 bits */
+static inline int rs_varint_len(uint32_t v) {
+    int len = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        len++;
+    }
+    return len;
+}
+
+static inline int rs_store_varint(uint8_t *p, uint32_t v) {
+    int len = 0;
+    while (v >= 0x80) {
+        p[len++] = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    p[len++] = (uint8_t)v;
+    return len;
+}
+
+/* Returns number of bytes read, -1 if p_len is exceeded */
+static inline int rs_load_varint(const uint8_t *p, int p_len, uint32_t *v) {
+    *v = 0;
+    for (int i = 0; i < p_len && i < 5; i++) {
+        *v |= (uint32_t)(p[i] & 0x7F) << (7 * i);
+        if (!(p[i] & 0x80))
+            return i + 1;
+    }
+    return -1;
+}
+
+/* Byte-wise variable length fields */
 #define PACK(buffer, buffer_len, type, val) \
     if (*buffer_len < sizeof(type)) \
         goto pack_err; \
@@ -52,19 +143,6 @@ inline void timespec_plus_ms(struct timespec* in, double ms){
         (*buffer_len)--; \
     }
 
-#define EVERY(EVNAME, EVMS) \
-    static struct timespec EVERY_ ## EVNAME ## _last; \
-    static int EVERY_ ## EVNAME ## _last_initialized = 0; \
-    if(!EVERY_ ## EVNAME ## _last_initialized){ \
-        clock_gettime(CLOCK_REALTIME, &EVERY_ ## EVNAME ## _last); \
-        EVERY_ ## EVNAME ## _last_initialized = 1; \
-    } \
-    struct timespec EVERY_ ## EVNAME ## _cur; \
-    clock_gettime(CLOCK_REALTIME, &EVERY_ ## EVNAME ## _cur); \
-    int EVERY_ ## EVNAME ## _now = (msec_diff(EVERY_ ## EVNAME ## _cur, EVERY_ ## EVNAME ## _last) > EVMS); \
-    if(EVERY_ ## EVNAME ## _now) EVERY_ ## EVNAME ## _last = EVERY_ ## EVNAME ## _cur; \
-    if(EVERY_ ## EVNAME ## _now)
-
 #ifdef __NO_TIMER__
 
 #define TIMER_START(TNAME) ;
@@ -81,17 +159,17 @@ inline void timespec_plus_ms(struct timespec* in, double ms){
     static int TIMER_ ## TNAME ## _n_agg = 0; \
     static long long int TIMER_ ## TNAME ## _nsec_agg = 0; \
     static int TIMER_ ## TNAME ## _bytes_through_agg = 0; \
-    clock_gettime(CLOCK_REALTIME, &TIMER_ ## TNAME ## _start);
+    rs_clock_precise(&TIMER_ ## TNAME ## _start);
 
 #define TIMER_STOP(TNAME, TBYTES) \
-    clock_gettime(CLOCK_REALTIME, &TIMER_ ## TNAME ## _end); \
+    rs_clock_precise(&TIMER_ ## TNAME ## _end); \
     TIMER_ ## TNAME ## _n_agg++; \
     TIMER_ ## TNAME ## _bytes_through_agg+=TBYTES; \
     TIMER_ ## TNAME ## _nsec_agg += TIMER_ ## TNAME ## _end.tv_nsec - TIMER_ ## TNAME ## _start.tv_nsec; \
     TIMER_ ## TNAME ## _nsec_agg += 1000000000 * (TIMER_ ## TNAME ## _end.tv_sec - TIMER_ ## TNAME ## _start.tv_sec);
 
 #define TIMER_PRINT(TNAME, TFREQ) \
-    clock_gettime(CLOCK_REALTIME, &TIMER_ ## TNAME ## _print); \
+    rs_clock_now(&TIMER_ ## TNAME ## _print); \
     if(msec_diff(TIMER_ ## TNAME ## _print, TIMER_ ## TNAME ## _last_print) > 1000. / TFREQ){ \
         syslog(LOG_DEBUG, "TIMER[%s]: %fms, %5.2fMbps\n", #TNAME, \
                 (double)TIMER_ ## TNAME ## _nsec_agg / TIMER_ ## TNAME ## _n_agg / 1000000., \
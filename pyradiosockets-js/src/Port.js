@@ -44,6 +44,7 @@ export default (props) => {
             <h2>bound to channel C{props.report.bound}</h2>
                 <h2>FEC factor TX: {Math.round(props.report.stats[props.report.stats.length - 1].tx_fec_factor * 100)/100.} / RX {Math.round(props.report.stats[props.report.stats.length - 1].rx_fec_factor*100)/100} </h2>
                 <h2>Packet size TX: {Math.round(props.report.stats[props.report.stats.length - 1].tx_bits_packet_size / 8)}b / RX {Math.round(props.report.stats[props.report.stats.length - 1].rx_bits_packet_size / 8)}b </h2>
+                <h2>Header TX: {Math.round(props.report.stats[props.report.stats.length - 1].tx_header_bytes * 10)/10.}b (full {Math.round(props.report.stats[props.report.stats.length - 1].tx_header_bytes_full * 10)/10.}b) </h2>
             <div className="Port-control">
                 <div className="Port-control-btn" onClick={() => props.switchChannel(
                     props.report.id, props.report.bound - 12)}>
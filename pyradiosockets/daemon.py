@@ -125,6 +125,8 @@ class Daemon:
                         'other_rx_missed': d[RS_MESSAGE_CMD_REPORT_N*idx + 8],
                         'tx_fec_factor': d[RS_MESSAGE_CMD_REPORT_N*idx + 9],
                         'rx_fec_factor': d[RS_MESSAGE_CMD_REPORT_N*idx + 10],
+                        'tx_header_bytes': d[RS_MESSAGE_CMD_REPORT_N*idx + 11],
+                        'tx_header_bytes_full': d[RS_MESSAGE_CMD_REPORT_N*idx + 12],
                     }
                 }]
             elif s[idx] == "C":
@@ -157,6 +159,33 @@ class Daemon:
                         'tx_skipped': d[RS_MESSAGE_CMD_REPORT_N*idx + 1],
                     }
                 }]
+            elif s[idx] == "M":
+                res += [{
+                    'key': 'M%d' % n[RS_MESSAGE_CMD_REPORT_N*idx],
+                    'id': n[RS_MESSAGE_CMD_REPORT_N*idx],
+                    'object_size': n[RS_MESSAGE_CMD_REPORT_N*idx + 1],
+                    'kind': 'pool',
+                    'stats': {
+                        't': t,
+                        'in_use': d[RS_MESSAGE_CMD_REPORT_N*idx],
+                        'n_alloc': d[RS_MESSAGE_CMD_REPORT_N*idx + 1],
+                        'n_malloc': d[RS_MESSAGE_CMD_REPORT_N*idx + 2],
+                        'n_slabs': d[RS_MESSAGE_CMD_REPORT_N*idx + 3],
+                    }
+                }]
+            elif s[idx] == "F":
+                res += [{
+                    'key': 'FEC',
+                    'id': n[RS_MESSAGE_CMD_REPORT_N*idx],
+                    'n_entries': n[RS_MESSAGE_CMD_REPORT_N*idx + 1],
+                    'kind': 'fec_cache',
+                    'stats': {
+                        't': t,
+                        'hits': d[RS_MESSAGE_CMD_REPORT_N*idx],
+                        'misses': d[RS_MESSAGE_CMD_REPORT_N*idx + 1],
+                        'evictions': d[RS_MESSAGE_CMD_REPORT_N*idx + 2],
+                    }
+                }]
             elif s[idx] == "U":
                 res += [{
                     'key': 'Status',
@@ -1,7 +1,7 @@
 import ctypes
 
 RS_MESSAGE_CMD_REPORT = 1
-RS_MESSAGE_CMD_REPORT_N = 11
+RS_MESSAGE_CMD_REPORT_N = 13
 
 RS_MESSAGE_CMD_SWITCH_CHANNEL = 2
 RS_MESSAGE_CMD_UPDATE_PORT = 3
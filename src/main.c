@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <getopt.h>
 #include <libconfig.h>
 #include <signal.h>
@@ -12,20 +13,40 @@
 #include "rs_channel_layer_pcap.h"
 #include "rs_channel_layer_nrf24l01_usb.h"
 #include "rs_command_loop.h"
+#include "rs_fec.h"
 #include "rs_packet.h"
+#include "rs_pipeline.h"
+#include "rs_pool.h"
 #include "rs_port_layer.h"
 #include "rs_server_state.h"
+#include "rs_timer.h"
 #include "rs_util.h"
 
 /* #define MAIN_PRINT_STATS */
 
 static struct rs_server_state state;
+static struct rs_pipeline pipeline;
 
 void signal_handler(int sig_num) {
     state.running = 0;
     signal(SIGINT, signal_handler);
 }
 
+#ifdef MAIN_PRINT_STATS
+#define MAIN_PRINT_STATS_MSEC 1000
+static struct rs_timer print_stats_timer;
+
+static void print_stats(struct rs_timer *timer, void *arg) {
+    printf("\e[1;1H\e[2J============= PORT =============\n");
+    rs_port_layer_stats_printf(state.port_layer);
+    printf("============ CHANNEL ===========\n");
+    for (int i = 0; i < state.n_channel_layers; i++) {
+        rs_channel_layer_stats_printf(state.channel_layers[i]);
+    }
+    rs_timer_schedule(&state.timers, timer, MAIN_PRINT_STATS_MSEC);
+}
+#endif
+
 int main(int argc, char **argv) {
 
     struct rs_channel_layer **layers1 = NULL;
@@ -72,10 +93,17 @@ int main(int argc, char **argv) {
     openlog("radiosocketd", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
     syslog(LOG_NOTICE, "Starting radiosocketd...");
 
+    rs_fec_init();
+
     /* set up state */
     state.running = 1;
     state.usage = 1.;
-    state.main_loop_us = 50000L;
+    rs_timer_wheel_init(&state.timers);
+    state.epoll_fd = epoll_create1(0);
+    if (state.epoll_fd < 0) {
+        syslog(LOG_ERR, "Could not create epoll instance");
+        exit(1);
+    }
 
     config_init(&state.config);
     if (config_read(&state.config, fopen(conf_file, "r")) != CONFIG_TRUE) {
@@ -100,6 +128,25 @@ int main(int argc, char **argv) {
     state.own_id = own;
     state.other_id = other;
 
+    /* set up FEC workers */
+    int fec_threads = 0;
+    config_lookup_int(&state.config, "fec_threads", &fec_threads);
+    if (fec_threads > 0 && rs_fec_workers_start(fec_threads))
+        goto error;
+
+    /* set up threaded mode */
+    int threads = 0;
+    config_lookup_bool(&state.config, "threads", &threads);
+    state.pipeline = NULL;
+    if (threads) {
+        if (rs_pipeline_init(&pipeline, &state)) {
+            rs_pipeline_destroy(&pipeline);
+            goto error;
+        }
+        state.pipeline = &pipeline;
+        rs_server_watch_fd(&state, rs_pipeline_receive_fd(&pipeline));
+    }
+
     /* set up channel layers */
     config_setting_t *cc = config_lookup(&state.config, "channels");
     int n_channel_layers = cc ? config_setting_length(cc) : 0;
@@ -154,6 +201,13 @@ int main(int argc, char **argv) {
     }
     state.n_channel_layers = n_layers1;
     state.channel_layers = layers1;
+    for (int i = 0; i < n_layers1; i++) {
+        if (state.pipeline)
+            rs_pipeline_watch_fd(state.pipeline,
+                                 rs_channel_layer_fd(layers1[i]));
+        else
+            rs_server_watch_fd(&state, rs_channel_layer_fd(layers1[i]));
+    }
 
     /* set up port layer */
     rs_port_layer_init(&layer2, &state);
@@ -165,89 +219,121 @@ int main(int argc, char **argv) {
 
     /* set up command loop */
     rs_command_loop_init(&command_loop, sock_file);
+    rs_server_watch_fd(&state, command_loop.socket_fd);
+
+#ifdef MAIN_PRINT_STATS
+    rs_timer_init(&print_stats_timer, &print_stats, NULL);
+    rs_timer_schedule(&state.timers, &print_stats_timer, MAIN_PRINT_STATS_MSEC);
+#endif
 
-    /* main loop */
+    /* main loop, in threaded mode the radio thread runs the port and channel
+     * layers */
     signal(SIGINT, signal_handler);
+    if (state.pipeline && rs_pipeline_start(state.pipeline))
+        state.running = 0;
+
+    int command_pending = 1;
     while (state.running) {
+        rs_clock_update();
         struct timespec loop_begin;
-        clock_gettime(CLOCK_REALTIME, &loop_begin);
+        rs_clock_now(&loop_begin);
         TIMER_START(main);
 
         /* Do stuff */
-        rs_command_loop_run(&command_loop, &state);
+        if (!state.pipeline) {
+            rs_command_loop_run(&command_loop, &state);
+        } else if (command_pending) {
+            /* Commands access layer state owned by the radio thread */
+            rs_pipeline_lock(state.pipeline);
+            rs_command_loop_run(&command_loop, &state);
+            rs_pipeline_unlock(state.pipeline);
+        }
 
         struct rs_packet *packet = NULL;
         rs_port_id_t port;
-        while (!rs_port_layer_receive(state.port_layer, &packet, &port)) {
+        while (!(state.pipeline
+                     ? rs_pipeline_receive(state.pipeline, &packet, &port)
+                     : rs_port_layer_receive(state.port_layer, &packet,
+                                             &port))) {
             rs_app_layer_main(state.app_layer, packet, port);
             rs_packet_destroy(packet);
-            free(packet);
+            rs_packet_free(packet);
             packet = NULL;
         }
-        for (int i = 0; i < state.n_channel_layers; i++) {
-            rs_channel_layer_main(state.channel_layers[i]);
-        }
-        rs_port_layer_main(state.port_layer, NULL);
-        rs_app_layer_main(state.app_layer, NULL, 0);
-
-#ifdef MAIN_PRINT_STATS
-        /* Print */
-        EVERY(main_printf, 1000) {
-            printf("\e[1;1H\e[2J============= PORT =============\n");
-            rs_port_layer_stats_printf(state.port_layer);
-            printf("============ CHANNEL ===========\n");
+        if (!state.pipeline) {
+            rs_timer_wheel_advance(&state.timers);
             for (int i = 0; i < state.n_channel_layers; i++) {
-                rs_channel_layer_stats_printf(state.channel_layers[i]);
+                rs_channel_layer_main(state.channel_layers[i]);
             }
+            rs_port_layer_main(state.port_layer, NULL);
         }
-#endif
+        rs_app_layer_main(state.app_layer, NULL, 0);
 
         TIMER_STOP(main, 0);
         TIMER_PRINT(main, 2);
 
-        /* Loop limit */
+        /* Sleep until a watched fd is readable or a deadline is due */
+        int timeout = MAIN_LOOP_TIMEOUT_MSEC;
+        if (!state.pipeline) {
+            int port_timeout = rs_port_layer_timeout(state.port_layer);
+            if (port_timeout >= 0 && port_timeout < timeout)
+                timeout = port_timeout;
+            int timer_timeout = rs_timer_wheel_timeout(&state.timers);
+            if (timer_timeout >= 0 && timer_timeout < timeout)
+                timeout = timer_timeout;
+        } else if (rs_pipeline_wait_begin(state.pipeline)) {
+            timeout = 0;
+        }
+        if (rs_app_layer_pending(state.app_layer))
+            timeout = 0;
+
         struct timespec loop;
-        clock_gettime(CLOCK_REALTIME, &loop);
-
-        long long int nsec_diff =
-            (loop.tv_sec > loop_begin.tv_sec ? 1000000000L : 0) + loop.tv_nsec -
-            loop_begin.tv_nsec;
-
-        /* Usage calculation and load controlling */
-        state.usage =
-            (1. - (double)state.main_loop_us / 1000000.) * state.usage +
-            (double)state.main_loop_us / 1000000. *
-                ((double)nsec_diff / ((double)state.main_loop_us * 1000.));
-
-        EVERY(adjust_main_loop, 100){
-            if(state.usage > 0.9){
-                if(state.main_loop_us < MAIN_LOOP_US_MAX){
-                    state.main_loop_us *= 1.2;
-                    state.usage /= 1.2;
-                }
-            }else if(state.usage < 0.8){
-                if(state.main_loop_us > MAIN_LOOP_US_MIN){
-                    state.main_loop_us *= 0.95;
-                    state.usage /= 0.95;
-                }
-            }
+        rs_clock_precise(&loop);
+
+        struct epoll_event events[MAIN_LOOP_MAX_EVENTS];
+        int n_events =
+            epoll_wait(state.epoll_fd, events, MAIN_LOOP_MAX_EVENTS, timeout);
+        if (n_events < 0 && errno != EINTR) {
+            syslog(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
         }
+        if (state.pipeline)
+            rs_pipeline_wait_end(state.pipeline);
 
-        if (nsec_diff < (long long int)state.main_loop_us * 1000) {
-            struct timespec sleep = {0};
-            sleep.tv_nsec = (long long int)state.main_loop_us * 1000 - nsec_diff;
-            nanosleep(&sleep, &sleep);
+        command_pending = 0;
+        for (int i = 0; i < n_events; i++) {
+            if (events[i].data.fd == command_loop.socket_fd)
+                command_pending = 1;
+        }
+
+        struct timespec wake;
+        rs_clock_precise(&wake);
+
+        /* Usage calculation, averaged over roughly one second */
+        double busy = (loop.tv_sec - loop_begin.tv_sec) +
+                      (loop.tv_nsec - loop_begin.tv_nsec) / 1000000000.;
+        double total = (wake.tv_sec - loop_begin.tv_sec) +
+                       (wake.tv_nsec - loop_begin.tv_nsec) / 1000000000.;
+        if (total > 0.) {
+            double w = total < 1. ? total : 1.;
+            state.usage = (1. - w) * state.usage + w * busy / total;
         }
     }
 
     /* shutdown */
     syslog(LOG_NOTICE, "Shutting down radiosocketd...");
 
+    if (state.pipeline)
+        rs_pipeline_join(state.pipeline);
+
     rs_port_layer_destroy(&layer2);
     rs_app_layer_destroy(&layer3);
     rs_command_loop_destroy(&command_loop);
 
 error:
+    if (state.pipeline)
+        rs_pipeline_destroy(state.pipeline);
+    if (state.epoll_fd >= 0)
+        close(state.epoll_fd);
     config_destroy(&state.config);
 
     for (int i = 0; i < n_layers1; i++) {
@@ -257,6 +343,10 @@ error:
     free(layers1);
     free(layers1_alloc);
 
+    rs_fec_workers_stop();
+    rs_fec_cache_destroy();
+    rs_pools_destroy();
+
     syslog(LOG_NOTICE, "...done");
     closelog();
     return 0;
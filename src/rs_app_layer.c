@@ -5,12 +5,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <syslog.h>
 #include <unistd.h>
 
 #include "rs_app_layer.h"
 #include "rs_packet.h"
+#include "rs_pipeline.h"
 #include "rs_port_layer.h"
 #include "rs_server_state.h"
 #include "rs_util.h"
@@ -146,10 +148,27 @@ int rs_app_layer_open_connection(struct rs_app_layer *layer,
     new_conn->socket = sock;
     new_conn->addr_server = addr_server;
     new_conn->client_socket = -1;
+    rs_server_watch_fd(layer->server, sock);
 
     return 0;
 }
 
+/* Threaded mode: frame is copied, as the frame buffer is reused right away */
+static int _pipeline_transmit(struct rs_app_layer *layer,
+                              struct rs_app_connection *conn, uint8_t *frame,
+                              int len, const struct timespec *ts) {
+    struct rs_buffer *buf = rs_buffer_new(RS_PACKET_HEADROOM + len);
+    if (!buf)
+        return -1;
+    memcpy(buf->data + RS_PACKET_HEADROOM, frame, len);
+
+    struct rs_packet *packet = rs_packet_alloc();
+    rs_packet_init(packet, buf, NULL, buf->data + RS_PACKET_HEADROOM, len);
+    packet->payload_data_headroom = RS_PACKET_HEADROOM;
+    return rs_pipeline_transmit(layer->server->pipeline, packet, conn->port,
+                                ts);
+}
+
 void rs_app_layer_main(struct rs_app_layer *layer, struct rs_packet *received,
                        rs_port_id_t received_port) {
 
@@ -161,6 +180,8 @@ void rs_app_layer_main(struct rs_app_layer *layer, struct rs_packet *received,
             if (layer->connections[i]->client_socket >= 0) {
                 syslog(LOG_NOTICE, "app layer: Closed connection on port %d\n",
                        layer->connections[i]->port);
+                rs_server_unwatch_fd(layer->server,
+                                     layer->connections[i]->client_socket);
                 close(layer->connections[i]->client_socket);
             }
 
@@ -172,6 +193,7 @@ void rs_app_layer_main(struct rs_app_layer *layer, struct rs_packet *received,
             fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 
             layer->connections[i]->client_socket = fd;
+            rs_server_watch_fd(layer->server, fd);
         }
     }
 
@@ -184,9 +206,19 @@ void rs_app_layer_main(struct rs_app_layer *layer, struct rs_packet *received,
             if (layer->connections[i]->client_socket < 0)
                 continue;
 
-            int res = write(layer->connections[i]->client_socket,
+            int res;
+            if (received->payload_iov) {
+                struct rs_packet_iov *iov =
+                    rs_packet_iov(received->payload_iov);
+                res = writev(layer->connections[i]->client_socket, iov->iov,
+                             iov->n);
+            } else {
+                res = write(layer->connections[i]->client_socket,
                             received->payload_data, received->payload_data_len);
+            }
             if (res < 0) {
+                rs_server_unwatch_fd(layer->server,
+                                     layer->connections[i]->client_socket);
                 close(layer->connections[i]->client_socket);
                 layer->connections[i]->client_socket = -1;
                 syslog(LOG_NOTICE, "app layer: Closed connection on port %d\n",
@@ -207,7 +239,16 @@ void rs_app_layer_main(struct rs_app_layer *layer, struct rs_packet *received,
                          conn->buffer.buffer + conn->buffer.buffer_at,
                          conn->buffer.buffer_size - conn->buffer.buffer_at, 0);
 
-                if (recv_len <= 0) {
+                if (recv_len == 0) {
+                    /* Would keep the main loop awake otherwise */
+                    rs_server_unwatch_fd(layer->server, conn->client_socket);
+                    close(conn->client_socket);
+                    conn->client_socket = -1;
+                    syslog(LOG_NOTICE, "app layer: Closed connection on port %d\n",
+                           conn->port);
+                    break;
+                }
+                if (recv_len < 0) {
                     break;
                 }
 
@@ -230,29 +271,75 @@ void rs_app_layer_main(struct rs_app_layer *layer, struct rs_packet *received,
             /* Did we skip frames */
             for (; conn->buffer.ext_at_frame < 0; conn->buffer.ext_at_frame++)
                 rs_stat_register(&conn->stat_skipped, 1);
+            for (int n = __atomic_exchange_n(&conn->n_expired, 0,
+                                             __ATOMIC_RELAXED);
+                 n > 0; n--)
+                rs_stat_register(&conn->stat_skipped, 1);
 
-            /* send one frame */
-            if (conn->buffer.n_frames > conn->buffer.ext_at_frame) {
-                rs_stat_register(&conn->stat_skipped, 0.0);
-
-                struct rs_packet packet;
-
-                rs_packet_init(
-                    &packet, NULL, NULL,
+            /* send one frame, skipping those beyond the latency budget */
+            while (conn->buffer.n_frames > conn->buffer.ext_at_frame) {
+                uint8_t *frame =
                     conn->buffer.buffer +
-                        conn->buffer.frame_start[conn->buffer.ext_at_frame],
+                    conn->buffer.frame_start[conn->buffer.ext_at_frame];
+                int len =
                     conn->buffer.frame_start[conn->buffer.ext_at_frame + 1] -
-                        conn->buffer.frame_start[conn->buffer.ext_at_frame]);
-                rs_port_layer_transmit(layer->server->port_layer, &packet,
-                                       conn->port);
+                    conn->buffer.frame_start[conn->buffer.ext_at_frame];
+                struct timespec *ts =
+                    &conn->buffer.frame_ts[conn->buffer.ext_at_frame];
+
+                int res;
+                if (layer->server->pipeline) {
+                    /* Latency budget is checked on the radio thread */
+                    res = _pipeline_transmit(layer, conn, frame, len, ts);
+                    conn->buffer.ext_at_frame++;
+                    rs_stat_register(&conn->stat_skipped, res < 0 ? 1 : 0.0);
+                    break;
+                }
+
+                struct rs_packet packet;
+                rs_packet_init(&packet, NULL, NULL, frame, len);
+
+                /* Everything in front of the frame has been sent or skipped
+                 * already, so lower layers may prepend their headers there */
+                packet.payload_data_headroom =
+                    conn->buffer.frame_start[conn->buffer.ext_at_frame];
+                res = rs_port_layer_transmit(layer->server->port_layer,
+                                             &packet, conn->port, ts);
                 rs_packet_destroy(&packet);
 
                 conn->buffer.ext_at_frame++;
+                if (res != RS_PORT_LAYER_EXPIRED) {
+                    rs_stat_register(&conn->stat_skipped, 0.0);
+                    break;
+                }
+                rs_stat_register(&conn->stat_skipped, 1);
             }
         }
+
+        /* One frame per connection queued, let the scheduler interleave */
+        if (!layer->server->pipeline)
+            rs_port_layer_flush(layer->server->port_layer);
+    }
+}
+
+void rs_app_layer_expired(struct rs_app_layer *layer, rs_port_id_t port) {
+    for (int i = 0; i < layer->n_connections; i++) {
+        if (layer->connections[i]->port == port)
+            __atomic_add_fetch(&layer->connections[i]->n_expired, 1,
+                               __ATOMIC_RELAXED);
     }
 }
 
+int rs_app_layer_pending(struct rs_app_layer *layer) {
+    for (int i = 0; i < layer->n_connections; i++) {
+        struct rs_app_connection *conn = layer->connections[i];
+        if (conn->client_socket >= 0 &&
+            conn->buffer.n_frames > conn->buffer.ext_at_frame)
+            return 1;
+    }
+    return 0;
+}
+
 void rs_app_connection_destroy(struct rs_app_connection *connection) {
     if (connection->client_socket > 0)
         close(connection->client_socket);
@@ -274,24 +361,32 @@ void rs_frame_buffer_init(struct rs_frame_buffer *buffer,
                           int expected_frame_size, int n_frames_max) {
     buffer->n_frames_max = n_frames_max;
     buffer->frame_start = calloc(buffer->n_frames_max + 1, sizeof(int));
+    buffer->frame_ts =
+        calloc(buffer->n_frames_max + 1, sizeof(struct timespec));
     buffer->n_frames = 0;
-    buffer->frame_start[0] = 0;
+    buffer->frame_start[0] = RS_PACKET_HEADROOM;
 
-    buffer->buffer_size = buffer->n_frames_max * expected_frame_size;
+    buffer->buffer_size =
+        RS_PACKET_HEADROOM + buffer->n_frames_max * expected_frame_size;
     buffer->buffer = calloc(buffer->buffer_size, sizeof(uint8_t));
-    buffer->buffer_at = 0;
+    buffer->buffer_at = RS_PACKET_HEADROOM;
 }
 
 void rs_frame_buffer_destroy(struct rs_frame_buffer *buffer) {
     free(buffer->buffer);
     free(buffer->frame_start);
+    free(buffer->frame_ts);
 }
 
 void rs_frame_buffer_process_fixed_size(struct rs_frame_buffer *buffer,
                                         int new_len, int frame_size_fixed) {
+    struct timespec now;
+    rs_clock_now(&now);
 
-    if (buffer->buffer_size < frame_size_fixed * buffer->n_frames_max) {
-        buffer->buffer_size = frame_size_fixed * buffer->n_frames_max;
+    if (buffer->buffer_size <
+        RS_PACKET_HEADROOM + frame_size_fixed * buffer->n_frames_max) {
+        buffer->buffer_size =
+            RS_PACKET_HEADROOM + frame_size_fixed * buffer->n_frames_max;
         buffer->buffer =
             realloc(buffer->buffer, buffer->buffer_size * sizeof(uint8_t));
     }
@@ -304,10 +399,13 @@ void rs_frame_buffer_process_fixed_size(struct rs_frame_buffer *buffer,
         if (buffer->n_frames == buffer->n_frames_max) {
             memcpy(buffer->frame_start, buffer->frame_start + 1,
                    buffer->n_frames_max * sizeof(int));
+            memmove(buffer->frame_ts, buffer->frame_ts + 1,
+                    buffer->n_frames_max * sizeof(struct timespec));
             buffer->n_frames--;
             buffer->ext_at_frame--;
         }
 
+        buffer->frame_ts[buffer->n_frames] = now;
         buffer->n_frames++;
         buffer->frame_start[buffer->n_frames] =
             buffer->frame_start[buffer->n_frames - 1] + frame_size_fixed;
@@ -316,9 +414,12 @@ void rs_frame_buffer_process_fixed_size(struct rs_frame_buffer *buffer,
 
 void rs_frame_buffer_process(struct rs_frame_buffer *buffer, int new_len,
                              uint8_t *sep, int sep_len) {
+    struct timespec now;
+    rs_clock_now(&now);
+
     int start_looking = buffer->buffer_at - sep_len + 1;
-    if (start_looking < 0)
-        start_looking = 0;
+    if (start_looking < RS_PACKET_HEADROOM)
+        start_looking = RS_PACKET_HEADROOM;
 
     buffer->buffer_at += new_len;
     int stop_looking = buffer->buffer_at - sep_len;
@@ -336,10 +437,13 @@ void rs_frame_buffer_process(struct rs_frame_buffer *buffer, int new_len,
             if (buffer->n_frames == buffer->n_frames_max) {
                 memcpy(buffer->frame_start, buffer->frame_start + 1,
                        buffer->n_frames_max * sizeof(int));
+                memmove(buffer->frame_ts, buffer->frame_ts + 1,
+                        buffer->n_frames_max * sizeof(struct timespec));
                 buffer->n_frames--;
                 buffer->ext_at_frame--;
             }
 
+            buffer->frame_ts[buffer->n_frames] = now;
             buffer->n_frames++;
             buffer->frame_start[buffer->n_frames] = i;
         }
@@ -369,13 +473,16 @@ void rs_frame_buffer_flush(struct rs_frame_buffer *buffer, int keep_n_frames) {
                  buffer->frame_start[buffer->n_frames - keep_n_frames];
     int delta_n = buffer->frame_start[buffer->n_frames - keep_n_frames];
 
-    memcpy(buffer->buffer, buffer->buffer + delta_n, copy_n * sizeof(uint8_t));
-    buffer->buffer_at = copy_n;
+    memmove(buffer->buffer + RS_PACKET_HEADROOM, buffer->buffer + delta_n,
+            copy_n * sizeof(uint8_t));
+    buffer->buffer_at = RS_PACKET_HEADROOM + copy_n;
 
     for (int i = 0; i < keep_n_frames + 1; i++) {
         buffer->frame_start[i] =
             buffer->frame_start[i + (buffer->n_frames - keep_n_frames)] -
-            delta_n;
+            delta_n + RS_PACKET_HEADROOM;
+        buffer->frame_ts[i] =
+            buffer->frame_ts[i + (buffer->n_frames - keep_n_frames)];
     }
 
     buffer->ext_at_frame -= buffer->n_frames - keep_n_frames;
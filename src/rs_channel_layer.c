@@ -4,26 +4,49 @@
 
 #include "rs_channel_layer.h"
 #include "rs_channel_layer_packet.h"
+#include "rs_server_state.h"
+#include "rs_timer.h"
 #include "rs_util.h"
 
+static void _heartbeat(struct rs_timer *timer, void *arg);
+
 void rs_channel_layer_init(struct rs_channel_layer *layer,
                            struct rs_server_state *server, uint8_t ch_base,
                            struct rs_channel_layer_vtable *vtable) {
     layer->vtable = vtable;
     layer->server = server;
     layer->ch_base = ch_base;
+    layer->tx_pending = NULL;
+    layer->tx_last_len_header = 0;
+
+    layer->compact_header = 1;
+    config_lookup_bool(&server->config, "compact_header",
+                       &layer->compact_header);
+
     layer->channels =
         calloc(rs_channel_layer_ch_n(layer), sizeof(struct rs_channel_info));
     for (int i = 0; i < rs_channel_layer_ch_n(layer); i++) {
         layer->channels[i].id = rs_channel_layer_ch(layer, i);
         layer->channels[i].is_in_use = 0;
         layer->channels[i].tx_last_seq = 0;
+        layer->channels[i].tx_compact = 0;
+        layer->channels[i].tx_aggregate = 0;
+        layer->channels[i].tx_xor = 0;
+        layer->channels[i].tx_segment = 0;
+        layer->channels[i].tx_group = 0;
         rs_stats_init(&layer->channels[i].stats);
         rs_stat_init(&layer->channels[i].tx_stat_dt, RS_STAT_AGG_SUM, "TX",
                      "s", 1.);
+        rs_timer_init(&layer->channels[i].heartbeat_timer, &_heartbeat, layer);
+        rs_timer_schedule(&server->timers, &layer->channels[i].heartbeat_timer,
+                          RS_CHANNEL_CMD_HEARTBEAT_MSEC);
     }
 }
 void rs_channel_layer_base_destroy(struct rs_channel_layer *layer) {
+    for (int i = 0; i < rs_channel_layer_ch_n(layer); i++) {
+        rs_timer_cancel(&layer->server->timers,
+                        &layer->channels[i].heartbeat_timer);
+    }
     free(layer->channels);
     layer->channels = NULL;
 }
@@ -62,20 +85,29 @@ static int _transmit(struct rs_channel_layer *layer,
                      struct rs_channel_layer_packet *packet,
                      struct rs_channel_info *info) {
 
-    /* Publish stats */
+    struct timespec before_tx;
+    rs_clock_precise(&before_tx);
+
+    /* Publish stats, in the compact format only with commands and every
+     * RS_CHANNEL_STATS_MSEC */
     rs_stats_packed_init(&packet->stats, &info->stats);
+    rs_channel_layer_packet_set_format(
+        packet, info->tx_compact,
+        packet->command || msec_diff(before_tx, info->tx_stats_last_ts) >=
+                               RS_CHANNEL_STATS_MSEC);
+    if (packet->has_stats)
+        info->tx_stats_last_ts = before_tx;
+    layer->tx_last_len_header = packet->super.len_header;
 
     info->is_in_use = 1;
 
     packet->channel = info->id;
     packet->seq = info->tx_last_seq + 1;
 
-    struct timespec before_tx;
-    clock_gettime(CLOCK_REALTIME, &before_tx);
     int res = layer->vtable->_transmit(layer, &packet->super, info->id);
     if (res > 0) {
         info->tx_last_seq++;
-        clock_gettime(CLOCK_REALTIME, &info->tx_last_ts);
+        rs_clock_precise(&info->tx_last_ts);
 
         uint64_t nsec =
             1000000000LL * (info->tx_last_ts.tv_sec - before_tx.tv_sec) +
@@ -84,6 +116,9 @@ static int _transmit(struct rs_channel_layer *layer,
 
         /* Register stats */
         rs_stats_register_tx(&info->stats, res);
+
+        if (layer->vtable->_flush)
+            layer->tx_pending = info;
     } else {
         rs_stat_register(&info->stats.tx_stat_errors, 1.0);
     }
@@ -109,44 +144,187 @@ int rs_channel_layer_transmit(struct rs_channel_layer *layer,
     return res;
 }
 
-int rs_channel_layer_receive(struct rs_channel_layer *layer,
-                             struct rs_packet **packet, rs_channel_t *channel) {
+/* Transmit n <= RS_CHANNEL_LAYER_BATCH packets through the vtable */
+static int _transmit_batch(struct rs_channel_layer *layer,
+                           struct rs_packet **packets, int n,
+                           struct rs_channel_info *info, int *len_header) {
+    struct rs_channel_layer_packet packed[RS_CHANNEL_LAYER_BATCH];
+    struct rs_packet *packed_ptrs[RS_CHANNEL_LAYER_BATCH];
 
-    struct rs_channel_layer_packet *unpacked;
-    int res = layer->vtable->_receive(layer, &unpacked, *channel);
-    if (res)
-        return res;
+    struct timespec before_tx;
+    rs_clock_precise(&before_tx);
+
+    /* In the compact format stats are published by the first packet only */
+    int has_stats =
+        msec_diff(before_tx, info->tx_stats_last_ts) >= RS_CHANNEL_STATS_MSEC;
+    if (has_stats)
+        info->tx_stats_last_ts = before_tx;
+
+    info->is_in_use = 1;
+
+    for (int i = 0; i < n; i++) {
+        rs_channel_layer_packet_init(&packed[i], NULL, packets[i], NULL, 0);
+        packed[i].command = 0;
+        if (i)
+            packed[i].stats = packed[0].stats;
+        else
+            rs_stats_packed_init(&packed[i].stats, &info->stats);
+        rs_channel_layer_packet_set_format(&packed[i], info->tx_compact,
+                                           has_stats && !i);
+
+        packed[i].channel = info->id;
+        packed[i].seq = info->tx_last_seq + 1 + i;
+        packed_ptrs[i] = &packed[i].super;
+        if (len_header)
+            len_header[i] = packed[i].super.len_header;
+    }
+    layer->tx_last_len_header = packed[n - 1].super.len_header;
+
+    int res = 0;
+    if (layer->vtable->_transmit_batch) {
+        res = layer->vtable->_transmit_batch(layer, packed_ptrs, n, info->id);
+    } else {
+        for (int i = 0; i < n && res >= 0; i++) {
+            int bytes = layer->vtable->_transmit(layer, packed_ptrs[i], info->id);
+            res = bytes > 0 ? res + bytes : -1;
+        }
+    }
+
+    /* Lost packets show up as missed on the other side */
+    info->tx_last_seq += n;
+
+    if (res > 0) {
+        rs_clock_precise(&info->tx_last_ts);
+
+        uint64_t nsec =
+            1000000000LL * (info->tx_last_ts.tv_sec - before_tx.tv_sec) +
+            (info->tx_last_ts.tv_nsec - before_tx.tv_nsec);
+        rs_stat_register(&info->tx_stat_dt, nsec / 1000000000.0);
+
+        /* Register stats, the device only reports the total */
+        for (int i = 0; i < n; i++)
+            rs_stats_register_tx(&info->stats, res / n + (i ? 0 : res % n));
+
+        if (layer->vtable->_flush)
+            layer->tx_pending = info;
+    } else {
+        rs_stat_register(&info->stats.tx_stat_errors, 1.0);
+        res = -1;
+    }
+
+    for (int i = 0; i < n; i++)
+        rs_packet_destroy(&packed[i].super);
+
+    return res;
+}
+
+int rs_channel_layer_transmit_batch(struct rs_channel_layer *layer,
+                                    struct rs_packet **packets, int n,
+                                    rs_channel_t channel, int *len_header) {
+    if (!rs_channel_layer_owns_channel(layer, channel))
+        return -1;
+    struct rs_channel_info *info =
+        &layer->channels[rs_channel_layer_extract(layer, channel)];
+
+    int total_bytes = 0;
+    for (int at = 0; at < n; at += RS_CHANNEL_LAYER_BATCH) {
+        int m = n - at;
+        if (m > RS_CHANNEL_LAYER_BATCH)
+            m = RS_CHANNEL_LAYER_BATCH;
+
+        int res = _transmit_batch(layer, packets + at, m, info,
+                                  len_header ? len_header + at : NULL);
+        if (res < 0)
+            return -1;
+        total_bytes += res;
+    }
+
+    return total_bytes;
+}
+
+int rs_channel_layer_flush(struct rs_channel_layer *layer) {
+    if (!layer->vtable->_flush || !layer->tx_pending)
+        return 0;
+
+    struct timespec before_flush, after_flush;
+    rs_clock_precise(&before_flush);
+    int res = layer->vtable->_flush(layer);
+    rs_clock_precise(&after_flush);
+
+    /* Queued frames only hit the device now, so the time spent here belongs
+     * to tx_stat_dt as well */
+    uint64_t nsec = 1000000000LL * (after_flush.tv_sec - before_flush.tv_sec) +
+                    (after_flush.tv_nsec - before_flush.tv_nsec);
+    rs_stat_register(&layer->tx_pending->tx_stat_dt, nsec / 1000000000.0);
+    if (res < 0)
+        rs_stat_register(&layer->tx_pending->stats.tx_stat_errors, 1.0);
 
+    layer->tx_pending = NULL;
+    return res;
+}
+
+/*
+ * Account for a packet received by the implementation (takes ownership).
+ * Returns 0 and places packet / channel in the args if it is meant for the
+ * port layer, RS_CHANNEL_LAYER_IRR otherwise
+ */
+static int _receive_unpacked(struct rs_channel_layer *layer,
+                             struct rs_channel_layer_packet *unpacked,
+                             struct rs_packet **packet,
+                             rs_channel_t *channel) {
     if (!rs_channel_layer_owns_channel(layer, unpacked->channel)) {
         syslog(LOG_DEBUG, "Received packet on channel without ownership");
         rs_packet_destroy(&unpacked->super);
-        free(unpacked);
+        rs_channel_layer_packet_free(unpacked);
         return RS_CHANNEL_LAYER_IRR;
     }
 
     struct rs_channel_info *info =
-        &layer->channels[rs_channel_layer_extract(layer, *channel)];
+        &layer->channels[rs_channel_layer_extract(layer, unpacked->channel)];
+
+    /* Compact format only carries the lower 8 bits */
+    if (unpacked->compact) {
+        unpacked->seq = info->rx_last_seq +
+                        (uint8_t)(unpacked->seq - info->rx_last_seq);
+    }
 
     info->is_in_use = 1;
     rs_stats_register_rx(&info->stats, unpacked->super.payload_data_len,
                          unpacked->seq - info->rx_last_seq - 1);
-    rs_stats_register_published_stats(&info->stats, &unpacked->stats);
+    if (unpacked->has_stats)
+        rs_stats_register_published_stats(&info->stats, &unpacked->stats);
     info->rx_last_seq = unpacked->seq;
 
     if (unpacked->command) {
         if (unpacked->command == RS_CHANNEL_CMD_HEARTBEAT) {
-            /* okay */
+            /* capabilities */
+            info->tx_compact =
+                layer->compact_header &&
+                unpacked->super.payload_data_len >= 1 &&
+                (unpacked->super.payload_data[0] & RS_CHANNEL_CAP_COMPACT);
+            info->tx_aggregate =
+                unpacked->super.payload_data_len >= 1 &&
+                (unpacked->super.payload_data[0] & RS_CHANNEL_CAP_AGGREGATE);
+            info->tx_xor =
+                unpacked->super.payload_data_len >= 1 &&
+                (unpacked->super.payload_data[0] & RS_CHANNEL_CAP_XOR);
+            info->tx_segment =
+                unpacked->super.payload_data_len >= 1 &&
+                (unpacked->super.payload_data[0] & RS_CHANNEL_CAP_SEGMENT);
+            info->tx_group =
+                unpacked->super.payload_data_len >= 1 &&
+                (unpacked->super.payload_data[0] & RS_CHANNEL_CAP_GROUP);
         } else {
             syslog(LOG_ERR, "Unknown channel layer command %02x",
                    unpacked->command);
         }
         rs_packet_destroy(&unpacked->super);
-        free(unpacked);
+        rs_channel_layer_packet_free(unpacked);
         return RS_CHANNEL_LAYER_IRR;
     }
 
     /* Move ownership to base class struct */
-    *packet = calloc(1, sizeof(struct rs_packet));
+    *packet = rs_packet_alloc();
     rs_packet_init(*packet, unpacked->super.payload_ownership,
                    unpacked->super.payload_packet, unpacked->super.payload_data,
                    unpacked->super.payload_data_len);
@@ -154,34 +332,153 @@ int rs_channel_layer_receive(struct rs_channel_layer *layer,
 
     unpacked->super.payload_ownership = NULL;
     rs_packet_destroy(&unpacked->super);
-    free(unpacked);
+    rs_channel_layer_packet_free(unpacked);
 
     return 0;
 }
 
-void rs_channel_layer_main(struct rs_channel_layer *layer) {
-    static uint8_t dummy[RS_CHANNEL_CMD_DUMMY_SIZE];
-
-    /*
-     * heartbeat through used channels
-     */
-    for (int j = 0; j < rs_channel_layer_ch_n(layer); j++) {
-        if (!layer->channels[j].is_in_use)
-            continue;
-
-        struct timespec now;
-        clock_gettime(CLOCK_REALTIME, &now);
-        long msec = msec_diff(now, layer->channels[j].tx_last_ts);
-        if (msec >= RS_CHANNEL_CMD_HEARTBEAT_MSEC) {
-            struct rs_channel_layer_packet packet;
-            rs_channel_layer_packet_init(&packet, NULL, NULL, dummy,
-                                         RS_CHANNEL_CMD_DUMMY_SIZE);
-
-            packet.command = RS_CHANNEL_CMD_HEARTBEAT;
-            _transmit(layer, &packet, &layer->channels[j]);
-            rs_packet_destroy(&packet.super);
+int rs_channel_layer_receive(struct rs_channel_layer *layer,
+                             struct rs_packet **packet, rs_channel_t *channel) {
+
+    struct rs_channel_layer_packet *unpacked;
+    int res = layer->vtable->_receive(layer, &unpacked, *channel);
+    if (res)
+        return res;
+
+    return _receive_unpacked(layer, unpacked, packet, channel);
+}
+
+int rs_channel_layer_receive_batch(struct rs_channel_layer *layer,
+                                   struct rs_packet **packets,
+                                   rs_channel_t *channels, int *n,
+                                   rs_channel_t channel) {
+    struct rs_channel_layer_packet *unpacked[RS_CHANNEL_LAYER_BATCH];
+    int max = *n < RS_CHANNEL_LAYER_BATCH ? *n : RS_CHANNEL_LAYER_BATCH;
+    int n_unpacked = max;
+    int res = 0;
+
+    if (layer->vtable->_receive_batch) {
+        res = layer->vtable->_receive_batch(layer, unpacked, &n_unpacked,
+                                            channel);
+    } else {
+        n_unpacked = 0;
+        for (int i = 0; i < max; i++) {
+            res = layer->vtable->_receive(layer, &unpacked[n_unpacked],
+                                          channel);
+            if (res == RS_CHANNEL_LAYER_IRR || res == RS_CHANNEL_LAYER_BADFCS) {
+                res = 0;
+                continue;
+            }
+            if (res)
+                break;
+
+            /* A borrowed payload is gone with the next _receive */
+            if (!unpacked[n_unpacked++]->super.payload_ownership)
+                break;
         }
     }
+
+    /* Errors are reported again by the next call */
+    if (res < 0 && n_unpacked)
+        res = 0;
+
+    *n = 0;
+    for (int i = 0; i < n_unpacked; i++) {
+        if (!_receive_unpacked(layer, unpacked[i], &packets[*n],
+                               &channels[*n]))
+            (*n)++;
+    }
+
+    return res;
+}
+
+int rs_channel_layer_compact(struct rs_channel_layer *layer,
+                             rs_channel_t channel) {
+    if (!rs_channel_layer_owns_channel(layer, channel))
+        return 0;
+    return layer->channels[rs_channel_layer_extract(layer, channel)]
+        .tx_compact;
+}
+
+int rs_channel_layer_aggregate(struct rs_channel_layer *layer,
+                               rs_channel_t channel) {
+    if (!rs_channel_layer_owns_channel(layer, channel))
+        return 0;
+    return layer->channels[rs_channel_layer_extract(layer, channel)]
+        .tx_aggregate;
+}
+
+int rs_channel_layer_xor(struct rs_channel_layer *layer,
+                         rs_channel_t channel) {
+    if (!rs_channel_layer_owns_channel(layer, channel))
+        return 0;
+    return layer->channels[rs_channel_layer_extract(layer, channel)].tx_xor;
+}
+
+int rs_channel_layer_segment(struct rs_channel_layer *layer,
+                             rs_channel_t channel) {
+    if (!rs_channel_layer_owns_channel(layer, channel))
+        return 0;
+    return layer->channels[rs_channel_layer_extract(layer, channel)]
+        .tx_segment;
+}
+
+int rs_channel_layer_group(struct rs_channel_layer *layer,
+                           rs_channel_t channel) {
+    if (!rs_channel_layer_owns_channel(layer, channel))
+        return 0;
+    return layer->channels[rs_channel_layer_extract(layer, channel)].tx_group;
+}
+
+/*
+ * Heartbeat through a used channel. The timer is not moved on every transmit,
+ * it fires once the channel may have become idle and is rearmed for the
+ * remaining time otherwise
+ */
+static void _heartbeat(struct rs_timer *timer, void *arg) {
+    struct rs_channel_layer *layer = arg;
+    struct rs_channel_info *info =
+        rs_container_of(rs_channel_info, heartbeat_timer, timer);
+
+    if (!info->is_in_use) {
+        rs_timer_schedule(&layer->server->timers, timer,
+                          RS_CHANNEL_CMD_HEARTBEAT_MSEC);
+        return;
+    }
+
+    struct timespec now;
+    rs_clock_now(&now);
+    long msec = msec_diff(now, info->tx_last_ts);
+    long msec_heartbeat = msec_diff(now, info->tx_heartbeat_last_ts);
+    if (msec >= RS_CHANNEL_CMD_HEARTBEAT_MSEC ||
+        msec_heartbeat >= RS_CHANNEL_CMD_HEARTBEAT_MAX_MSEC) {
+        info->tx_heartbeat_last_ts = now;
+
+        uint8_t dummy[RS_CHANNEL_CMD_DUMMY_SIZE] = {0};
+        dummy[0] = (layer->compact_header ? RS_CHANNEL_CAP_COMPACT : 0) |
+                   RS_CHANNEL_CAP_AGGREGATE | RS_CHANNEL_CAP_XOR |
+                   RS_CHANNEL_CAP_SEGMENT | RS_CHANNEL_CAP_GROUP;
+
+        struct rs_channel_layer_packet packet;
+        rs_channel_layer_packet_init(&packet, NULL, NULL, dummy,
+                                     RS_CHANNEL_CMD_DUMMY_SIZE);
+
+        packet.command = RS_CHANNEL_CMD_HEARTBEAT;
+        _transmit(layer, &packet, info);
+        rs_packet_destroy(&packet.super);
+
+        msec = 0;
+        msec_heartbeat = 0;
+    }
+
+    long next = RS_CHANNEL_CMD_HEARTBEAT_MSEC - msec;
+    if (RS_CHANNEL_CMD_HEARTBEAT_MAX_MSEC - msec_heartbeat < next)
+        next = RS_CHANNEL_CMD_HEARTBEAT_MAX_MSEC - msec_heartbeat;
+    rs_timer_schedule(&layer->server->timers, timer, next);
+}
+
+void rs_channel_layer_main(struct rs_channel_layer *layer) {
+    rs_channel_layer_flush(layer);
 }
 
 void rs_channel_layer_close_all_channels(struct rs_channel_layer *layer) {
@@ -233,7 +233,7 @@ static int _receive(struct rs_channel_layer *super,
                 if (packet == n_packets - 1) {
                     /* recv_buf contains one full packet */
                     struct rs_channel_layer_packet *unpacked =
-                        calloc(1, sizeof(struct rs_channel_layer_packet));
+                        rs_channel_layer_packet_alloc();
 
                     if (rs_channel_layer_packet_unpack(unpacked, NULL,
                                                        layer->recv_buf,
@@ -244,7 +244,7 @@ static int _receive(struct rs_channel_layer *super,
                                "layer (%d fragments)",
                                n_packets);
                         rs_packet_destroy(&unpacked->super);
-                        free(unpacked);
+                        rs_channel_layer_packet_free(unpacked);
                         return RS_CHANNEL_LAYER_IRR;
                     }
 
@@ -263,10 +263,15 @@ static int _max_packet_size(struct rs_channel_layer* layer, rs_channel_t channel
     return 310;
 }
 
+static int _fd(struct rs_channel_layer *super) {
+    return rs_cast(rs_channel_layer_nrf24l01_usb, super)->fd_serial;
+}
+
 static struct rs_channel_layer_vtable vtable = {
     .destroy = rs_channel_layer_nrf24l01_usb_destroy,
     ._transmit = _transmit,
     ._receive = _receive,
     .ch_n = _ch_n,
-    .max_packet_size = _max_packet_size
+    .max_packet_size = _max_packet_size,
+    .fd = _fd
 };
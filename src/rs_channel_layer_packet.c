@@ -12,70 +12,117 @@
 
 static struct rs_packet_vtable vtable;
 
-int rs_channel_layer_packet_len_header(struct rs_packet* super){
-    struct rs_channel_layer_packet *packet = rs_cast(rs_channel_layer_packet, super);
-    return  sizeof(rs_channel_t) + 
-        sizeof(rs_channel_layer_seq_t) +
-        rs_stats_packed_len(&packet->stats) + 
-        sizeof(uint8_t);
-}
-
 void rs_channel_layer_packet_pack_header(struct rs_packet *super,
                                          uint8_t **buffer, int *buffer_len) {
     struct rs_channel_layer_packet *packet =
         rs_cast(rs_channel_layer_packet, super);
 
-    /* channel */
-    PACK(buffer, buffer_len, rs_channel_t, packet->channel);
-    PACK(buffer, buffer_len, rs_channel_layer_seq_t, packet->seq);
-
-    if (rs_stats_packed_pack(&packet->stats, buffer, buffer_len))
-        goto pack_err;
-
-    /* command */
-    PACK(buffer, buffer_len, uint8_t, packet->command);
+    if (*buffer_len < super->len_header)
+        return;
+
+    uint8_t *b = *buffer;
+    if (packet->compact) {
+        uint8_t flags = (packet->command ? RS_CHANNEL_LAYER_COMPACT_COMMAND : 0) |
+                        (packet->has_stats ? RS_CHANNEL_LAYER_COMPACT_STATS : 0);
+
+        rs_store_be16(b, packet->channel | RS_CHANNEL_LAYER_PACKET_COMPACT);
+        b[2] = flags;
+        b[3] = (uint8_t)packet->seq;
+        b += RS_CHANNEL_LAYER_PACKET_COMPACT_LEN;
+
+        if (packet->command)
+            *(b++) = packet->command;
+        if (packet->has_stats)
+            rs_stats_packed_store(&packet->stats, b);
+    } else {
+        rs_store_be16(b, packet->channel);
+        rs_store_be16(b + 2, packet->seq);
+        rs_stats_packed_store(&packet->stats, b + 4);
+        b[4 + RS_STATS_PACKED_LEN] = packet->command;
+    }
+
+    (*buffer) += super->len_header;
+    (*buffer_len) -= super->len_header;
+}
 
-pack_err:;
+void rs_channel_layer_packet_set_format(struct rs_channel_layer_packet *packet,
+                                        int compact, int has_stats) {
+    packet->compact = compact;
+    packet->has_stats = compact ? has_stats : 1;
+
+    if (compact) {
+        packet->super.len_header = RS_CHANNEL_LAYER_PACKET_COMPACT_LEN +
+                                   (packet->command ? 1 : 0) +
+                                   (packet->has_stats ? RS_STATS_PACKED_LEN : 0);
+    } else {
+        packet->super.len_header = RS_CHANNEL_LAYER_PACKET_HEADER_LEN;
+    }
 }
 
 void rs_channel_layer_packet_init(struct rs_channel_layer_packet *packet,
-                                  void *payload_ownership,
+                                  struct rs_buffer *payload_ownership,
                                   struct rs_packet *payload_packet,
                                   uint8_t *payload_data, int payload_data_len) {
     rs_packet_init(&packet->super, payload_ownership, payload_packet,
                    payload_data, payload_data_len);
     packet->super.vtable = &vtable;
+    packet->command = 0;
+    rs_channel_layer_packet_set_format(packet, 0, 1);
 }
 
 int rs_channel_layer_packet_unpack(struct rs_channel_layer_packet *packet,
-                                   void *payload_ownership,
+                                   struct rs_buffer *payload_ownership,
                                    uint8_t *payload_data,
                                    int payload_data_len) {
 
     rs_channel_layer_packet_init(packet, payload_ownership, NULL, payload_data,
                                  payload_data_len);
 
-    UNPACK(&packet->super.payload_data, &packet->super.payload_data_len,
-           rs_channel_t, &packet->channel);
-    UNPACK(&packet->super.payload_data, &packet->super.payload_data_len,
-           rs_channel_layer_seq_t, &packet->seq);
-
-    if (rs_stats_packed_unpack(&packet->stats, &packet->super.payload_data,
-                               &packet->super.payload_data_len))
-        goto unpack_err;
-
-    UNPACK(&packet->super.payload_data, &packet->super.payload_data_len,
-           uint8_t, &packet->command);
+    uint8_t *b = packet->super.payload_data;
+    int len = packet->super.payload_data_len;
+    if (len < 2)
+        return -1;
+
+    packet->channel = rs_load_be16(b);
+    if (packet->channel & RS_CHANNEL_LAYER_PACKET_COMPACT) {
+        if (len < RS_CHANNEL_LAYER_PACKET_COMPACT_LEN)
+            return -1;
+
+        uint8_t flags = b[2];
+        packet->channel &= ~RS_CHANNEL_LAYER_PACKET_COMPACT;
+        packet->seq = b[3];
+        packet->command = 0;
+        if (flags & RS_CHANNEL_LAYER_COMPACT_COMMAND) {
+            if (len < RS_CHANNEL_LAYER_PACKET_COMPACT_LEN + 1)
+                return -1;
+            packet->command = b[RS_CHANNEL_LAYER_PACKET_COMPACT_LEN];
+        }
+        rs_channel_layer_packet_set_format(
+            packet, 1, !!(flags & RS_CHANNEL_LAYER_COMPACT_STATS));
+
+        if (len < packet->super.len_header)
+            return -1;
+        if (packet->has_stats)
+            rs_stats_packed_load(&packet->stats,
+                                 b + packet->super.len_header -
+                                     RS_STATS_PACKED_LEN);
+    } else {
+        if (len < RS_CHANNEL_LAYER_PACKET_HEADER_LEN)
+            return -1;
+
+        packet->seq = rs_load_be16(b + 2);
+        rs_stats_packed_load(&packet->stats, b + 4);
+        packet->command = b[4 + RS_STATS_PACKED_LEN];
+    }
+
+    packet->super.payload_data += packet->super.len_header;
+    packet->super.payload_data_len -= packet->super.len_header;
 
     return 0;
-
-unpack_err:
-    return -1;
 }
 
 static struct rs_packet_vtable vtable = {
     .destroy = &rs_packet_base_destroy,
     .len = &rs_packet_base_len,
     .pack = &rs_packet_base_pack,
-    .len_header = &rs_channel_layer_packet_len_header,
     .pack_header = &rs_channel_layer_packet_pack_header};
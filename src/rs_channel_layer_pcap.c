@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* sendmmsg */
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -5,9 +6,15 @@
 #include <syslog.h>
 #include <unistd.h>
 
+#include <linux/filter.h>
 #include <linux/if.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
 #include <linux/nl80211.h>
+#include <poll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 
 #include <netlink/genl/ctrl.h>
 #include <netlink/genl/family.h>
@@ -225,6 +232,285 @@ static void nl_set_channel(struct rs_channel_layer_pcap *layer,
     layer->on_channel = channel;
 }
 
+/*
+ ************************************************************************
+ * PACKET_MMAP TX ring
+ *
+ * - https://www.kernel.org/doc/Documentation/networking/packet_mmap.txt
+ */
+/* Bind fd (AF_PACKET) to the interface of layer, protocol in network order */
+static int ring_bind(struct rs_channel_layer_pcap *layer, int fd,
+                     uint16_t protocol, const char *name) {
+    struct ifreq ifr = {0};
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", layer->nl_ifname);
+    if (ioctl(fd, SIOCGIFINDEX, &ifr)) {
+        syslog(LOG_ERR, "%s: SIOCGIFINDEX", name);
+        return -1;
+    }
+
+    struct sockaddr_ll addr = {0};
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = protocol;
+    addr.sll_ifindex = ifr.ifr_ifindex;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        syslog(LOG_ERR, "%s: Could not bind socket", name);
+        return -1;
+    }
+    return 0;
+}
+
+static int tx_ring_init(struct rs_channel_layer_pcap *layer, int frame_nr) {
+    layer->tx_ring.fd = socket(PF_PACKET, SOCK_RAW, 0);
+    if (layer->tx_ring.fd < 0) {
+        syslog(LOG_ERR, "TX ring: Could not open socket");
+        return -1;
+    }
+
+    int version = TPACKET_V2;
+    if (setsockopt(layer->tx_ring.fd, SOL_PACKET, PACKET_VERSION, &version,
+                   sizeof(version))) {
+        syslog(LOG_ERR, "TX ring: Could not set TPACKET_V2");
+        goto err;
+    }
+
+    /* Frames are sized to hold everything _transmit could possibly write, and
+     * are a power of two so they tile the (page-sized) blocks */
+    int frame_size = getpagesize();
+    while (frame_size < TPACKET_ALIGN(TPACKET2_HDRLEN + RS_PCAP_TX_BUFSIZE))
+        frame_size *= 2;
+    while (frame_size / 2 >= TPACKET_ALIGN(TPACKET2_HDRLEN + RS_PCAP_TX_BUFSIZE))
+        frame_size /= 2;
+    int block_size = frame_size < getpagesize() ? getpagesize() : frame_size;
+
+    struct tpacket_req req = {0};
+    req.tp_frame_size = frame_size;
+    req.tp_block_size = block_size;
+    req.tp_block_nr = (frame_nr * frame_size + block_size - 1) / block_size;
+    req.tp_frame_nr = req.tp_block_nr * (block_size / frame_size);
+
+    if (setsockopt(layer->tx_ring.fd, SOL_PACKET, PACKET_TX_RING, &req,
+                   sizeof(req))) {
+        syslog(LOG_ERR, "TX ring: Could not set up PACKET_TX_RING");
+        goto err;
+    }
+
+    /* bind to interface, protocol 0 ensures we do not receive anything */
+    if (ring_bind(layer, layer->tx_ring.fd, 0, "TX ring"))
+        goto err;
+
+    layer->tx_ring.map_len = req.tp_block_size * req.tp_block_nr;
+    layer->tx_ring.map = mmap(NULL, layer->tx_ring.map_len,
+                              PROT_READ | PROT_WRITE, MAP_SHARED,
+                              layer->tx_ring.fd, 0);
+    if (layer->tx_ring.map == MAP_FAILED) {
+        syslog(LOG_ERR, "TX ring: mmap failed");
+        layer->tx_ring.map = NULL;
+        goto err;
+    }
+
+    layer->tx_ring.frame_size = req.tp_frame_size;
+    layer->tx_ring.frame_nr = req.tp_frame_nr;
+    layer->tx_ring.frame_at = 0;
+    layer->tx_ring.n_pending = 0;
+
+    syslog(LOG_NOTICE, "TX ring: %d frames of %db", layer->tx_ring.frame_nr,
+           layer->tx_ring.frame_size);
+    return 0;
+
+err:
+    close(layer->tx_ring.fd);
+    layer->tx_ring.fd = -1;
+    return -1;
+}
+
+static void tx_ring_destroy(struct rs_channel_layer_pcap *layer) {
+    if (layer->tx_ring.map)
+        munmap(layer->tx_ring.map, layer->tx_ring.map_len);
+    if (layer->tx_ring.fd >= 0)
+        close(layer->tx_ring.fd);
+    layer->tx_ring.map = NULL;
+    layer->tx_ring.fd = -1;
+}
+
+static int tx_ring_flush(struct rs_channel_layer_pcap *layer) {
+    if (!layer->tx_ring.n_pending)
+        return 0;
+
+    /* Blocking send processes all frames marked TP_STATUS_SEND_REQUEST */
+    int res = send(layer->tx_ring.fd, NULL, 0, 0);
+    layer->tx_ring.n_pending = 0;
+    if (res < 0) {
+        syslog(LOG_ERR, "TX ring: send failed: %s", strerror(errno));
+        return -1;
+    }
+    return res;
+}
+
+/* Returns the next free frame, flushing and waiting for the kernel if the ring
+ * is full */
+static struct tpacket2_hdr *tx_ring_next(struct rs_channel_layer_pcap *layer) {
+    for (;;) {
+        struct tpacket2_hdr *hdr =
+            (struct tpacket2_hdr *)(layer->tx_ring.map +
+                                    layer->tx_ring.frame_at *
+                                        layer->tx_ring.frame_size);
+
+        switch (hdr->tp_status) {
+        case TP_STATUS_AVAILABLE:
+            return hdr;
+        case TP_STATUS_WRONG_FORMAT:
+            syslog(LOG_ERR, "TX ring: frame rejected by kernel");
+            hdr->tp_status = TP_STATUS_AVAILABLE;
+            return hdr;
+        default:
+            /* TP_STATUS_SEND_REQUEST / TP_STATUS_SENDING */
+            if (tx_ring_flush(layer) < 0)
+                return NULL;
+
+            struct pollfd pfd = {.fd = layer->tx_ring.fd, .events = POLLOUT};
+            if (poll(&pfd, 1, 100) <= 0) {
+                syslog(LOG_ERR, "TX ring: timeout waiting for free frame");
+                return NULL;
+            }
+        }
+    }
+}
+
+/*
+ ************************************************************************
+ * PACKET_MMAP TPACKET_V3 RX ring
+ */
+static int rx_ring_init(struct rs_channel_layer_pcap *layer, int block_nr,
+                        struct bpf_program *filter) {
+    layer->rx_ring.fd = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (layer->rx_ring.fd < 0) {
+        syslog(LOG_ERR, "RX ring: Could not open socket");
+        return -1;
+    }
+
+    int version = TPACKET_V3;
+    if (setsockopt(layer->rx_ring.fd, SOL_PACKET, PACKET_VERSION, &version,
+                   sizeof(version))) {
+        syslog(LOG_ERR, "RX ring: Could not set TPACKET_V3");
+        goto err;
+    }
+
+    /* Attach the filter compiled by pcap, struct bpf_insn and struct
+     * sock_filter share their layout */
+    struct sock_fprog fprog = {.len = filter->bf_len,
+                               .filter = (struct sock_filter *)filter->bf_insns};
+    if (setsockopt(layer->rx_ring.fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog,
+                   sizeof(fprog))) {
+        syslog(LOG_ERR, "RX ring: Could not attach filter");
+        goto err;
+    }
+
+    struct tpacket_req3 req = {0};
+    req.tp_block_size = RS_PCAP_RX_RING_BLOCK_SIZE;
+    req.tp_block_nr = block_nr;
+    req.tp_frame_size = RS_PCAP_RX_RING_FRAME_SIZE;
+    req.tp_frame_nr = (req.tp_block_size / req.tp_frame_size) * block_nr;
+    req.tp_retire_blk_tov = RS_PCAP_RX_RING_BLOCK_TOV_MSEC;
+
+    if (setsockopt(layer->rx_ring.fd, SOL_PACKET, PACKET_RX_RING, &req,
+                   sizeof(req))) {
+        syslog(LOG_ERR, "RX ring: Could not set up PACKET_RX_RING");
+        goto err;
+    }
+
+    layer->rx_ring.map_len = req.tp_block_size * req.tp_block_nr;
+    layer->rx_ring.map = mmap(NULL, layer->rx_ring.map_len,
+                              PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED,
+                              layer->rx_ring.fd, 0);
+    if (layer->rx_ring.map == MAP_FAILED) {
+        /* MAP_LOCKED may exceed RLIMIT_MEMLOCK */
+        layer->rx_ring.map =
+            mmap(NULL, layer->rx_ring.map_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED, layer->rx_ring.fd, 0);
+    }
+    if (layer->rx_ring.map == MAP_FAILED) {
+        syslog(LOG_ERR, "RX ring: mmap failed");
+        layer->rx_ring.map = NULL;
+        goto err;
+    }
+
+    if (ring_bind(layer, layer->rx_ring.fd, htons(ETH_P_ALL), "RX ring"))
+        goto err;
+
+    layer->rx_ring.block_size = req.tp_block_size;
+    layer->rx_ring.block_nr = req.tp_block_nr;
+    layer->rx_ring.block_at = 0;
+    layer->rx_ring.block_held = 0;
+    layer->rx_ring.n_left = 0;
+    layer->rx_ring.frame = NULL;
+
+    syslog(LOG_NOTICE, "RX ring: %d blocks of %db", layer->rx_ring.block_nr,
+           layer->rx_ring.block_size);
+    return 0;
+
+err:
+    if (layer->rx_ring.map)
+        munmap(layer->rx_ring.map, layer->rx_ring.map_len);
+    layer->rx_ring.map = NULL;
+    close(layer->rx_ring.fd);
+    layer->rx_ring.fd = -1;
+    return -1;
+}
+
+static void rx_ring_destroy(struct rs_channel_layer_pcap *layer) {
+    if (layer->rx_ring.map)
+        munmap(layer->rx_ring.map, layer->rx_ring.map_len);
+    if (layer->rx_ring.fd >= 0)
+        close(layer->rx_ring.fd);
+    layer->rx_ring.map = NULL;
+    layer->rx_ring.fd = -1;
+}
+
+/*
+ * Returns the next frame or NULL. The block containing the frame is kept from
+ * the kernel until the next call, which makes it safe to reference the frame
+ * from received packets in the meantime
+ */
+static struct tpacket3_hdr *rx_ring_next(struct rs_channel_layer_pcap *layer) {
+    struct tpacket_block_desc *block =
+        (struct tpacket_block_desc *)(layer->rx_ring.map +
+                                      layer->rx_ring.block_at *
+                                          layer->rx_ring.block_size);
+
+    if (layer->rx_ring.block_held && !layer->rx_ring.n_left) {
+        /* Done with this block - return it to the kernel */
+        __sync_synchronize();
+        block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        layer->rx_ring.block_held = 0;
+        layer->rx_ring.block_at =
+            (layer->rx_ring.block_at + 1) % layer->rx_ring.block_nr;
+
+        block = (struct tpacket_block_desc *)(layer->rx_ring.map +
+                                              layer->rx_ring.block_at *
+                                                  layer->rx_ring.block_size);
+    }
+
+    if (!layer->rx_ring.block_held) {
+        if (!(block->hdr.bh1.block_status & TP_STATUS_USER))
+            return NULL;
+        __sync_synchronize();
+
+        layer->rx_ring.block_held = 1;
+        layer->rx_ring.n_left = block->hdr.bh1.num_pkts;
+        layer->rx_ring.frame =
+            (uint8_t *)block + block->hdr.bh1.offset_to_first_pkt;
+
+        if (!layer->rx_ring.n_left)
+            return rx_ring_next(layer);
+    }
+
+    struct tpacket3_hdr *frame = (struct tpacket3_hdr *)layer->rx_ring.frame;
+    layer->rx_ring.frame += frame->tp_next_offset;
+    layer->rx_ring.n_left--;
+
+    return frame;
+}
+
 /*
  ************************************************************************
  * setup/shutdown code
@@ -236,6 +522,10 @@ int rs_channel_layer_pcap_init(struct rs_channel_layer_pcap *layer,
                                config_setting_t *conf) {
     rs_channel_layer_init(&layer->super, server, ch_base, &vtable);
     layer->pcap = NULL;
+    layer->tx_ring.fd = -1;
+    layer->tx_ring.map = NULL;
+    layer->rx_ring.fd = -1;
+    layer->rx_ring.map = NULL;
 
     /* read config */
     const char *ifname;
@@ -252,6 +542,18 @@ int rs_channel_layer_pcap_init(struct rs_channel_layer_pcap *layer,
 
     layer->phy_conf.use_short_gi = 0;
     config_setting_lookup_bool(conf, "short_gi", &layer->phy_conf.use_short_gi);
+    layer->phy_conf.mcs_max = RS_PCAP_MCS_MAX;
+    config_setting_lookup_int(conf, "mcs_max", &layer->phy_conf.mcs_max);
+
+    int use_tx_ring = 0;
+    config_setting_lookup_bool(conf, "tx_ring", &use_tx_ring);
+    int tx_ring_frames = RS_PCAP_TX_RING_FRAMES;
+    config_setting_lookup_int(conf, "tx_ring_frames", &tx_ring_frames);
+
+    int use_rx_ring = 0;
+    config_setting_lookup_bool(conf, "rx_ring", &use_rx_ring);
+    int rx_ring_blocks = RS_PCAP_RX_RING_BLOCKS;
+    config_setting_lookup_int(conf, "rx_ring_blocks", &rx_ring_blocks);
 
     /* initialize nl80211 */
     layer->nl_socket = nl_socket_alloc();
@@ -445,8 +747,29 @@ int rs_channel_layer_pcap_init(struct rs_channel_layer_pcap *layer,
         return -1;
     }
 
+    /* set up RX ring */
+    if (use_rx_ring) {
+        if (rx_ring_init(layer, rx_ring_blocks, &bpfprogram)) {
+            syslog(LOG_ERR, "Unable to set up RX ring, falling back to pcap");
+        } else {
+            /* pcap is only used for TX from now on, stop its socket from
+             * receiving (and buffering) the same frames */
+            struct sock_filter reject = BPF_STMT(BPF_RET | BPF_K, 0);
+            struct sock_fprog fprog = {.len = 1, .filter = &reject};
+            if (setsockopt(pcap_fileno(layer->pcap), SOL_SOCKET,
+                           SO_ATTACH_FILTER, &fprog, sizeof(fprog))) {
+                syslog(LOG_ERR, "Unable to disable pcap RX");
+            }
+        }
+    }
+
     pcap_freecode(&bpfprogram);
 
+    /* set up TX ring */
+    if (use_tx_ring && tx_ring_init(layer, tx_ring_frames)) {
+        syslog(LOG_ERR, "Unable to set up TX ring, falling back to pcap_inject");
+    }
+
     /* set initial channel */
     struct rs_channel_layer_pcap_phys_channel initial = {
         .band = RS_PCAP_CHAN_2_4G_NO_HT, .channel = 0, .mcs = 0};
@@ -459,6 +782,9 @@ static void _destroy(struct rs_channel_layer *super) {
     rs_channel_layer_base_destroy(super);
 
     struct rs_channel_layer_pcap *layer = rs_cast(rs_channel_layer_pcap, super);
+    tx_ring_flush(layer);
+    tx_ring_destroy(layer);
+    rx_ring_destroy(layer);
     if (layer->pcap)
         pcap_close(layer->pcap);
     nl_cb_put(layer->nl_cb);
@@ -517,22 +843,17 @@ static uint8_t ieee80211_header[] __attribute__((unused)) = {
 };
 // clang-format on
 
-static int _transmit(struct rs_channel_layer *super, struct rs_packet *packet,
-                     rs_channel_t channel) {
-    struct rs_channel_layer_pcap *layer = rs_cast(rs_channel_layer_pcap, super);
+#define RS_PCAP_TX_FRAME_HEADER_LEN                                            \
+    (sizeof(tx_radiotap_header) + sizeof(ieee80211_header))
 
-    if (!rs_channel_layer_owns_channel(super, channel)) {
-        syslog(LOG_ERR, "Attempting to send packet through wrong channel");
-        return -1;
-    }
-    struct rs_channel_layer_pcap_phys_channel chan =
-        rs_channel_layer_pcap_phys_channel_unpack(
-            rs_channel_layer_extract(&layer->super, channel));
-    nl_set_channel(layer, chan, 0);
-
-    uint8_t tx_buf[RS_PCAP_TX_BUFSIZE];
-    uint8_t *tx_ptr = tx_buf;
-    int tx_len = RS_PCAP_TX_BUFSIZE;
+/*
+ * Writes radiotap / IEEE802.11 headers (RS_PCAP_TX_FRAME_HEADER_LEN bytes)
+ * into buf
+ */
+static void _pack_frame_header(struct rs_channel_layer_pcap *layer,
+                               struct rs_channel_layer_pcap_phys_channel chan,
+                               uint8_t *buf) {
+    uint8_t *tx_ptr = buf;
 
     /* Radiotap header */
     memcpy(tx_ptr, tx_radiotap_header, sizeof(tx_radiotap_header));
@@ -559,7 +880,6 @@ static int _transmit(struct rs_channel_layer *super, struct rs_packet *packet,
     tx_ptr[12] = chan.mcs;
 
     tx_ptr += sizeof(tx_radiotap_header);
-    tx_len -= sizeof(tx_radiotap_header);
 
     /* IEEE802.11 header */
     memcpy(tx_ptr, ieee80211_header, sizeof(ieee80211_header));
@@ -572,21 +892,294 @@ static int _transmit(struct rs_channel_layer *super, struct rs_packet *packet,
     for (int i = 0; i < sizeof(rs_server_id_t); i++) {
         tx_ptr[21 - i] = (uint8_t)(layer->super.server->other_id >> (8 * i));
     }
+}
 
-    tx_ptr += sizeof(ieee80211_header);
-    tx_len -= sizeof(ieee80211_header);
+/*
+ * Writes radiotap / IEEE802.11 headers and packet into buf, returns the number
+ * of bytes written
+ */
+static int _pack_frame(struct rs_channel_layer_pcap *layer,
+                       struct rs_channel_layer_pcap_phys_channel chan,
+                       struct rs_packet *packet, uint8_t *buf, int buf_len) {
+    _pack_frame_header(layer, chan, buf);
 
-    /* Payload */
+    uint8_t *tx_ptr = buf + RS_PCAP_TX_FRAME_HEADER_LEN;
+    int tx_len = buf_len - RS_PCAP_TX_FRAME_HEADER_LEN;
     rs_packet_pack(packet, &tx_ptr, &tx_len);
 
+    return tx_ptr - buf;
+}
+
+/* Queue a frame in the TX ring, the device has to be on chan already */
+static int _transmit_ring(struct rs_channel_layer_pcap *layer,
+                          struct rs_channel_layer_pcap_phys_channel chan,
+                          struct rs_packet *packet) {
+    struct tpacket2_hdr *hdr = tx_ring_next(layer);
+    if (!hdr)
+        return -1;
+
+    uint8_t *data =
+        (uint8_t *)hdr + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+    int len = _pack_frame(layer, chan, packet, data, RS_PCAP_TX_BUFSIZE);
+
+    hdr->tp_len = len;
+    __sync_synchronize();
+    hdr->tp_status = TP_STATUS_SEND_REQUEST;
+
+    layer->tx_ring.frame_at =
+        (layer->tx_ring.frame_at + 1) % layer->tx_ring.frame_nr;
+    layer->tx_ring.n_pending++;
+
+    /* Do not let a single batch occupy the whole ring */
+    if (layer->tx_ring.n_pending >= layer->tx_ring.frame_nr / 2) {
+        if (tx_ring_flush(layer) < 0)
+            return -1;
+    }
+
+    return len;
+}
+
+/* Tune to the channel of the frames about to be sent */
+static int _transmit_set_channel(struct rs_channel_layer_pcap *layer,
+                                 rs_channel_t channel,
+                                 struct rs_channel_layer_pcap_phys_channel *chan) {
+    if (!rs_channel_layer_owns_channel(&layer->super, channel)) {
+        syslog(LOG_ERR, "Attempting to send packet through wrong channel");
+        return -1;
+    }
+    *chan = rs_channel_layer_pcap_phys_channel_unpack(
+        rs_channel_layer_extract(&layer->super, channel));
+
+    /* Frames queued in the ring need to go out on the channel they were
+     * meant for */
+    if (layer->tx_ring.fd >= 0 &&
+        (chan->channel != layer->on_channel.channel ||
+         chan->band != layer->on_channel.band))
+        tx_ring_flush(layer);
+    nl_set_channel(layer, *chan, 0);
+    return 0;
+}
+
+static int _transmit(struct rs_channel_layer *super, struct rs_packet *packet,
+                     rs_channel_t channel) {
+    struct rs_channel_layer_pcap *layer = rs_cast(rs_channel_layer_pcap, super);
+
+    struct rs_channel_layer_pcap_phys_channel chan;
+    if (_transmit_set_channel(layer, channel, &chan))
+        return -1;
+
+    if (layer->tx_ring.fd >= 0)
+        return _transmit_ring(layer, chan, packet);
+
+    uint8_t tx_buf[RS_PCAP_TX_BUFSIZE];
+    uint8_t *tx_frame = tx_buf;
+    int tx_len;
+
+    if (rs_packet_headroom(packet) >= (int)RS_PCAP_TX_FRAME_HEADER_LEN) {
+        /* Headers go in front of the payload, which is injected as is */
+        tx_frame = rs_packet_pack_inplace(packet) - RS_PCAP_TX_FRAME_HEADER_LEN;
+        _pack_frame_header(layer, chan, tx_frame);
+        tx_len = RS_PCAP_TX_FRAME_HEADER_LEN + rs_packet_len(packet);
+    } else {
+        tx_len = _pack_frame(layer, chan, packet, tx_buf, RS_PCAP_TX_BUFSIZE);
+    }
+
     TIMER_START(pcap_inject);
-    if (pcap_inject(layer->pcap, tx_buf, tx_ptr - tx_buf) != tx_ptr - tx_buf) {
+    if (pcap_inject(layer->pcap, tx_frame, tx_len) != tx_len) {
         return -1;
     }
-    TIMER_STOP(pcap_inject, tx_ptr - tx_buf);
+    TIMER_STOP(pcap_inject, tx_len);
     TIMER_PRINT(pcap_inject, 2);
 
-    return tx_ptr - tx_buf;
+    return tx_len;
+}
+
+/*
+ * Without TX ring all frames of the batch are handed to the socket behind
+ * pcap with a single sendmmsg. Headers are placed in front of the payloads,
+ * packets without headroom are packed into tx_buf
+ */
+static int _transmit_batch(struct rs_channel_layer *super,
+                           struct rs_packet **packets, int n,
+                           rs_channel_t channel) {
+    struct rs_channel_layer_pcap *layer = rs_cast(rs_channel_layer_pcap, super);
+
+    struct rs_channel_layer_pcap_phys_channel chan;
+    if (_transmit_set_channel(layer, channel, &chan))
+        return -1;
+
+    int total_bytes = 0;
+    if (layer->tx_ring.fd >= 0) {
+        for (int i = 0; i < n; i++) {
+            int len = _transmit_ring(layer, chan, packets[i]);
+            if (len < 0)
+                return -1;
+            total_bytes += len;
+        }
+        return total_bytes;
+    }
+
+    static uint8_t tx_buf[RS_CHANNEL_LAYER_BATCH][RS_PCAP_TX_BUFSIZE];
+    struct iovec iov[RS_CHANNEL_LAYER_BATCH];
+    struct mmsghdr msgs[RS_CHANNEL_LAYER_BATCH];
+    memset(msgs, 0, n * sizeof(*msgs));
+
+    for (int i = 0; i < n; i++) {
+        if (rs_packet_headroom(packets[i]) >=
+            (int)RS_PCAP_TX_FRAME_HEADER_LEN) {
+            iov[i].iov_base = rs_packet_pack_inplace(packets[i]) -
+                              RS_PCAP_TX_FRAME_HEADER_LEN;
+            _pack_frame_header(layer, chan, iov[i].iov_base);
+            iov[i].iov_len =
+                RS_PCAP_TX_FRAME_HEADER_LEN + rs_packet_len(packets[i]);
+        } else {
+            iov[i].iov_base = tx_buf[i];
+            iov[i].iov_len = _pack_frame(layer, chan, packets[i], tx_buf[i],
+                                         RS_PCAP_TX_BUFSIZE);
+        }
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        total_bytes += iov[i].iov_len;
+    }
+
+    TIMER_START(pcap_sendmmsg);
+    int sent = 0;
+    while (sent < n) {
+        int res = sendmmsg(pcap_fileno(layer->pcap), msgs + sent, n - sent, 0);
+        if (res <= 0) {
+            syslog(LOG_ERR, "sendmmsg failed after %d of %d frames: %s", sent,
+                   n, strerror(errno));
+            return -1;
+        }
+        sent += res;
+    }
+    TIMER_STOP(pcap_sendmmsg, total_bytes);
+    TIMER_PRINT(pcap_sendmmsg, 2);
+
+    return total_bytes;
+}
+
+static int _flush(struct rs_channel_layer *super) {
+    struct rs_channel_layer_pcap *layer = rs_cast(rs_channel_layer_pcap, super);
+    if (layer->tx_ring.fd < 0)
+        return 0;
+
+    TIMER_START(tx_ring_flush);
+    int res = tx_ring_flush(layer);
+    TIMER_STOP(tx_ring_flush, res > 0 ? res : 0);
+    TIMER_PRINT(tx_ring_flush, 2);
+
+    return res;
+}
+
+/*
+ * Parses radiotap / IEEE802.11 headers in place and unpacks the payload,
+ * which stays borrowed from the caller
+ */
+static int _receive_frame(struct rs_channel_layer_pcap *layer,
+                          const uint8_t *radiotap_header, int caplen,
+                          struct rs_channel_layer_packet **packet) {
+    struct ieee80211_radiotap_iterator it;
+    int status = ieee80211_radiotap_iterator_init(
+        &it, (struct ieee80211_radiotap_header *)radiotap_header, caplen,
+        NULL);
+
+    int flags = -1;
+    int mcs_known = -1;
+    int mcs_flags = -1;
+    int mcs = -1;
+    int rate = -1;
+    int chan = -1;
+    int chan_flags = -1;
+    int antenna = -1;
+
+    while (status == 0) {
+        if ((status = ieee80211_radiotap_iterator_next(&it)))
+            continue;
+
+        switch (it.this_arg_index) {
+        case IEEE80211_RADIOTAP_FLAGS:
+            flags = *(uint8_t *)(it.this_arg);
+            break;
+        case IEEE80211_RADIOTAP_MCS:
+            mcs_known = *(uint8_t *)(it.this_arg);
+            mcs_flags = *(((uint8_t *)(it.this_arg)) + 1);
+            mcs = *(((uint8_t *)(it.this_arg)) + 2);
+            break;
+        case IEEE80211_RADIOTAP_RATE:
+            rate = *(uint8_t *)(it.this_arg);
+            break;
+        case IEEE80211_RADIOTAP_CHANNEL:
+            chan = get_unaligned((uint16_t *)(it.this_arg));
+            chan_flags = get_unaligned(((uint16_t *)(it.this_arg)) + 1);
+            break;
+        case IEEE80211_RADIOTAP_ANTENNA:
+            antenna = *(uint8_t *)(it.this_arg);
+            break;
+        default:
+            break;
+        }
+    }
+
+    /* syslog(LOG_DEBUG, "MCS: %3d <-> Expected: %3d", mcs, */
+    /*        rs_channel_layer_pcap_phys_channel_unpack( */
+    /*            rs_channel_layer_extract(&layer->super, channel)) */
+    /*            .mcs); */
+
+    /* syslog(LOG_DEBUG, */
+    /*        "rate: %d MCS: known %02x flags %02x mcs %d Channel: %d flags
+     * " */
+    /*        "%04x Antenna: %d", */
+    /*        rate, mcs_known, mcs_flags, mcs, chan, chan_flags, antenna);
+     */
+
+    if (flags >= 0 && (((uint8_t)flags) & IEEE80211_RADIOTAP_F_BADFCS)) {
+        syslog(LOG_DEBUG, "Received bad FCS packet");
+        return RS_CHANNEL_LAYER_BADFCS;
+    }
+
+    const uint8_t *payload = radiotap_header + it._max_length;
+    int payload_len = caplen - it._max_length;
+    if (flags >= 0 && (((uint8_t)flags) & IEEE80211_RADIOTAP_F_FCS)) {
+        payload_len -= 4;
+    }
+
+    payload += sizeof(ieee80211_header);
+    payload_len -= sizeof(ieee80211_header);
+
+    if (payload_len < 0)
+        return RS_CHANNEL_LAYER_IRR;
+
+    struct rs_channel_layer_packet *unpacked = rs_channel_layer_packet_alloc();
+
+    /* No copy - payload is borrowed from the ring / pcap buffer */
+    if (rs_channel_layer_packet_unpack(unpacked, NULL, (uint8_t *)payload,
+                                       payload_len)) {
+        syslog(LOG_DEBUG,
+               "Received packet which could not be unpacked on channel "
+               "layer (%db)",
+               payload_len);
+        rs_packet_destroy(&unpacked->super);
+        rs_channel_layer_packet_free(unpacked);
+        return RS_CHANNEL_LAYER_IRR;
+    }
+
+    if (mcs_known > 0 &&
+        ((uint8_t)mcs_known & IEEE80211_RADIOTAP_MCS_HAVE_MCS)) {
+        int mcs_c =
+            rs_channel_layer_pcap_phys_channel_unpack(
+                rs_channel_layer_extract(&layer->super, unpacked->channel))
+                .mcs;
+        if (mcs != mcs_c) {
+            syslog(LOG_NOTICE,
+                   "Received packet with MCS=%d on channel with MCS=%d", mcs,
+                   mcs_c);
+        }
+    }
+
+    (*packet) = unpacked;
+
+    return 0;
 }
 
 static int _receive(struct rs_channel_layer *super,
@@ -604,117 +1197,70 @@ static int _receive(struct rs_channel_layer *super,
         nl_set_channel(layer, chan, 0);
     }
 
-    struct pcap_pkthdr header;
-    const uint8_t *radiotap_header = pcap_next(layer->pcap, &header);
-
-    if (radiotap_header) {
-        struct ieee80211_radiotap_iterator it;
-        int status = ieee80211_radiotap_iterator_init(
-            &it, (struct ieee80211_radiotap_header *)radiotap_header,
-            header.caplen, NULL);
-
-        int flags = -1;
-        int mcs_known = -1;
-        int mcs_flags = -1;
-        int mcs = -1;
-        int rate = -1;
-        int chan = -1;
-        int chan_flags = -1;
-        int antenna = -1;
-
-        while (status == 0) {
-            if ((status = ieee80211_radiotap_iterator_next(&it)))
-                continue;
-
-            switch (it.this_arg_index) {
-            case IEEE80211_RADIOTAP_FLAGS:
-                flags = *(uint8_t *)(it.this_arg);
-                break;
-            case IEEE80211_RADIOTAP_MCS:
-                mcs_known = *(uint8_t *)(it.this_arg);
-                mcs_flags = *(((uint8_t *)(it.this_arg)) + 1);
-                mcs = *(((uint8_t *)(it.this_arg)) + 2);
-                break;
-            case IEEE80211_RADIOTAP_RATE:
-                rate = *(uint8_t *)(it.this_arg);
-                break;
-            case IEEE80211_RADIOTAP_CHANNEL:
-                chan = get_unaligned((uint16_t *)(it.this_arg));
-                chan_flags = get_unaligned(((uint16_t *)(it.this_arg)) + 1);
-                break;
-            case IEEE80211_RADIOTAP_ANTENNA:
-                antenna = *(uint8_t *)(it.this_arg);
-                break;
-            default:
-                break;
-            }
-        }
-
-        /* syslog(LOG_DEBUG, "MCS: %3d <-> Expected: %3d", mcs, */
-        /*        rs_channel_layer_pcap_phys_channel_unpack( */
-        /*            rs_channel_layer_extract(&layer->super, channel)) */
-        /*            .mcs); */
+    if (layer->rx_ring.fd >= 0) {
+        struct tpacket3_hdr *frame = rx_ring_next(layer);
+        if (!frame)
+            return RS_CHANNEL_LAYER_EOF;
 
-        /* syslog(LOG_DEBUG, */
-        /*        "rate: %d MCS: known %02x flags %02x mcs %d Channel: %d flags
-         * " */
-        /*        "%04x Antenna: %d", */
-        /*        rate, mcs_known, mcs_flags, mcs, chan, chan_flags, antenna);
-         */
+        return _receive_frame(layer, (uint8_t *)frame + frame->tp_mac,
+                              frame->tp_snaplen, packet);
+    }
 
-        if (flags >= 0 && (((uint8_t)flags) & IEEE80211_RADIOTAP_F_BADFCS)) {
-            syslog(LOG_DEBUG, "Received bad FCS packet");
-            return RS_CHANNEL_LAYER_BADFCS;
-        }
+    /* Data returned by pcap_next_ex stays valid until the next call */
+    struct pcap_pkthdr *header;
+    const uint8_t *radiotap_header;
+    if (pcap_next_ex(layer->pcap, &header, &radiotap_header) != 1)
+        return RS_CHANNEL_LAYER_EOF;
 
-        const uint8_t *payload = radiotap_header + it._max_length;
-        int payload_len = header.caplen - it._max_length;
-        if (flags >= 0 && (((uint8_t)flags) & IEEE80211_RADIOTAP_F_FCS)) {
-            payload_len -= 4;
-        }
+    return _receive_frame(layer, radiotap_header, header->caplen, packet);
+}
 
-        payload += sizeof(ieee80211_header);
-        payload_len -= sizeof(ieee80211_header);
+/*
+ * With RX ring, frames of the currently held block are received up to the
+ * block boundary (the block is only returned to the kernel on the next call),
+ * otherwise a single frame
+ */
+static int _receive_batch(struct rs_channel_layer *super,
+                          struct rs_channel_layer_packet **packets, int *n,
+                          rs_channel_t channel) {
 
-        if (payload_len < 0)
-            return RS_CHANNEL_LAYER_EOF;
+    struct rs_channel_layer_pcap *layer = rs_cast(rs_channel_layer_pcap, super);
+    int max = *n;
+    *n = 0;
+
+    if (layer->rx_ring.fd < 0) {
+        int res = _receive(super, &packets[0], channel);
+        if (!res)
+            *n = 1;
+        return res == RS_CHANNEL_LAYER_IRR || res == RS_CHANNEL_LAYER_BADFCS
+                   ? 0
+                   : res;
+    }
 
-        uint8_t *payload_copy = calloc(payload_len, sizeof(uint8_t));
-        memcpy(payload_copy, payload, payload_len);
-
-        struct rs_channel_layer_packet *unpacked =
-            calloc(1, sizeof(struct rs_channel_layer_packet));
-
-        if (rs_channel_layer_packet_unpack(unpacked, payload_copy, payload_copy,
-                                           payload_len)) {
-            syslog(LOG_DEBUG,
-                   "Received packet which could not be unpacked on channel "
-                   "layer (%db)",
-                   payload_len);
-            rs_packet_destroy(&unpacked->super);
-            free(unpacked);
-            return RS_CHANNEL_LAYER_IRR;
-        }
+    if (layer->pcap == NULL) {
+        return -1;
+    }
+    if (channel) {
+        struct rs_channel_layer_pcap_phys_channel chan =
+            rs_channel_layer_pcap_phys_channel_unpack(
+                rs_channel_layer_extract(&layer->super, channel));
+        nl_set_channel(layer, chan, 0);
+    }
 
-        if (mcs_known > 0 &&
-            ((uint8_t)mcs_known & IEEE80211_RADIOTAP_MCS_HAVE_MCS)) {
-            int mcs_c =
-                rs_channel_layer_pcap_phys_channel_unpack(
-                    rs_channel_layer_extract(&layer->super, unpacked->channel))
-                    .mcs;
-            if (mcs != mcs_c) {
-                syslog(LOG_NOTICE,
-                       "Received packet with MCS=%d on channel with MCS=%d",
-                       mcs, mcs_c);
-            }
-        }
+    for (int i = 0; i < max; i++) {
+        if (i && !layer->rx_ring.n_left)
+            return 0;
 
-        (*packet) = unpacked;
+        struct tpacket3_hdr *frame = rx_ring_next(layer);
+        if (!frame)
+            return RS_CHANNEL_LAYER_EOF;
 
-        return 0;
+        if (!_receive_frame(layer, (uint8_t *)frame + frame->tp_mac,
+                            frame->tp_snaplen, &packets[*n]))
+            (*n)++;
     }
 
-    return RS_CHANNEL_LAYER_EOF;
+    return 0;
 }
 
 static int _ch_n(struct rs_channel_layer *super) {
@@ -725,10 +1271,38 @@ static int _max_packet_size(struct rs_channel_layer* layer, rs_channel_t channel
     return 1350;
 }
 
+static int _fd(struct rs_channel_layer *super) {
+    struct rs_channel_layer_pcap *layer = rs_cast(rs_channel_layer_pcap, super);
+    if (layer->rx_ring.fd >= 0)
+        return layer->rx_ring.fd;
+    return layer->pcap ? pcap_get_selectable_fd(layer->pcap) : -1;
+}
+
+static rs_channel_t _rate_step(struct rs_channel_layer *super,
+                               rs_channel_t channel, int dir) {
+    struct rs_channel_layer_pcap *layer = rs_cast(rs_channel_layer_pcap, super);
+    struct rs_channel_layer_pcap_phys_channel chan =
+        rs_channel_layer_pcap_phys_channel_unpack(
+            rs_channel_layer_extract(super, channel));
+
+    int mcs = chan.mcs + (dir > 0 ? 1 : -1);
+    if (mcs < 0 || mcs > layer->phy_conf.mcs_max)
+        return 0;
+
+    /* Inverse of rs_channel_layer_pcap_phys_channel_unpack */
+    return rs_channel_layer_ch(super,
+                               chan.band * 12 * 32 + mcs * 12 + chan.channel);
+}
+
 static struct rs_channel_layer_vtable vtable = {
     .destroy = _destroy,
     ._transmit = _transmit,
+    ._flush = _flush,
     ._receive = _receive,
+    ._transmit_batch = _transmit_batch,
+    ._receive_batch = _receive_batch,
     .ch_n = _ch_n,
     .max_packet_size = _max_packet_size,
+    .rate_step = _rate_step,
+    .fd = _fd,
 };
@@ -10,7 +10,9 @@
 
 #include "rs_app_layer.h"
 #include "rs_command_loop.h"
+#include "rs_fec.h"
 #include "rs_message.h"
+#include "rs_pool.h"
 #include "rs_port_layer.h"
 #include "rs_server_state.h"
 
@@ -23,7 +25,8 @@ static void handle_command(struct rs_message *command,
 
     } else if (command->header.cmd == RS_MESSAGE_CMD_REPORT) {
         int n_reports =
-            1 + state->app_layer->n_connections + state->port_layer->n_ports;
+            1 + state->app_layer->n_connections + state->port_layer->n_ports +
+            RS_POOL_N + 1;
         for (int c = 0; c < state->n_channel_layers; c++) {
             for (int ch = 0;
                  ch < rs_channel_layer_ch_n(state->channel_layers[c]); ch++) {
@@ -81,6 +84,13 @@ static void handle_command(struct rs_message *command,
                                    RS_STATS_PLACE_N + 1] =
                 rs_stat_current(
                     &state->port_layer->ports[i]->rx_stats_fec_factor);
+            answer->payload_double[idx * RS_MESSAGE_CMD_REPORT_N +
+                                   RS_STATS_PLACE_N + 2] =
+                rs_stat_current(&state->port_layer->ports[i]->tx_stats_header);
+            answer->payload_double[idx * RS_MESSAGE_CMD_REPORT_N +
+                                   RS_STATS_PLACE_N + 3] =
+                rs_stat_current(
+                    &state->port_layer->ports[i]->tx_stats_header_full);
             idx++;
         }
 
@@ -107,6 +117,35 @@ static void handle_command(struct rs_message *command,
             }
         }
 
+        for (int i = 0; i < RS_POOL_N; i++) {
+            answer->payload_char[idx] = 'M';
+            answer->payload_int[idx * RS_MESSAGE_CMD_REPORT_N] = i;
+            answer->payload_int[idx * RS_MESSAGE_CMD_REPORT_N + 1] =
+                rs_pools[i].object_size;
+            answer->payload_double[idx * RS_MESSAGE_CMD_REPORT_N] =
+                rs_pools[i].n_in_use;
+            answer->payload_double[idx * RS_MESSAGE_CMD_REPORT_N + 1] =
+                rs_pools[i].n_alloc;
+            answer->payload_double[idx * RS_MESSAGE_CMD_REPORT_N + 2] =
+                rs_pools[i].n_malloc;
+            answer->payload_double[idx * RS_MESSAGE_CMD_REPORT_N + 3] =
+                rs_pools[i].n_slabs;
+            idx++;
+        }
+
+        struct rs_fec_cache_stats fec_cache;
+        rs_fec_cache_stats(&fec_cache);
+        answer->payload_char[idx] = 'F';
+        answer->payload_int[idx * RS_MESSAGE_CMD_REPORT_N] = 0;
+        answer->payload_int[idx * RS_MESSAGE_CMD_REPORT_N + 1] =
+            fec_cache.n_entries;
+        answer->payload_double[idx * RS_MESSAGE_CMD_REPORT_N] = fec_cache.hits;
+        answer->payload_double[idx * RS_MESSAGE_CMD_REPORT_N + 1] =
+            fec_cache.misses;
+        answer->payload_double[idx * RS_MESSAGE_CMD_REPORT_N + 2] =
+            fec_cache.evictions;
+        idx++;
+
         answer->header.cmd = 0;
 
     } else if (command->header.cmd == RS_MESSAGE_CMD_SWITCH_CHANNEL) {
@@ -0,0 +1,589 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RS_FEC_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define RS_FEC_NEON
+#include <arm_neon.h>
+#endif
+
+#include "rs_fec.h"
+
+/* Same field as zfec: x^8 + x^4 + x^3 + x^2 + 1 */
+#define RS_FEC_GF_POLY 0x11D
+
+/* Blocks are processed in chunks, so that the output stays in L1 while all
+ * inputs are accumulated */
+#define RS_FEC_CHUNK 4096
+
+static uint8_t gf_exp[510];
+static uint8_t gf_log[256];
+static uint8_t gf_inv[256];
+
+/* Products c * x for the low and high nibble of x */
+static uint8_t gf_nibble[256][2][16] __attribute__((aligned(16)));
+
+static inline uint8_t gf_mul(uint8_t a, uint8_t b) {
+    if (!a || !b)
+        return 0;
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+typedef void (*rs_fec_mul_add_t)(uint8_t *dst, const uint8_t *src, uint8_t c,
+                                 size_t len);
+typedef void (*rs_fec_xor_t)(uint8_t *dst, const uint8_t *src, size_t len);
+
+static void _xor_scalar(uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t d, s;
+        memcpy(&d, dst + i, 8);
+        memcpy(&s, src + i, 8);
+        d ^= s;
+        memcpy(dst + i, &d, 8);
+    }
+    for (; i < len; i++)
+        dst[i] ^= src[i];
+}
+
+static void _mul_add_scalar(uint8_t *dst, const uint8_t *src, uint8_t c,
+                            size_t len) {
+    const uint8_t *lo = gf_nibble[c][0];
+    const uint8_t *hi = gf_nibble[c][1];
+    for (size_t i = 0; i < len; i++)
+        dst[i] ^= lo[src[i] & 0x0f] ^ hi[src[i] >> 4];
+}
+
+#ifdef RS_FEC_X86
+__attribute__((target("ssse3"))) static void
+_mul_add_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    const __m128i lo = _mm_load_si128((const __m128i *)gf_nibble[c][0]);
+    const __m128i hi = _mm_load_si128((const __m128i *)gf_nibble[c][1]);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i p = _mm_xor_si128(
+            _mm_shuffle_epi8(lo, _mm_and_si128(s, mask)),
+            _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, p));
+    }
+    _mul_add_scalar(dst + i, src + i, c, len - i);
+}
+
+__attribute__((target("sse2"))) static void
+_xor_sse2(uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, s));
+    }
+    _xor_scalar(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx2"))) static void
+_mul_add_avx2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    const __m256i lo = _mm256_broadcastsi128_si256(
+        _mm_load_si128((const __m128i *)gf_nibble[c][0]));
+    const __m256i hi = _mm256_broadcastsi128_si256(
+        _mm_load_si128((const __m128i *)gf_nibble[c][1]));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i p = _mm256_xor_si256(
+            _mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask)),
+            _mm256_shuffle_epi8(hi,
+                                _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, p));
+    }
+    _mul_add_scalar(dst + i, src + i, c, len - i);
+}
+
+__attribute__((target("avx2"))) static void
+_xor_avx2(uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, s));
+    }
+    _xor_scalar(dst + i, src + i, len - i);
+}
+#endif
+
+#ifdef RS_FEC_NEON
+static void _mul_add_neon(uint8_t *dst, const uint8_t *src, uint8_t c,
+                          size_t len) {
+    const uint8x16_t mask = vdupq_n_u8(0x0f);
+#ifdef __aarch64__
+    const uint8x16_t lo = vld1q_u8(gf_nibble[c][0]);
+    const uint8x16_t hi = vld1q_u8(gf_nibble[c][1]);
+#define RS_FEC_TBL(t, i) vqtbl1q_u8(t, i)
+#else
+    const uint8x8x2_t lo = {
+        {vld1_u8(gf_nibble[c][0]), vld1_u8(gf_nibble[c][0] + 8)}};
+    const uint8x8x2_t hi = {
+        {vld1_u8(gf_nibble[c][1]), vld1_u8(gf_nibble[c][1] + 8)}};
+#define RS_FEC_TBL(t, i)                                                       \
+    vcombine_u8(vtbl2_u8(t, vget_low_u8(i)), vtbl2_u8(t, vget_high_u8(i)))
+#endif
+
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t s = vld1q_u8(src + i);
+        uint8x16_t d = vld1q_u8(dst + i);
+        uint8x16_t p = veorq_u8(RS_FEC_TBL(lo, vandq_u8(s, mask)),
+                                RS_FEC_TBL(hi, vshrq_n_u8(s, 4)));
+        vst1q_u8(dst + i, veorq_u8(d, p));
+    }
+#undef RS_FEC_TBL
+    _mul_add_scalar(dst + i, src + i, c, len - i);
+}
+
+static void _xor_neon(uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+        vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), vld1q_u8(src + i)));
+    _xor_scalar(dst + i, src + i, len - i);
+}
+#endif
+
+static struct {
+    const char *name;
+    rs_fec_mul_add_t mul_add;
+    rs_fec_xor_t xor_into;
+} kernels[] = {
+#ifdef RS_FEC_X86
+    {"avx2", &_mul_add_avx2, &_xor_avx2},
+    {"ssse3", &_mul_add_ssse3, &_xor_sse2},
+#endif
+#ifdef RS_FEC_NEON
+    {"neon", &_mul_add_neon, &_xor_neon},
+#endif
+    {"scalar", &_mul_add_scalar, &_xor_scalar},
+};
+
+static int initialized = 0;
+static int kernel = -1;
+
+static int _kernel_supported(const char *name) {
+#ifdef RS_FEC_X86
+    __builtin_cpu_init();
+    if (!strcmp(name, "avx2"))
+        return __builtin_cpu_supports("avx2");
+    if (!strcmp(name, "ssse3"))
+        return __builtin_cpu_supports("ssse3");
+#endif
+    /* NEON is only compiled in if the target guarantees it */
+    return 1;
+}
+
+void rs_fec_init() {
+    if (initialized)
+        return;
+
+    int x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = x;
+        gf_exp[i + 255] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= RS_FEC_GF_POLY;
+    }
+    gf_log[0] = 0;
+    gf_inv[0] = 0;
+    for (int i = 1; i < 256; i++)
+        gf_inv[i] = gf_exp[255 - gf_log[i]];
+
+    for (int c = 0; c < 256; c++) {
+        for (int i = 0; i < 16; i++) {
+            gf_nibble[c][0][i] = gf_mul(c, i);
+            gf_nibble[c][1][i] = gf_mul(c, i << 4);
+        }
+    }
+
+    initialized = 1;
+    if (kernel < 0)
+        rs_fec_select_kernel(NULL);
+}
+
+int rs_fec_select_kernel(const char *name) {
+    rs_fec_init();
+
+    for (int i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if ((!name || !strcmp(name, kernels[i].name)) &&
+            _kernel_supported(kernels[i].name)) {
+            kernel = i;
+            syslog(LOG_NOTICE, "FEC: using %s kernel", kernels[i].name);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *rs_fec_kernel_name() {
+    rs_fec_init();
+    return kernels[kernel].name;
+}
+
+void rs_fec_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    rs_fec_init();
+    if (c == 0)
+        return;
+    kernels[kernel].mul_add(dst, src, c, len);
+}
+
+/*
+ * out[i] = sum_j matrix[i * k + j] * in[j] for n_out rows, restricted to the
+ * bytes [begin, end)
+ */
+static void _matrix_mul_range(const uint8_t *matrix, int k,
+                              const uint8_t *const *in, uint8_t *const *out,
+                              int n_out, size_t begin, size_t end) {
+    rs_fec_mul_add_t mul_add = kernels[kernel].mul_add;
+
+    for (size_t off = begin; off < end; off += RS_FEC_CHUNK) {
+        size_t len = end - off < RS_FEC_CHUNK ? end - off : RS_FEC_CHUNK;
+        for (int i = 0; i < n_out; i++) {
+            memset(out[i] + off, 0, len);
+            for (int j = 0; j < k; j++) {
+                uint8_t c = matrix[i * k + j];
+                if (c)
+                    mul_add(out[i] + off, in[j] + off, c, len);
+            }
+        }
+    }
+}
+
+/*
+ * Worker pool: a matrix multiplication is cut into byte-column stripes, which
+ * are taken by the workers and the calling thread alike. Only one
+ * multiplication runs at a time, FEC is used by a single thread
+ */
+static struct {
+    int n;
+    pthread_t threads[RS_FEC_MAX_WORKERS];
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    int generation;
+    int n_running;
+    int stop;
+
+    /* current job */
+    const uint8_t *matrix;
+    int k;
+    const uint8_t *const *in;
+    uint8_t *const *out;
+    int n_out;
+    size_t sz;
+    size_t stripe;
+    int n_stripes;
+    int next_stripe;
+} workers = {.n = 0,
+             .lock = PTHREAD_MUTEX_INITIALIZER,
+             .start = PTHREAD_COND_INITIALIZER,
+             .done = PTHREAD_COND_INITIALIZER};
+
+static void _run_stripes() {
+    int i;
+    while ((i = __atomic_fetch_add(&workers.next_stripe, 1,
+                                   __ATOMIC_RELAXED)) < workers.n_stripes) {
+        size_t begin = i * workers.stripe;
+        size_t end = begin + workers.stripe;
+        if (end > workers.sz)
+            end = workers.sz;
+        _matrix_mul_range(workers.matrix, workers.k, workers.in, workers.out,
+                          workers.n_out, begin, end);
+    }
+}
+
+/* arg is the generation at start, the first job may be posted before the
+ * worker gets to run */
+static void *_worker_main(void *arg) {
+    int seen = (int)(intptr_t)arg;
+
+    pthread_mutex_lock(&workers.lock);
+    for (;;) {
+        while (workers.generation == seen && !workers.stop)
+            pthread_cond_wait(&workers.start, &workers.lock);
+        if (workers.stop)
+            break;
+        seen = workers.generation;
+        pthread_mutex_unlock(&workers.lock);
+
+        _run_stripes();
+
+        pthread_mutex_lock(&workers.lock);
+        if (--workers.n_running == 0)
+            pthread_cond_signal(&workers.done);
+    }
+    pthread_mutex_unlock(&workers.lock);
+    return NULL;
+}
+
+int rs_fec_workers_start(int n) {
+    rs_fec_workers_stop();
+    if (n > RS_FEC_MAX_WORKERS)
+        n = RS_FEC_MAX_WORKERS;
+
+    workers.stop = 0;
+    for (int i = 0; i < n; i++) {
+        if (pthread_create(&workers.threads[i], NULL, _worker_main,
+                           (void *)(intptr_t)workers.generation)) {
+            syslog(LOG_ERR, "FEC: Could not start worker thread");
+            rs_fec_workers_stop();
+            return -1;
+        }
+        workers.n++;
+    }
+    if (n > 0)
+        syslog(LOG_NOTICE, "FEC: using %d worker threads", n);
+    return 0;
+}
+
+void rs_fec_workers_stop() {
+    pthread_mutex_lock(&workers.lock);
+    workers.stop = 1;
+    pthread_cond_broadcast(&workers.start);
+    pthread_mutex_unlock(&workers.lock);
+
+    for (int i = 0; i < workers.n; i++)
+        pthread_join(workers.threads[i], NULL);
+    workers.n = 0;
+}
+
+static void _matrix_mul(const uint8_t *matrix, int k, const uint8_t *const *in,
+                        uint8_t *const *out, int n_out, size_t sz) {
+    if (!workers.n || (size_t)n_out * k * sz < RS_FEC_PARALLEL_MIN) {
+        _matrix_mul_range(matrix, k, in, out, n_out, 0, sz);
+        return;
+    }
+
+    /* One stripe per thread, aligned so that no cache line is shared */
+    size_t stripe = (sz + workers.n) / (workers.n + 1);
+    stripe = (stripe + 63) & ~(size_t)63;
+
+    pthread_mutex_lock(&workers.lock);
+    workers.matrix = matrix;
+    workers.k = k;
+    workers.in = in;
+    workers.out = out;
+    workers.n_out = n_out;
+    workers.sz = sz;
+    workers.stripe = stripe;
+    workers.n_stripes = (sz + stripe - 1) / stripe;
+    workers.next_stripe = 0;
+    workers.n_running = workers.n;
+    workers.generation++;
+    pthread_cond_broadcast(&workers.start);
+    pthread_mutex_unlock(&workers.lock);
+
+    _run_stripes();
+
+    pthread_mutex_lock(&workers.lock);
+    while (workers.n_running)
+        pthread_cond_wait(&workers.done, &workers.lock);
+    pthread_mutex_unlock(&workers.lock);
+}
+
+void rs_fec_xor(const uint8_t *const *src, int n, uint8_t *dst, size_t sz) {
+    rs_fec_init();
+    rs_fec_xor_t xor_into = kernels[kernel].xor_into;
+
+    for (size_t off = 0; off < sz; off += RS_FEC_CHUNK) {
+        size_t len = sz - off < RS_FEC_CHUNK ? sz - off : RS_FEC_CHUNK;
+        memcpy(dst + off, src[0] + off, len);
+        for (int j = 1; j < n; j++)
+            xor_into(dst + off, src[j] + off, len);
+    }
+}
+
+void rs_fec_encode(const fec_t *code, const uint8_t *const *src,
+                   uint8_t *const *fecs, const unsigned int *block_nums,
+                   size_t num_block_nums, size_t sz) {
+    rs_fec_init();
+
+    int k = code->k;
+    uint8_t rows[num_block_nums * k];
+    for (size_t i = 0; i < num_block_nums; i++)
+        memcpy(rows + i * k, code->enc_matrix + block_nums[i] * k, k);
+
+    _matrix_mul(rows, k, src, fecs, num_block_nums, sz);
+}
+
+/* Gauss-Jordan inversion of the k x k matrix m in place, -1 if singular */
+static int _invert(uint8_t *m, int k) {
+    uint8_t inv[k * k];
+    memset(inv, 0, sizeof(inv));
+    for (int i = 0; i < k; i++)
+        inv[i * k + i] = 1;
+
+    for (int col = 0; col < k; col++) {
+        int pivot = col;
+        while (pivot < k && !m[pivot * k + col])
+            pivot++;
+        if (pivot == k)
+            return -1;
+
+        if (pivot != col) {
+            for (int j = 0; j < k; j++) {
+                uint8_t t = m[col * k + j];
+                m[col * k + j] = m[pivot * k + j];
+                m[pivot * k + j] = t;
+                t = inv[col * k + j];
+                inv[col * k + j] = inv[pivot * k + j];
+                inv[pivot * k + j] = t;
+            }
+        }
+
+        uint8_t f = gf_inv[m[col * k + col]];
+        for (int j = 0; j < k; j++) {
+            m[col * k + j] = gf_mul(m[col * k + j], f);
+            inv[col * k + j] = gf_mul(inv[col * k + j], f);
+        }
+
+        for (int row = 0; row < k; row++) {
+            uint8_t g = m[row * k + col];
+            if (row == col || !g)
+                continue;
+            for (int j = 0; j < k; j++) {
+                m[row * k + j] ^= gf_mul(g, m[col * k + j]);
+                inv[row * k + j] ^= gf_mul(g, inv[col * k + j]);
+            }
+        }
+    }
+
+    memcpy(m, inv, sizeof(inv));
+    return 0;
+}
+
+void rs_fec_decode(const fec_t *code, const uint8_t *const *inpkts,
+                   uint8_t *const *outpkts, const unsigned int *index,
+                   size_t sz) {
+    rs_fec_init();
+
+    int k = code->k;
+    uint8_t m[k * k];
+    memset(m, 0, sizeof(m));
+    for (int i = 0; i < k; i++) {
+        if (index[i] < k)
+            m[i * k + index[i]] = 1;
+        else
+            memcpy(m + i * k, code->enc_matrix + index[i] * k, k);
+    }
+    if (_invert(m, k) < 0) {
+        syslog(LOG_ERR, "FEC: singular decode matrix");
+        return;
+    }
+
+    /* Only rows of missing primary blocks need to be computed */
+    uint8_t rows[k * k];
+    int n_out = 0;
+    for (int i = 0; i < k; i++) {
+        if (index[i] >= k) {
+            memcpy(rows + n_out * k, m + i * k, k);
+            n_out++;
+        }
+    }
+
+    _matrix_mul(rows, k, inpkts, outpkts, n_out, sz);
+}
+
+static struct {
+    int k;
+    int m;
+    fec_t *code;
+    int refcount;
+    unsigned long last_use;
+} cache[RS_FEC_CACHE_SIZE];
+
+static unsigned long cache_clock = 0;
+static struct rs_fec_cache_stats cache_stats = {0};
+
+fec_t *rs_fec_acquire(int k, int m) {
+    int slot = -1;
+    for (int i = 0; i < RS_FEC_CACHE_SIZE; i++) {
+        if (cache[i].code && cache[i].k == k && cache[i].m == m) {
+            cache[i].refcount++;
+            cache[i].last_use = ++cache_clock;
+            cache_stats.hits++;
+            return cache[i].code;
+        }
+
+        /* Free slot, or least recently used unpinned one */
+        if (!cache[i].code) {
+            if (slot < 0 || cache[slot].code)
+                slot = i;
+        } else if (!cache[i].refcount &&
+                   (slot < 0 ||
+                    (cache[slot].code &&
+                     cache[i].last_use < cache[slot].last_use))) {
+            slot = i;
+        }
+    }
+
+    cache_stats.misses++;
+    fec_t *code = fec_new(k, m);
+    if (slot < 0) {
+        /* Every entry is pinned, the code is freed on release */
+        syslog(LOG_DEBUG, "FEC: cache full");
+        return code;
+    }
+
+    if (cache[slot].code) {
+        fec_free(cache[slot].code);
+        cache_stats.evictions++;
+    } else {
+        cache_stats.n_entries++;
+    }
+    cache[slot].k = k;
+    cache[slot].m = m;
+    cache[slot].code = code;
+    cache[slot].refcount = 1;
+    cache[slot].last_use = ++cache_clock;
+    return code;
+}
+
+void rs_fec_release(fec_t *code) {
+    if (!code)
+        return;
+
+    for (int i = 0; i < RS_FEC_CACHE_SIZE; i++) {
+        if (cache[i].code == code) {
+            cache[i].refcount--;
+            return;
+        }
+    }
+    fec_free(code);
+}
+
+void rs_fec_cache_stats(struct rs_fec_cache_stats *stats) {
+    *stats = cache_stats;
+}
+
+void rs_fec_cache_destroy() {
+    for (int i = 0; i < RS_FEC_CACHE_SIZE; i++) {
+        if (cache[i].code) {
+            if (cache[i].refcount)
+                syslog(LOG_ERR, "FEC: destroying code still in use");
+            fec_free(cache[i].code);
+            cache[i].code = NULL;
+        }
+    }
+    cache_stats.n_entries = 0;
+}
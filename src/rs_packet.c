@@ -9,13 +9,17 @@
 
 static struct rs_packet_vtable vtable;
 
-void rs_packet_init(struct rs_packet *packet, void *payload_ownership,
+void rs_packet_init(struct rs_packet *packet,
+                    struct rs_buffer *payload_ownership,
                     struct rs_packet *payload_packet, uint8_t *payload_data,
                     int payload_data_len) {
     packet->payload_ownership = payload_ownership;
     packet->payload_packet = payload_packet;
+    packet->payload_iov = NULL;
     packet->payload_data = payload_data;
     packet->payload_data_len = payload_data_len;
+    packet->payload_data_headroom = 0;
+    packet->len_header = 0;
     packet->vtable = &vtable;
 }
 
@@ -35,6 +39,19 @@ void rs_packet_base_pack(struct rs_packet *packet, uint8_t **buffer,
         memcpy(*buffer, packet->payload_data, len);
         (*buffer) += len;
         (*buffer_len) -= len;
+    } else if (packet->payload_iov) {
+        struct rs_packet_iov *iov = rs_packet_iov(packet->payload_iov);
+        for (int i = 0; i < iov->n; i++) {
+            int len = iov->iov[i].iov_len;
+            if (len > *buffer_len) {
+                syslog(LOG_ERR, "pack: buffer too short: %d < %d",
+                       *buffer_len, len);
+                len = *buffer_len;
+            }
+            memcpy(*buffer, iov->iov[i].iov_base, len);
+            (*buffer) += len;
+            (*buffer_len) -= len;
+        }
     }
 }
 
@@ -45,30 +62,82 @@ int rs_packet_base_len(struct rs_packet *packet) {
     int res = rs_packet_len_header(packet);
     if (packet->payload_packet) {
         res += rs_packet_len(packet->payload_packet);
-    } else if (packet->payload_data) {
+    } else if (packet->payload_data || packet->payload_iov) {
         res += packet->payload_data_len;
     }
 
     return res;
 }
 
-int rs_packet_base_len_header(struct rs_packet *packet) { return 0; }
+int rs_packet_headroom(struct rs_packet *packet) {
+    int headroom = -1;
+    if (packet->payload_packet) {
+        headroom = rs_packet_headroom(packet->payload_packet);
+    } else if (packet->payload_data) {
+        headroom = packet->payload_data_headroom;
+    }
 
-void rs_packet_base_destroy(struct rs_packet *packet) {
-    if (!packet->payload_ownership)
-        return;
-    if (packet->payload_data)
-        free(packet->payload_ownership);
+    if (headroom < 0)
+        return -1;
+    return headroom - rs_packet_len_header(packet);
+}
+
+uint8_t *rs_packet_pack_inplace(struct rs_packet *packet) {
+    uint8_t *start;
     if (packet->payload_packet) {
-        rs_packet_destroy(packet->payload_packet);
-        free(packet->payload_packet);
+        start = rs_packet_pack_inplace(packet->payload_packet);
+    } else {
+        start = packet->payload_data;
     }
+
+    int len_header = rs_packet_len_header(packet);
+    start -= len_header;
+
+    uint8_t *buffer = start;
+    rs_packet_pack_header(packet, &buffer, &len_header);
+
+    return start;
+}
+
+void rs_packet_base_destroy(struct rs_packet *packet) {
+    rs_buffer_unref(packet->payload_ownership);
+    packet->payload_ownership = NULL;
+
+    if (packet->payload_iov) {
+        struct rs_packet_iov *iov = rs_packet_iov(packet->payload_iov);
+        for (int i = 0; i < iov->n; i++)
+            rs_buffer_unref(iov->ownership[i]);
+        rs_buffer_unref(packet->payload_iov);
+        packet->payload_iov = NULL;
+    }
+}
+
+struct rs_buffer *rs_packet_iov_new(int n) {
+    struct rs_buffer *buffer =
+        rs_buffer_new(sizeof(struct rs_packet_iov) +
+                      n * (sizeof(struct iovec) + sizeof(struct rs_buffer *)));
+    if (!buffer)
+        return NULL;
+
+    struct rs_packet_iov *iov = rs_packet_iov(buffer);
+    iov->n = 0;
+    iov->ownership = (struct rs_buffer **)&iov->iov[n];
+    return buffer;
+}
+
+void rs_packet_iov_append(struct rs_buffer *buffer,
+                          struct rs_buffer *ownership, uint8_t *data,
+                          int len) {
+    struct rs_packet_iov *iov = rs_packet_iov(buffer);
+    iov->iov[iov->n].iov_base = data;
+    iov->iov[iov->n].iov_len = len;
+    iov->ownership[iov->n] = ownership;
+    iov->n++;
 }
 
 static struct rs_packet_vtable vtable = {
     .pack = rs_packet_base_pack,
     .pack_header = rs_packet_base_pack_header,
     .len = rs_packet_base_len,
-    .len_header = rs_packet_base_len_header,
     .destroy = rs_packet_base_destroy,
 };
@@ -0,0 +1,280 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "rs_app_layer.h"
+#include "rs_packet.h"
+#include "rs_pipeline.h"
+#include "rs_port_layer.h"
+#include "rs_server_state.h"
+#include "rs_util.h"
+
+/*
+ ************************************************************************
+ * SPSC ring
+ */
+static int _ring_init(struct rs_pipeline_ring *ring) {
+    ring->head = 0;
+    ring->tail = 0;
+    ring->waiting = 0;
+    ring->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return ring->wakeup_fd < 0 ? -1 : 0;
+}
+
+static void _ring_destroy(struct rs_pipeline_ring *ring) {
+    for (; ring->tail != ring->head; ring->tail++) {
+        struct rs_packet *packet =
+            ring->items[ring->tail % RS_PIPELINE_RING_SIZE].packet;
+        rs_packet_destroy(packet);
+        rs_packet_free(packet);
+    }
+    if (ring->wakeup_fd >= 0)
+        close(ring->wakeup_fd);
+    ring->wakeup_fd = -1;
+}
+
+static int _ring_push(struct rs_pipeline_ring *ring,
+                      const struct rs_pipeline_item *item) {
+    unsigned int head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >=
+        RS_PIPELINE_RING_SIZE)
+        return -1;
+
+    ring->items[head % RS_PIPELINE_RING_SIZE] = *item;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+
+    /* Consumer is about to sleep or sleeping */
+    if (__atomic_exchange_n(&ring->waiting, 0, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        if (write(ring->wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            syslog(LOG_ERR, "pipeline: could not signal eventfd");
+    }
+    return 0;
+}
+
+static int _ring_pop(struct rs_pipeline_ring *ring,
+                     struct rs_pipeline_item *item) {
+    unsigned int tail = ring->tail;
+    if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+        return -1;
+
+    *item = ring->items[tail % RS_PIPELINE_RING_SIZE];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Consumer: announce going to sleep on wakeup_fd, returns nonzero if items
+ * arrived in the meantime (no sleep then)
+ */
+static int _ring_wait_begin(struct rs_pipeline_ring *ring) {
+    __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+    if (ring->tail != __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&ring->waiting, 0, __ATOMIC_SEQ_CST);
+        return 1;
+    }
+    return 0;
+}
+
+static void _ring_wait_end(struct rs_pipeline_ring *ring) {
+    __atomic_store_n(&ring->waiting, 0, __ATOMIC_SEQ_CST);
+
+    uint64_t n;
+    if (read(ring->wakeup_fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+        syslog(LOG_ERR, "pipeline: could not read eventfd");
+}
+
+/*
+ ************************************************************************
+ * radio thread
+ */
+
+/* The payload of a received packet may be borrowed from the channel layer,
+ * which is only valid until its next receive */
+static int _own_payload(struct rs_packet *packet) {
+    if (packet->payload_ownership || packet->payload_iov)
+        return 0;
+
+    int len = rs_packet_len(packet);
+    struct rs_buffer *buf = rs_buffer_new(len);
+    if (!buf)
+        return -1;
+
+    uint8_t *b = buf->data;
+    int bl = len;
+    rs_packet_pack(packet, &b, &bl);
+    rs_packet_destroy(packet);
+    rs_packet_init(packet, buf, NULL, buf->data, len);
+    return 0;
+}
+
+static void *_radio_main(void *arg) {
+    struct rs_pipeline *pipeline = arg;
+    struct rs_server_state *server = pipeline->server;
+
+    while (server->running) {
+        rs_clock_update();
+        rs_pipeline_lock(pipeline);
+
+        /* Frames queued by the app layer */
+        struct rs_pipeline_item item;
+        int n_frames = 0;
+        while (!_ring_pop(&pipeline->tx, &item)) {
+            if (rs_port_layer_transmit(server->port_layer, item.packet,
+                                       item.port,
+                                       &item.ts) == RS_PORT_LAYER_EXPIRED)
+                rs_app_layer_expired(server->app_layer, item.port);
+            rs_packet_destroy(item.packet);
+            rs_packet_free(item.packet);
+            n_frames++;
+        }
+        if (n_frames)
+            rs_port_layer_flush(server->port_layer);
+
+        struct rs_packet *packet = NULL;
+        rs_port_id_t port;
+        while (!rs_port_layer_receive(server->port_layer, &packet, &port)) {
+            item.packet = packet;
+            item.port = port;
+            if (_own_payload(packet) || _ring_push(&pipeline->rx, &item)) {
+                syslog(LOG_DEBUG, "pipeline: dropped packet on port %d",
+                       port);
+                rs_packet_destroy(packet);
+                rs_packet_free(packet);
+            }
+            packet = NULL;
+        }
+
+        rs_timer_wheel_advance(&server->timers);
+        for (int i = 0; i < server->n_channel_layers; i++) {
+            rs_channel_layer_main(server->channel_layers[i]);
+        }
+        rs_port_layer_main(server->port_layer, NULL);
+
+        int timeout = MAIN_LOOP_TIMEOUT_MSEC;
+        int port_timeout = rs_port_layer_timeout(server->port_layer);
+        if (port_timeout >= 0 && port_timeout < timeout)
+            timeout = port_timeout;
+        int timer_timeout = rs_timer_wheel_timeout(&server->timers);
+        if (timer_timeout >= 0 && timer_timeout < timeout)
+            timeout = timer_timeout;
+
+        rs_pipeline_unlock(pipeline);
+
+        if (_ring_wait_begin(&pipeline->tx))
+            continue;
+
+        struct epoll_event events[MAIN_LOOP_MAX_EVENTS];
+        if (epoll_wait(pipeline->radio_epoll_fd, events, MAIN_LOOP_MAX_EVENTS,
+                       timeout) < 0 &&
+            errno != EINTR) {
+            syslog(LOG_ERR, "pipeline: epoll_wait failed: %s",
+                   strerror(errno));
+        }
+        _ring_wait_end(&pipeline->tx);
+    }
+
+    return NULL;
+}
+
+/*
+ ************************************************************************
+ * setup/shutdown code
+ */
+int rs_pipeline_init(struct rs_pipeline *pipeline,
+                     struct rs_server_state *server) {
+    pipeline->server = server;
+    pipeline->started = 0;
+    pipeline->tx.wakeup_fd = -1;
+    pipeline->rx.wakeup_fd = -1;
+
+    pthread_mutex_init(&pipeline->lock, NULL);
+
+    pipeline->radio_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (pipeline->radio_epoll_fd < 0 || _ring_init(&pipeline->tx) ||
+        _ring_init(&pipeline->rx)) {
+        syslog(LOG_ERR, "pipeline: Could not create epoll instance / eventfd");
+        return -1;
+    }
+    rs_pipeline_watch_fd(pipeline, pipeline->tx.wakeup_fd);
+
+    /* Packets are allocated and freed on both threads from now on */
+    rs_pools_share();
+
+    return 0;
+}
+
+void rs_pipeline_destroy(struct rs_pipeline *pipeline) {
+    _ring_destroy(&pipeline->tx);
+    _ring_destroy(&pipeline->rx);
+    if (pipeline->radio_epoll_fd >= 0)
+        close(pipeline->radio_epoll_fd);
+    pipeline->radio_epoll_fd = -1;
+    pthread_mutex_destroy(&pipeline->lock);
+}
+
+void rs_pipeline_watch_fd(struct rs_pipeline *pipeline, int fd) {
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = fd};
+    if (fd >= 0)
+        epoll_ctl(pipeline->radio_epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+int rs_pipeline_start(struct rs_pipeline *pipeline) {
+    if (pthread_create(&pipeline->radio_thread, NULL, _radio_main, pipeline)) {
+        syslog(LOG_ERR, "pipeline: Could not start radio thread");
+        return -1;
+    }
+    pipeline->started = 1;
+    return 0;
+}
+
+void rs_pipeline_join(struct rs_pipeline *pipeline) {
+    if (!pipeline->started)
+        return;
+    pthread_join(pipeline->radio_thread, NULL);
+    pipeline->started = 0;
+}
+
+/*
+ ************************************************************************
+ * main thread
+ */
+int rs_pipeline_transmit(struct rs_pipeline *pipeline, struct rs_packet *packet,
+                         rs_port_id_t port, const struct timespec *ts) {
+    struct rs_pipeline_item item = {.packet = packet, .port = port};
+    if (ts)
+        item.ts = *ts;
+    else
+        rs_clock_now(&item.ts);
+
+    if (_ring_push(&pipeline->tx, &item)) {
+        rs_packet_destroy(packet);
+        rs_packet_free(packet);
+        return -1;
+    }
+    return 0;
+}
+
+int rs_pipeline_receive(struct rs_pipeline *pipeline, struct rs_packet **packet,
+                        rs_port_id_t *port) {
+    struct rs_pipeline_item item;
+    if (_ring_pop(&pipeline->rx, &item))
+        return RS_PORT_LAYER_EOF;
+
+    *packet = item.packet;
+    *port = item.port;
+    return 0;
+}
+
+int rs_pipeline_wait_begin(struct rs_pipeline *pipeline) {
+    return _ring_wait_begin(&pipeline->rx);
+}
+
+void rs_pipeline_wait_end(struct rs_pipeline *pipeline) {
+    _ring_wait_end(&pipeline->rx);
+}
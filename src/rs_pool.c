@@ -0,0 +1,198 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "rs_channel_layer_packet.h"
+#include "rs_packet.h"
+#include "rs_pool.h"
+#include "rs_port_layer_packet.h"
+
+#define BUFFER_POOL(_i_)                                                       \
+    {                                                                          \
+        .title = "buffer", .objects_per_slab = 16 >> (2 * (_i_)),              \
+        .lock = PTHREAD_MUTEX_INITIALIZER,                                     \
+        .object_size =                                                         \
+            sizeof(struct rs_buffer) +                                         \
+            (RS_POOL_BUFFER_MIN_SIZE << (RS_POOL_BUFFER_CLASS_SHIFT * (_i_))), \
+    }
+
+struct rs_pool rs_pools[RS_POOL_N] = {
+    [RS_POOL_PACKET] = {.title = "packet",
+                        .object_size = sizeof(struct rs_packet),
+                        .objects_per_slab = RS_POOL_OBJECTS_PER_SLAB,
+                        .lock = PTHREAD_MUTEX_INITIALIZER},
+    [RS_POOL_CHANNEL_LAYER_PACKET] =
+        {.title = "channel packet",
+         .object_size = sizeof(struct rs_channel_layer_packet),
+         .objects_per_slab = RS_POOL_OBJECTS_PER_SLAB,
+         .lock = PTHREAD_MUTEX_INITIALIZER},
+    [RS_POOL_PORT_LAYER_PACKET] =
+        {.title = "port packet",
+         .object_size = sizeof(struct rs_port_layer_packet),
+         .objects_per_slab = RS_POOL_OBJECTS_PER_SLAB,
+         .lock = PTHREAD_MUTEX_INITIALIZER},
+    [RS_POOL_BUFFER_0] = BUFFER_POOL(0),
+    [RS_POOL_BUFFER_1] = BUFFER_POOL(1),
+    [RS_POOL_BUFFER_2] = BUFFER_POOL(2),
+    [RS_POOL_BUFFER_3] = BUFFER_POOL(3),
+    [RS_POOL_BUFFER_OVERSIZED] = {.title = "buffer (oversized)",
+                                  .lock = PTHREAD_MUTEX_INITIALIZER},
+};
+
+int rs_pools_shared = 0;
+
+void rs_pools_share() { rs_pools_shared = 1; }
+
+static inline void _lock(struct rs_pool *pool) {
+    if (rs_pools_shared)
+        pthread_mutex_lock(&pool->lock);
+}
+
+static inline void _unlock(struct rs_pool *pool) {
+    if (rs_pools_shared)
+        pthread_mutex_unlock(&pool->lock);
+}
+
+/* Free objects are linked through their first bytes */
+struct free_object {
+    struct free_object *next;
+};
+
+static int _grow(struct rs_pool *pool) {
+    int objects_per_slab = pool->objects_per_slab ? pool->objects_per_slab : 1;
+    int object_size = pool->object_size;
+    if (object_size < sizeof(struct free_object))
+        object_size = sizeof(struct free_object);
+    /* keep objects aligned */
+    object_size = (object_size + 15) & ~15;
+
+    uint8_t *slab = malloc(object_size * objects_per_slab);
+    void **slabs = realloc(pool->slabs, (pool->n_slabs + 1) * sizeof(void *));
+    if (!slab || !slabs) {
+        syslog(LOG_ERR, "pool %s: out of memory", pool->title);
+        free(slab);
+        if (slabs)
+            pool->slabs = slabs;
+        return -1;
+    }
+    pool->n_malloc++;
+
+    pool->slabs = slabs;
+    pool->slabs[pool->n_slabs] = slab;
+    pool->n_slabs++;
+
+    for (int i = objects_per_slab - 1; i >= 0; i--) {
+        struct free_object *o = (struct free_object *)(slab + i * object_size);
+        o->next = pool->free_list;
+        pool->free_list = o;
+    }
+
+    return 0;
+}
+
+static void *_alloc(struct rs_pool *pool) {
+    _lock(pool);
+    if (!pool->free_list && _grow(pool)) {
+        _unlock(pool);
+        return NULL;
+    }
+
+    struct free_object *o = pool->free_list;
+    pool->free_list = o->next;
+
+    pool->n_alloc++;
+    pool->n_in_use++;
+    _unlock(pool);
+
+    return o;
+}
+
+void *rs_pool_alloc(struct rs_pool *pool) {
+    void *o = _alloc(pool);
+    if (o)
+        memset(o, 0, pool->object_size);
+    return o;
+}
+
+void rs_pool_free(struct rs_pool *pool, void *object) {
+    if (!object)
+        return;
+
+    struct free_object *o = object;
+    _lock(pool);
+    o->next = pool->free_list;
+    pool->free_list = o;
+
+    pool->n_in_use--;
+    _unlock(pool);
+}
+
+void rs_pools_destroy() {
+    for (int i = 0; i < RS_POOL_N; i++) {
+        if (rs_pools[i].n_in_use) {
+            syslog(LOG_DEBUG, "pool %s: %ld objects still in use",
+                   rs_pools[i].title, rs_pools[i].n_in_use);
+        }
+        for (int j = 0; j < rs_pools[i].n_slabs; j++)
+            free(rs_pools[i].slabs[j]);
+        free(rs_pools[i].slabs);
+
+        rs_pools[i].slabs = NULL;
+        rs_pools[i].n_slabs = 0;
+        rs_pools[i].free_list = NULL;
+    }
+}
+
+struct rs_buffer *rs_buffer_new(int size) {
+    struct rs_buffer *buffer = NULL;
+
+    int pool = RS_POOL_BUFFER_0;
+    for (; pool < RS_POOL_BUFFER_OVERSIZED; pool++) {
+        if (size + sizeof(struct rs_buffer) <= rs_pools[pool].object_size)
+            break;
+    }
+
+    if (pool < RS_POOL_BUFFER_OVERSIZED) {
+        /* Not zeroed, payload is overwritten anyway */
+        buffer = _alloc(&rs_pools[pool]);
+        if (!buffer)
+            return NULL;
+        buffer->size = rs_pools[pool].object_size - sizeof(struct rs_buffer);
+    } else {
+        buffer = malloc(sizeof(struct rs_buffer) + size);
+        if (!buffer)
+            return NULL;
+        _lock(&rs_pools[pool]);
+        rs_pools[pool].n_alloc++;
+        rs_pools[pool].n_in_use++;
+        rs_pools[pool].n_malloc++;
+        _unlock(&rs_pools[pool]);
+        buffer->size = size;
+    }
+
+    buffer->pool = pool;
+    buffer->refcount = 1;
+    return buffer;
+}
+
+void rs_buffer_unref(struct rs_buffer *buffer) {
+    if (!buffer)
+        return;
+    if (rs_pools_shared) {
+        if (__atomic_sub_fetch(&buffer->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+            return;
+    } else if (--buffer->refcount > 0) {
+        return;
+    }
+
+    if (buffer->pool < RS_POOL_BUFFER_OVERSIZED) {
+        rs_pool_free(&rs_pools[buffer->pool], buffer);
+    } else {
+        _lock(&rs_pools[buffer->pool]);
+        rs_pools[buffer->pool].n_in_use--;
+        _unlock(&rs_pools[buffer->pool]);
+        free(buffer);
+    }
+}
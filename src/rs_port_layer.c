@@ -1,5 +1,6 @@
 #include <errno.h>
 #include <libconfig.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,17 +8,40 @@
 #include <unistd.h>
 
 #include "rs_channel_layer.h"
+#include "rs_fec.h"
 #include "rs_port_layer.h"
 #include "rs_port_layer_packet.h"
 #include "rs_server_state.h"
+#include "rs_timer.h"
 #include "rs_util.h"
 
+static void _heartbeat_timer(struct rs_timer *timer, void *arg);
+static void _switch_timer(struct rs_timer *timer, void *arg);
+static void _fec_control_timer(struct rs_timer *timer, void *arg);
+static void _rate_control_timer(struct rs_timer *timer, void *arg);
+static void _group_timer(struct rs_timer *timer, void *arg);
+
 void rs_port_layer_init(struct rs_port_layer *layer,
                         struct rs_server_state *server) {
     layer->server = server;
 
     layer->ports = NULL;
     layer->n_ports = 0;
+    memset(layer->ports_by_id, 0, sizeof(layer->ports_by_id));
+    layer->rx_channels = NULL;
+    layer->n_rx_channels = 0;
+    layer->rx_channel_at = -1;
+    layer->rx_error = 0;
+    layer->rx_pending = 0;
+    layer->tx_aggregates = NULL;
+    layer->n_tx_aggregates = 0;
+    layer->rx_aggregate.buf = NULL;
+    layer->rx_batch.n = 0;
+    layer->rx_batch.at = 0;
+
+    layer->tx_schedule = 0;
+    config_lookup_bool(&server->config, "tx_schedule", &layer->tx_schedule);
+    layer->tx_schedule_rr = 0;
 
     /* ports */
     config_setting_t *c = config_lookup(&server->config, "ports");
@@ -32,20 +56,19 @@ void rs_port_layer_init(struct rs_port_layer *layer,
             rs_port_id_t via = layer->ports[i]->route_cmd.route_via_id;
             layer->ports[i]->route_cmd.route_via = NULL;
 
-            for (int j = 0; j < layer->n_ports; j++) {
-                if (layer->ports[j]->id == via) {
-                    int n = 0;
-                    for (void *p = layer->ports[j]->route_cmd.routing_via_this;
-                         p; p++)
-                        n++;
-                    layer->ports[j]->route_cmd.routing_via_this = realloc(
-                        layer->ports[j]->route_cmd.routing_via_this, n + 1);
-
-                    layer->ports[j]->route_cmd.routing_via_this[n] =
-                        layer->ports[i];
-                    layer->ports[j]->route_cmd.routing_via_this[n + 1] = NULL;
-
-                    layer->ports[i]->route_cmd.route_via = layer->ports[j];
+            struct rs_port *via_port = layer->ports_by_id[via];
+            if (via_port) {
+                /* NULL terminated */
+                struct rs_port **routing = via_port->route_cmd.routing_via_this;
+                int n = 0;
+                while (routing[n])
+                    n++;
+                routing = realloc(routing, (n + 2) * sizeof(struct rs_port *));
+                if (routing) {
+                    routing[n] = layer->ports[i];
+                    routing[n + 1] = NULL;
+                    via_port->route_cmd.routing_via_this = routing;
+                    layer->ports[i]->route_cmd.route_via = via_port;
                 }
             }
 
@@ -74,16 +97,67 @@ void rs_port_layer_create_port(struct rs_port_layer *layer,
     double fec_factor = 1.5;
     config_setting_lookup_float(config, "fec_factor", &fec_factor);
 
+    int fec_adaptive = 0;
+    config_setting_lookup_bool(config, "fec_adaptive", &fec_adaptive);
+    double fec_min = RS_PORT_FEC_MIN;
+    config_setting_lookup_float(config, "fec_min", &fec_min);
+    double fec_max = RS_PORT_FEC_MAX;
+    config_setting_lookup_float(config, "fec_max", &fec_max);
+    double fec_target_loss = RS_PORT_FEC_TARGET_LOSS;
+    config_setting_lookup_float(config, "fec_target_loss", &fec_target_loss);
+
+    int rate_adaptive = 0;
+    config_setting_lookup_bool(config, "rate_adaptive", &rate_adaptive);
+
     int route_cmd = -100;
     config_setting_lookup_int(config, "route_cmd", &route_cmd);
 
-    if (port) {
-        for (int i = 0; i < layer->n_ports; i++) {
-            if (layer->ports[i]->id == port) {
-                syslog(LOG_ERR, "Port already in use");
-                return;
-            }
-        }
+    /* Window is a power of two, so that seq % n_blocks is contiguous across
+     * the wrap around of seq */
+    int reassembly_window = RS_PORT_REASSEMBLY_WINDOW;
+    config_setting_lookup_int(config, "reassembly_window", &reassembly_window);
+    int n_blocks = 1;
+    while (n_blocks < reassembly_window &&
+           n_blocks < RS_PORT_REASSEMBLY_WINDOW_MAX)
+        n_blocks <<= 1;
+
+    int reassembly_memory = RS_PORT_REASSEMBLY_MEMORY;
+    config_setting_lookup_int(config, "reassembly_memory", &reassembly_memory);
+
+    const char *reassembly_order = "latest";
+    config_setting_lookup_string(config, "reassembly_order",
+                                 &reassembly_order);
+
+    int group_frames = 0;
+    config_setting_lookup_int(config, "group_frames", &group_frames);
+    if (group_frames > RS_PORT_GROUP_MAX_FRAMES)
+        group_frames = RS_PORT_GROUP_MAX_FRAMES;
+
+    int group_latency = RS_PORT_GROUP_LATENCY_MSEC;
+    config_setting_lookup_int(config, "group_latency_ms", &group_latency);
+
+    int aggregate_msec = 0;
+    config_setting_lookup_int(config, "aggregate_ms", &aggregate_msec);
+    if (aggregate_msec > RS_PORT_AGGREGATE_MAX_MSEC)
+        aggregate_msec = RS_PORT_AGGREGATE_MAX_MSEC;
+
+    int latency_msec = 0;
+    config_setting_lookup_int(config, "latency_ms", &latency_msec);
+    if (latency_msec > RS_PORT_LATENCY_MAX_MSEC)
+        latency_msec = RS_PORT_LATENCY_MAX_MSEC;
+
+    int priority = 0;
+    config_setting_lookup_int(config, "priority", &priority);
+    int weight = 1;
+    config_setting_lookup_int(config, "weight", &weight);
+    int rate_kbps = 0;
+    config_setting_lookup_int(config, "rate_kbps", &rate_kbps);
+    int queue_memory = RS_PORT_SCHED_QUEUE_MEMORY;
+    config_setting_lookup_int(config, "queue_memory", &queue_memory);
+
+    if (port && layer->ports_by_id[port]) {
+        syslog(LOG_ERR, "Port already in use");
+        return;
     }
 
     struct rs_port *new_port = calloc(1, sizeof(struct rs_port));
@@ -91,25 +165,88 @@ void rs_port_layer_create_port(struct rs_port_layer *layer,
     new_port->bound_channel = bound_channel;
     new_port->tx_last_seq = 0;
     new_port->owner = owner;
-    memset(&new_port->frag_buffer, 0, sizeof(new_port->frag_buffer));
+    new_port->reassembly.order = strcmp(reassembly_order, "in_order")
+                                     ? RS_PORT_DELIVER_LATEST
+                                     : RS_PORT_DELIVER_IN_ORDER;
+    new_port->reassembly.n_blocks = n_blocks;
+    new_port->reassembly.blocks =
+        calloc(n_blocks, sizeof(struct rs_port_reassembly_block));
+    new_port->reassembly.memory = 0;
+    new_port->reassembly.memory_max = reassembly_memory;
+    new_port->reassembly.has_delivered = 0;
+
+    new_port->group.max_k = group_frames > 1 ? group_frames : 0;
+    new_port->group.latency_msec = group_latency;
+    new_port->group.k = 0;
+    rs_timer_init(&new_port->group.timer, &_group_timer, layer);
+    rs_timer_init(&new_port->cmd_switch_state.timer, &_switch_timer, layer);
+    new_port->aggregate_msec = aggregate_msec > 0 ? aggregate_msec : 0;
+    new_port->latency_msec = latency_msec > 0 ? latency_msec : 0;
+    new_port->sched.priority = priority;
+    new_port->sched.weight = weight > 0 ? weight : 1;
+    new_port->sched.rate_kbps = rate_kbps > 0 ? rate_kbps : 0;
+    new_port->sched.tokens = 0.;
+    rs_clock_now(&new_port->sched.refill_ts);
+    new_port->sched.deficit = 0;
+    new_port->sched.queue = NULL;
+    new_port->sched.queue_size = 0;
+    new_port->sched.queue_at = 0;
+    new_port->sched.queue_n = 0;
+    new_port->sched.bytes = 0;
+    new_port->sched.bytes_max = queue_memory;
     rs_stats_init(&new_port->stats);
     rs_stat_init(&new_port->tx_stats_fec_factor, RS_STAT_AGG_AVG, "TX FEC", "",
                  1.);
     rs_stat_init(&new_port->rx_stats_fec_factor, RS_STAT_AGG_AVG, "RX FEC", "",
                  1.);
+    rs_stat_init(&new_port->rx_stats_invalid, RS_STAT_AGG_COUNT,
+                 "RX invalid fragments", "fps", 1000. / RS_STAT_DT_MSEC);
+    new_port->rx_invalid_logged = 0;
+    rs_stat_init(&new_port->tx_stats_header, RS_STAT_AGG_AVG, "TX Header",
+                 "B", 1.);
+    rs_stat_init(&new_port->tx_stats_header_full, RS_STAT_AGG_AVG,
+                 "TX Header (full)", "B", 1.);
 
     new_port->tx_target_fec_factor = fec_factor;
+    new_port->fec_control.enabled = fec_adaptive;
+    new_port->fec_control.min_factor = fec_min < 1. ? 1. : fec_min;
+    new_port->fec_control.max_factor =
+        fec_max < new_port->fec_control.min_factor
+            ? new_port->fec_control.min_factor
+            : fec_max;
+    new_port->fec_control.target_loss = fec_target_loss;
+    new_port->fec_control.burst = 1.;
+    rs_timer_init(&new_port->fec_control.timer, &_fec_control_timer, layer);
+    if (new_port->fec_control.enabled)
+        rs_timer_schedule(&layer->server->timers, &new_port->fec_control.timer,
+                          RS_PORT_FEC_CONTROL_MSEC);
+    new_port->rate_control.enabled = rate_adaptive;
+    new_port->rate_control.probe_msec = RS_PORT_RATE_PROBE_MSEC;
+    rs_timer_init(&new_port->rate_control.timer, &_rate_control_timer, layer);
+    if (new_port->rate_control.enabled)
+        rs_timer_schedule(&layer->server->timers, &new_port->rate_control.timer,
+                          RS_PORT_RATE_CONTROL_MSEC);
+    rs_clock_now(&new_port->rate_control.switched_ts);
+    new_port->rate_control.n_bad = 0;
+    new_port->rate_control.probing = 0;
     new_port->tx_fec = NULL;
     new_port->rx_fec = NULL;
 
     rs_port_setup_tx_fec(new_port, 4, 7);
     rs_port_setup_rx_fec(new_port, 4, 7);
 
-    clock_gettime(CLOCK_REALTIME, &new_port->tx_last_ts);
+    rs_clock_now(&new_port->tx_last_ts);
+    rs_timer_init(&new_port->heartbeat_timer, &_heartbeat_timer, layer);
+    rs_timer_schedule(&layer->server->timers, &new_port->heartbeat_timer,
+                      RS_PORT_CMD_HEARTBEAT_MSEC);
 
     layer->n_ports++;
     layer->ports = realloc(layer->ports, layer->n_ports * sizeof(void *));
     layer->ports[layer->n_ports - 1] = new_port;
+    if (!layer->ports_by_id[new_port->id])
+        layer->ports_by_id[new_port->id] = new_port;
+    layer->rx_channels =
+        realloc(layer->rx_channels, layer->n_ports * sizeof(rs_channel_t));
 
     new_port->route_cmd.routing_via_this = calloc(1, sizeof(void *));
     *(new_port->route_cmd.routing_via_this) = NULL;
@@ -127,45 +264,462 @@ void rs_port_setup_tx_fec(struct rs_port *port, int k, int m) {
     if (!port->tx_fec || port->tx_fec_k != k || port->tx_fec_m != m) {
         port->tx_fec_m = m;
         port->tx_fec_k = k;
-        if (port->tx_fec)
-            fec_free(port->tx_fec);
-        port->tx_fec = fec_new(k, m);
+        rs_fec_release(port->tx_fec);
+        port->tx_fec = rs_fec_acquire(k, m);
     }
 }
 void rs_port_setup_rx_fec(struct rs_port *port, int k, int m) {
     if (!port->rx_fec || port->rx_fec_k != k || port->rx_fec_m != m) {
         port->rx_fec_m = m;
         port->rx_fec_k = k;
-        if (port->rx_fec)
-            fec_free(port->rx_fec);
-        port->rx_fec = fec_new(k, m);
+        rs_fec_release(port->rx_fec);
+        port->rx_fec = rs_fec_acquire(k, m);
     }
 }
 
+static void _reassembly_release(struct rs_port *port,
+                                struct rs_port_reassembly_block *block);
+static void _sched_pop(struct rs_port *port);
+
 void rs_port_layer_destroy(struct rs_port_layer *layer) {
     for (int i = 0; i < layer->n_ports; i++) {
-        fec_free(layer->ports[i]->tx_fec);
-        fec_free(layer->ports[i]->rx_fec);
-        for (int j = 0; j < layer->ports[i]->frag_buffer.n_frag_received; j++) {
-            rs_packet_destroy(
-                &layer->ports[i]->frag_buffer.fragments[j]->super);
-            free(layer->ports[i]->frag_buffer.fragments[j]);
-        }
-        free(layer->ports[i]->frag_buffer.fragments);
+        struct rs_timer_wheel *timers = &layer->server->timers;
+        rs_timer_cancel(timers, &layer->ports[i]->heartbeat_timer);
+        rs_timer_cancel(timers, &layer->ports[i]->group.timer);
+        rs_timer_cancel(timers, &layer->ports[i]->fec_control.timer);
+        rs_timer_cancel(timers, &layer->ports[i]->rate_control.timer);
+        rs_timer_cancel(timers, &layer->ports[i]->cmd_switch_state.timer);
+        while (layer->ports[i]->sched.queue_n)
+            _sched_pop(layer->ports[i]);
+        free(layer->ports[i]->sched.queue);
+        rs_fec_release(layer->ports[i]->tx_fec);
+        rs_fec_release(layer->ports[i]->rx_fec);
+        for (int j = 0; j < layer->ports[i]->reassembly.n_blocks; j++) {
+            _reassembly_release(layer->ports[i],
+                                &layer->ports[i]->reassembly.blocks[j]);
+        }
+        free(layer->ports[i]->reassembly.blocks);
+        for (int j = 0; j < layer->ports[i]->group.k; j++)
+            rs_buffer_unref(layer->ports[i]->group.blocks[j]);
         free(layer->ports[i]);
     }
     free(layer->ports);
+    free(layer->rx_channels);
+    memset(layer->ports_by_id, 0, sizeof(layer->ports_by_id));
+
+    for (int i = 0; i < layer->n_tx_aggregates; i++)
+        rs_buffer_unref(layer->tx_aggregates[i].buf);
+    free(layer->tx_aggregates);
+    rs_buffer_unref(layer->rx_aggregate.buf);
+    for (int i = layer->rx_batch.at; i < layer->rx_batch.n; i++) {
+        rs_packet_destroy(layer->rx_batch.packets[i]);
+        rs_packet_free(layer->rx_batch.packets[i]);
+    }
 
     layer->ports = NULL;
+    layer->rx_channels = NULL;
+    layer->tx_aggregates = NULL;
+    layer->n_tx_aggregates = 0;
+    layer->rx_aggregate.buf = NULL;
+    layer->rx_batch.n = 0;
+    layer->rx_batch.at = 0;
+}
+
+/* len_header_below: bytes added to fragment by the layers below */
+static void _register_header_stats(struct rs_port *port,
+                                   struct rs_port_layer_packet *fragment,
+                                   int len_header_below) {
+    rs_stat_register(&port->tx_stats_header,
+                     fragment->super.len_header + len_header_below);
+    rs_stat_register(
+        &port->tx_stats_header_full,
+        RS_PORT_LAYER_PACKET_HEADER_LEN +
+            (fragment->command ? RS_PORT_LAYER_COMMAND_LENGTH : 0) +
+            RS_CHANNEL_LAYER_PACKET_HEADER_LEN);
+}
+
+static void _drop_fragment(struct rs_port_layer_packet *fragment) {
+    rs_packet_destroy(&fragment->super);
+    rs_port_layer_packet_free(fragment);
+}
+
+/* Fragment which does not fit its block: malformed, or from a peer that
+ * groups frames without marking the fragments */
+static void _drop_invalid(struct rs_port *port,
+                          struct rs_port_layer_packet *fragment) {
+    rs_stat_register(&port->rx_stats_invalid, 1.);
+    if (!port->rx_invalid_logged) {
+        port->rx_invalid_logged = 1;
+        if (!fragment->n_frag_encoded && !fragment->group)
+            syslog(LOG_ERR,
+                   "port %d: dropping unmarked group fragments, the other "
+                   "side groups frames without announcing it",
+                   port->id);
+        else
+            syslog(LOG_ERR,
+                   "port %d: dropping fragment %d of k=%d / m=%d, which does "
+                   "not fit its block (further ones are only counted)",
+                   port->id, fragment->frag, fragment->n_frag_decoded,
+                   fragment->n_frag_encoded);
+    }
+    _drop_fragment(fragment);
+}
+
+static struct rs_port_aggregate *
+_aggregate_find(struct rs_port_layer *layer, rs_channel_t channel) {
+    for (int i = 0; i < layer->n_tx_aggregates; i++) {
+        if (layer->tx_aggregates[i].channel == channel)
+            return &layer->tx_aggregates[i];
+    }
+    return NULL;
 }
 
+static struct rs_port_aggregate *
+_aggregate_create(struct rs_port_layer *layer, struct rs_channel_layer *ch,
+                  rs_channel_t channel) {
+    int size = RS_PACKET_HEADROOM +
+               rs_channel_layer_max_packet_size(ch, channel) +
+               RS_PORT_LAYER_PACKET_HEADER_LEN + RS_PORT_LAYER_COMMAND_LENGTH;
+    struct rs_buffer *buf = rs_buffer_new(size);
+    if (!buf)
+        return NULL;
+
+    struct rs_port_aggregate *aggregates =
+        realloc(layer->tx_aggregates,
+                (layer->n_tx_aggregates + 1) * sizeof(*aggregates));
+    if (!aggregates) {
+        rs_buffer_unref(buf);
+        return NULL;
+    }
+    layer->tx_aggregates = aggregates;
+
+    struct rs_port_aggregate *aggregate =
+        &layer->tx_aggregates[layer->n_tx_aggregates++];
+    aggregate->channel = channel;
+    aggregate->buf = buf;
+    aggregate->size = size;
+    aggregate->len = 0;
+    aggregate->n = 0;
+    buf->data[RS_PACKET_HEADROOM] = RS_PORT_LAYER_PACKET_AGGREGATE_MARKER;
+    return aggregate;
+}
+
+/* Send the packets collected in aggregate */
+static int _aggregate_flush(struct rs_port_layer *layer,
+                            struct rs_port_aggregate *aggregate) {
+    if (!aggregate->n)
+        return 0;
+
+    int res = -1;
+    struct rs_channel_layer *ch =
+        rs_server_channel_layer_for_channel(layer->server, aggregate->channel);
+    if (ch) {
+        uint8_t *data = aggregate->buf->data + RS_PACKET_HEADROOM;
+        int len = 1 + aggregate->len;
+        if (aggregate->n == 1) {
+            uint32_t l;
+            data += 1 + rs_load_varint(data + 1, aggregate->len, &l);
+            len = l;
+        }
+
+        struct rs_packet packet;
+        rs_packet_init(&packet, NULL, NULL, data, len);
+        packet.payload_data_headroom = data - aggregate->buf->data;
+        res = rs_channel_layer_transmit(ch, &packet, aggregate->channel);
+        if (rs_channel_layer_flush(ch) < 0)
+            res = -1;
+        rs_packet_destroy(&packet);
+    }
+
+    aggregate->len = 0;
+    aggregate->n = 0;
+    return res;
+}
+
+/*
+ * Hand fragment to the channel layer, or add it to the aggregate of the
+ * channel if port aggregates or packets are pending there already
+ */
+static int _channel_transmit(struct rs_port_layer *layer,
+                             struct rs_port *port,
+                             struct rs_channel_layer *ch,
+                             struct rs_port_layer_packet *fragment) {
+    rs_channel_t channel = port->bound_channel;
+    struct rs_port_aggregate *aggregate = _aggregate_find(layer, channel);
+    int aggregating =
+        port->aggregate_msec && rs_channel_layer_aggregate(ch, channel);
+
+    int len = rs_packet_len(&fragment->super);
+    int entry = rs_varint_len(len) + len;
+    if (aggregating && !aggregate)
+        aggregate = _aggregate_create(layer, ch, channel);
+    if (!aggregate || (!aggregating && !aggregate->n) ||
+        RS_PACKET_HEADROOM + 1 + entry > aggregate->size) {
+        if (aggregate)
+            _aggregate_flush(layer, aggregate);
+
+        int res = rs_channel_layer_transmit(ch, &fragment->super, channel);
+        if (res > 0)
+            _register_header_stats(port, fragment, ch->tx_last_len_header);
+        return res;
+    }
+
+    if (RS_PACKET_HEADROOM + 1 + aggregate->len + entry > aggregate->size)
+        _aggregate_flush(layer, aggregate);
+
+    struct timespec now;
+    rs_clock_now(&now);
+    if (!aggregate->n) {
+        aggregate->deadline = now;
+        timespec_plus_ms(&aggregate->deadline, port->aggregate_msec);
+    } else if (aggregating) {
+        struct timespec deadline = now;
+        timespec_plus_ms(&deadline, port->aggregate_msec);
+        if (msec_diff(aggregate->deadline, deadline) > 0)
+            aggregate->deadline = deadline;
+    }
+
+    uint8_t *b = aggregate->buf->data + RS_PACKET_HEADROOM + 1 + aggregate->len;
+    b += rs_store_varint(b, len);
+    int bl = len;
+    rs_packet_pack(&fragment->super, &b, &bl);
+    aggregate->len += entry;
+    aggregate->n++;
+    _register_header_stats(port, fragment, rs_varint_len(len));
+
+    /* Only taken along */
+    if (!aggregating && _aggregate_flush(layer, aggregate) < 0)
+        return -1;
+    return len;
+}
+
+/*
+ * Hand n fragments to the channel layer as one batch, packets pending in the
+ * aggregate of the channel go first. Only for ports which do not aggregate
+ */
+static int _channel_transmit_batch(struct rs_port_layer *layer,
+                                   struct rs_port *port,
+                                   struct rs_channel_layer *ch,
+                                   struct rs_port_layer_packet **fragments,
+                                   int n) {
+    rs_channel_t channel = port->bound_channel;
+    struct rs_port_aggregate *aggregate = _aggregate_find(layer, channel);
+    if (aggregate)
+        _aggregate_flush(layer, aggregate);
+
+    struct rs_packet *packets[RS_PORT_LAYER_MAX_FRAGMENTS];
+    int len_header[RS_PORT_LAYER_MAX_FRAGMENTS];
+    for (int i = 0; i < n; i++)
+        packets[i] = &fragments[i]->super;
+
+    int res = rs_channel_layer_transmit_batch(ch, packets, n, channel,
+                                              len_header);
+    if (res > 0) {
+        for (int i = 0; i < n; i++)
+            _register_header_stats(port, fragments[i], len_header[i]);
+    }
+    return res;
+}
+
+/* Pooled copy of fragment, owning its payload (with headroom) */
+static struct rs_port_layer_packet *
+_fragment_copy(struct rs_port_layer_packet *fragment) {
+    struct rs_port_layer_packet *copy = rs_port_layer_packet_alloc();
+    *copy = *fragment;
+    if (fragment->super.payload_ownership && fragment->super.payload_data) {
+        rs_buffer_ref(fragment->super.payload_ownership);
+        return copy;
+    }
+
+    int len = rs_packet_len(&fragment->super) -
+              rs_packet_len_header(&fragment->super);
+    struct rs_buffer *buf = rs_buffer_new(RS_PACKET_HEADROOM + len);
+    if (!buf) {
+        rs_port_layer_packet_free(copy);
+        return NULL;
+    }
+
+    uint8_t *b = buf->data + RS_PACKET_HEADROOM;
+    int bl = len;
+    if (fragment->super.payload_packet)
+        rs_packet_pack(fragment->super.payload_packet, &b, &bl);
+    else
+        memcpy(b, fragment->super.payload_data, len);
+
+    copy->super.payload_ownership = buf;
+    copy->super.payload_packet = NULL;
+    copy->super.payload_data = buf->data + RS_PACKET_HEADROOM;
+    copy->super.payload_data_len = len;
+    copy->super.payload_data_headroom = RS_PACKET_HEADROOM;
+    return copy;
+}
+
+/* Drop the oldest queued fragment */
+static void _sched_pop(struct rs_port *port) {
+    struct rs_port_sched_entry *entry =
+        &port->sched.queue[port->sched.queue_at];
+    port->sched.bytes -= entry->len;
+    _drop_fragment(entry->fragment);
+    entry->fragment = NULL;
+
+    port->sched.queue_at = (port->sched.queue_at + 1) % port->sched.queue_size;
+    port->sched.queue_n--;
+}
+
+/* Queue fragment (takes ownership), returns its length or -1 */
+static int _sched_enqueue(struct rs_port *port,
+                          struct rs_port_layer_packet *fragment,
+                          const struct timespec *deadline) {
+    if (port->sched.queue_n == port->sched.queue_size) {
+        int size = port->sched.queue_size ? 2 * port->sched.queue_size : 64;
+        struct rs_port_sched_entry *queue =
+            malloc(size * sizeof(struct rs_port_sched_entry));
+        if (!queue) {
+            _drop_fragment(fragment);
+            return -1;
+        }
+        for (int i = 0; i < port->sched.queue_n; i++) {
+            queue[i] = port->sched.queue[(port->sched.queue_at + i) %
+                                         port->sched.queue_size];
+        }
+        free(port->sched.queue);
+        port->sched.queue = queue;
+        port->sched.queue_size = size;
+        port->sched.queue_at = 0;
+    }
+
+    int len = rs_packet_len(&fragment->super);
+    if (port->sched.queue_n && port->sched.bytes + len > port->sched.bytes_max)
+        syslog(LOG_DEBUG, "port %d: TX queue full", port->id);
+    while (port->sched.queue_n &&
+           port->sched.bytes + len > port->sched.bytes_max)
+        _sched_pop(port);
+
+    struct rs_port_sched_entry *entry =
+        &port->sched.queue[(port->sched.queue_at + port->sched.queue_n) %
+                           port->sched.queue_size];
+    entry->fragment = fragment;
+    entry->len = len;
+    entry->has_deadline = deadline != NULL;
+    if (deadline)
+        entry->deadline = *deadline;
+    port->sched.queue_n++;
+    port->sched.bytes += len;
+    return len;
+}
+
+static int _sched_ready(struct rs_port *port) {
+    return port->sched.queue_n &&
+           (!port->sched.rate_kbps || port->sched.tokens >= 0.);
+}
+
+/*
+ * Send queued fragments of port within its deficit and rate cap. Deadlines
+ * are checked against the precise time, as each inject may block
+ */
+static void _sched_serve(struct rs_port_layer *layer, struct rs_port *port) {
+    port->sched.deficit += (long)port->sched.weight * RS_PORT_SCHED_QUANTUM;
+
+    while (_sched_ready(port)) {
+        struct rs_port_sched_entry *entry =
+            &port->sched.queue[port->sched.queue_at];
+        if (entry->has_deadline) {
+            struct timespec now;
+            rs_clock_precise(&now);
+            if (msec_diff(now, entry->deadline) > 0) {
+                _sched_pop(port);
+                continue;
+            }
+        }
+        if (entry->len > port->sched.deficit)
+            break;
+
+        struct rs_port_layer_packet *fragment = entry->fragment;
+        entry->fragment = NULL;
+        port->sched.deficit -= entry->len;
+        port->sched.tokens -= entry->len;
+        port->sched.bytes -= entry->len;
+        port->sched.queue_at =
+            (port->sched.queue_at + 1) % port->sched.queue_size;
+        port->sched.queue_n--;
+
+        struct rs_channel_layer *ch = rs_server_channel_layer_for_channel(
+            layer->server, port->bound_channel);
+        if (ch)
+            _channel_transmit(layer, port, ch, fragment);
+        _drop_fragment(fragment);
+    }
+
+    if (!port->sched.queue_n)
+        port->sched.deficit = 0;
+}
+
+void rs_port_layer_flush(struct rs_port_layer *layer) {
+    if (!layer->tx_schedule || !layer->n_ports)
+        return;
+
+    struct timespec now;
+    rs_clock_now(&now);
+
+    /* Refill token buckets */
+    for (int i = 0; i < layer->n_ports; i++) {
+        struct rs_port *port = layer->ports[i];
+        if (!port->sched.rate_kbps)
+            continue;
+
+        double msec = 1000. * (now.tv_sec - port->sched.refill_ts.tv_sec) +
+                      (now.tv_nsec - port->sched.refill_ts.tv_nsec) / 1000000.;
+        double bytes_per_msec = port->sched.rate_kbps / 8.;
+        port->sched.tokens += msec * bytes_per_msec;
+        if (port->sched.tokens > RS_PORT_SCHED_BURST_MSEC * bytes_per_msec)
+            port->sched.tokens = RS_PORT_SCHED_BURST_MSEC * bytes_per_msec;
+        port->sched.refill_ts = now;
+    }
+
+    /* Rounds over the ports of the highest priority with something to send,
+     * lower priorities are served once those are empty or capped */
+    for (;;) {
+        int found = 0;
+        int priority = 0;
+        for (int i = 0; i < layer->n_ports; i++) {
+            if (_sched_ready(layer->ports[i]) &&
+                (!found || layer->ports[i]->sched.priority > priority)) {
+                found = 1;
+                priority = layer->ports[i]->sched.priority;
+            }
+        }
+        if (!found)
+            break;
+
+        for (int j = 0; j < layer->n_ports; j++) {
+            struct rs_port *port =
+                layer->ports[(layer->tx_schedule_rr + j) % layer->n_ports];
+            if (port->sched.priority == priority && _sched_ready(port))
+                _sched_serve(layer, port);
+        }
+        layer->tx_schedule_rr = (layer->tx_schedule_rr + 1) % layer->n_ports;
+    }
+
+    for (int i = 0; i < layer->server->n_channel_layers; i++)
+        rs_channel_layer_flush(layer->server->channel_layers[i]);
+}
+
+static int _transmit_segmented(struct rs_port_layer *layer,
+                               struct rs_port_layer_packet *packet,
+                               struct rs_port *port,
+                               struct rs_channel_layer *channel_layer,
+                               int max_segment_len,
+                               const struct timespec *deadline);
+
+/* Not yet sent fragments are dropped once deadline (if nonnull) has passed */
 static int _transmit_fragmented(struct rs_port_layer *layer,
                                 struct rs_port_layer_packet *packet,
                                 struct rs_port *port,
-                                struct rs_channel_layer *channel_layer) {
+                                struct rs_channel_layer *channel_layer,
+                                const struct timespec *deadline) {
 
     /* Split packet if necessary */
-    struct rs_port_layer_packet **fragments;
+    struct rs_port_layer_packet *fragments[RS_PORT_LAYER_MAX_FRAGMENTS];
 
     /* Do not use FEC for commands */
     double fec_factor = port->tx_target_fec_factor;
@@ -173,20 +727,67 @@ static int _transmit_fragmented(struct rs_port_layer *layer,
         fec_factor = 1.;
     }
 
+    /* More than RS_PORT_LAYER_MAX_FRAGMENTS fragments needed, split refuses
+     * or reduces parity if the other side does not reassemble segments */
+    int max_size =
+        rs_channel_layer_max_packet_size(channel_layer, port->bound_channel);
+    int max_k = RS_PORT_LAYER_MAX_FRAGMENTS / fec_factor;
+    if (max_k < 1)
+        max_k = 1;
+    if (rs_channel_layer_segment(channel_layer, port->bound_channel) &&
+        packet->n_segments == 1 &&
+        (long)packet->payload_len > (long)max_k * max_size)
+        return _transmit_segmented(layer, packet, port, channel_layer,
+                                   max_k * max_size, deadline);
+
+    int xor_parity = rs_channel_layer_xor(channel_layer, port->bound_channel);
     int n_fragments = rs_port_layer_packet_split(
-        packet, port, &fragments,
-        rs_channel_layer_max_packet_size(channel_layer, port->bound_channel),
-        fec_factor);
+        packet, port, fragments, max_size, fec_factor, xor_parity);
+    if (!n_fragments)
+        return -1;
     rs_stat_register(&port->tx_stats_fec_factor,
                      (double)fragments[0]->n_frag_encoded /
                          (double)fragments[0]->n_frag_decoded);
 
+    /* Without scheduling or aggregation all fragments go out in one batch */
+    int scheduled = layer->tx_schedule && !packet->command;
+    int batched = !scheduled && !(port->aggregate_msec &&
+                                  rs_channel_layer_aggregate(
+                                      channel_layer, port->bound_channel));
+
     int total_bytes = 0;
     int bytes;
-    for (int i = 0; i < n_fragments; i++) {
-        if ((bytes =
-                 rs_channel_layer_transmit(channel_layer, &fragments[i]->super,
-                                           port->bound_channel)) > 0) {
+    int n_sent;
+    for (int i = 0; i < n_fragments; i += n_sent) {
+        n_sent = 1;
+        if (deadline) {
+            /* Not the cached time, the injects before may have blocked */
+            struct timespec now;
+            rs_clock_precise(&now);
+            if (msec_diff(now, *deadline) > 0) {
+                syslog(LOG_DEBUG, "port %d: frame %d expired after %d of %d "
+                       "fragments", port->id, packet->seq, i, n_fragments);
+                total_bytes = RS_PORT_LAYER_EXPIRED;
+                goto cleanup;
+            }
+        }
+
+        if (scheduled) {
+            /* The fragment is sent by rs_port_layer_flush */
+            struct rs_port_layer_packet *queued =
+                fragments[i] == packet ? _fragment_copy(packet) : fragments[i];
+            if (queued != packet)
+                fragments[i] = NULL;
+            bytes = queued ? _sched_enqueue(port, queued, deadline) : -1;
+        } else if (batched) {
+            n_sent = n_fragments - i;
+            bytes = _channel_transmit_batch(layer, port, channel_layer,
+                                            fragments + i, n_sent);
+        } else {
+            bytes = _channel_transmit(layer, port, channel_layer, fragments[i]);
+        }
+
+        if (bytes > 0) {
             total_bytes += bytes;
         } else {
             total_bytes = -1;
@@ -195,21 +796,93 @@ static int _transmit_fragmented(struct rs_port_layer *layer,
     }
 
 cleanup:
+    if (rs_channel_layer_flush(channel_layer) < 0 && total_bytes >= 0)
+        total_bytes = -1;
+
     for (int i = 0; i < n_fragments; i++) {
-        if (fragments[i] != packet) {
-            rs_packet_destroy(&fragments[i]->super);
-            free(fragments[i]);
+        if (fragments[i] && fragments[i] != packet)
+            _drop_fragment(fragments[i]);
+    }
+
+    return total_bytes;
+}
+
+/* Send packet as independent FEC blocks of at most max_segment_len bytes
+ * each, all under the seq of packet */
+static int _transmit_segmented(struct rs_port_layer *layer,
+                               struct rs_port_layer_packet *packet,
+                               struct rs_port *port,
+                               struct rs_channel_layer *channel_layer,
+                               int max_segment_len,
+                               const struct timespec *deadline) {
+    int len = packet->payload_len;
+    int n_segments = (len + max_segment_len - 1) / max_segment_len;
+    if (n_segments > RS_PORT_LAYER_MAX_SEGMENTS) {
+        syslog(LOG_ERR, "port %d: frame of %d bytes too big", port->id, len);
+        return -1;
+    }
+
+    /* Flat payload, only a chain of packets needs to be packed first */
+    uint8_t *payload = packet->super.payload_data;
+    struct rs_buffer *payload_buf = NULL;
+    struct rs_packet *payload_packet = packet->super.payload_packet;
+    if (payload_packet) {
+        if (!payload_packet->payload_packet &&
+            !payload_packet->payload_iov &&
+            !rs_packet_len_header(payload_packet)) {
+            payload = payload_packet->payload_data;
+        } else {
+            payload_buf = rs_buffer_new(len);
+            if (!payload_buf)
+                return -1;
+
+            uint8_t *b = payload_buf->data;
+            int bl = len;
+            rs_packet_pack(payload_packet, &b, &bl);
+            payload = payload_buf->data;
         }
     }
 
-    free(fragments);
+    /* Equal sizes, so that all segments share the FEC parameters */
+    int segment_len = (len + n_segments - 1) / n_segments;
+    syslog(LOG_DEBUG, "port %d: sending %d bytes in %d segments", port->id,
+           len, n_segments);
+
+    int total_bytes = 0;
+    for (int i = 0; i < n_segments; i++) {
+        int n = len - i * segment_len;
+        if (n > segment_len)
+            n = segment_len;
+
+        struct rs_port_layer_packet segment;
+        rs_port_layer_packet_init(&segment, NULL, NULL,
+                                  payload + i * segment_len, n);
+        segment.port = packet->port;
+        segment.seq = packet->seq;
+        segment.segment = i;
+        segment.n_segments = n_segments;
+        segment.stats = packet->stats;
+        rs_port_layer_packet_set_format(&segment, packet->compact,
+                                        packet->has_stats && i == 0);
+
+        int bytes = _transmit_fragmented(layer, &segment, port, channel_layer,
+                                         deadline);
+        rs_packet_destroy(&segment.super);
+        if (bytes < 0) {
+            total_bytes = bytes == RS_PORT_LAYER_EXPIRED ? bytes : -1;
+            break;
+        }
+        total_bytes += bytes;
+    }
 
+    rs_buffer_unref(payload_buf);
     return total_bytes;
 }
 
 static int _transmit(struct rs_port_layer *layer,
                      struct rs_port_layer_packet *packet, struct rs_port *port,
-                     struct rs_port *original_port) {
+                     struct rs_port *original_port,
+                     const struct timespec *deadline) {
 
     if (!original_port) {
         original_port = port;
@@ -221,19 +894,32 @@ static int _transmit(struct rs_port_layer *layer,
         syslog(LOG_ERR, "Invalid channel: %d", port->bound_channel);
     }
 
-    /* Publish stats of original_port */
+    /* Publish stats of original_port, in the compact format only with
+     * commands and every RS_PORT_STATS_MSEC */
+    struct timespec now;
+    rs_clock_now(&now);
     rs_stats_packed_init(&packet->stats, &original_port->stats);
+    rs_port_layer_packet_set_format(
+        packet, ch && rs_channel_layer_compact(ch, port->bound_channel),
+        packet->command || msec_diff(now, original_port->tx_stats_last_ts) >=
+                               RS_PORT_STATS_MSEC);
 
     int res;
     packet->port = port->id;
     packet->seq = port->tx_last_seq + 1;
 
-    if ((res = _transmit_fragmented(layer, packet, port, ch)) >= 0) {
+    res = _transmit_fragmented(layer, packet, port, ch, deadline);
+    if (res == RS_PORT_LAYER_EXPIRED) {
+        /* Fragments may have been sent under seq already */
+        port->tx_last_seq++;
+    } else if (res >= 0) {
         port->tx_last_seq++;
-        clock_gettime(CLOCK_REALTIME, &port->tx_last_ts);
+        rs_clock_now(&port->tx_last_ts);
 
         /* Register stats */
         rs_stats_register_tx(&port->stats, packet->payload_len);
+        if (packet->has_stats)
+            original_port->tx_stats_last_ts = now;
 
         if (original_port != port) {
             /* Also denote in original_port that something happened - as far as
@@ -246,231 +932,879 @@ static int _transmit(struct rs_port_layer *layer,
     return res;
 }
 
-int rs_port_layer_transmit(struct rs_port_layer *layer,
-                           struct rs_packet *send_packet, rs_port_id_t port) {
+/* Send one fragment of the open group, stats are only published on primary
+ * fragments */
+static int _transmit_group_fragment(struct rs_port_layer *layer,
+                                    struct rs_port *port,
+                                    struct rs_port_layer_packet *fragment) {
+    struct rs_channel_layer *ch =
+        rs_server_channel_layer_for_channel(layer->server, port->bound_channel);
+    if (!ch) {
+        syslog(LOG_ERR, "Invalid channel: %d", port->bound_channel);
+        return -1;
+    }
 
-    struct rs_port *p = NULL;
-    for (int i = 0; i < layer->n_ports; i++) {
-        if (layer->ports[i]->id == port) {
-            p = layer->ports[i];
-            break;
+    struct timespec now;
+    rs_clock_now(&now);
+    fragment->port = port->id;
+    fragment->seq = port->group.seq;
+    fragment->group = 1;
+    rs_stats_packed_init(&fragment->stats, &port->stats);
+    rs_port_layer_packet_set_format(
+        fragment, rs_channel_layer_compact(ch, port->bound_channel),
+        fragment->n_frag_encoded == 0 &&
+            msec_diff(now, port->tx_stats_last_ts) >= RS_PORT_STATS_MSEC);
+
+    int res;
+    if (layer->tx_schedule) {
+        struct rs_port_layer_packet *queued = _fragment_copy(fragment);
+        res = queued ? _sched_enqueue(port, queued, NULL) : -1;
+    } else {
+        res = _channel_transmit(layer, port, ch, fragment);
+        if (rs_channel_layer_flush(ch) < 0)
+            res = -1;
+    }
+
+    if (res > 0) {
+        port->tx_last_ts = now;
+        if (fragment->n_frag_encoded == 0 && fragment->has_stats)
+            port->tx_stats_last_ts = now;
+    }
+    return res;
+}
+
+/* Send parity of the open group */
+static void _group_close(struct rs_port_layer *layer, struct rs_port *port) {
+    int k = port->group.k;
+    if (!k)
+        return;
+    rs_timer_cancel(&layer->server->timers, &port->group.timer);
+
+    int m = round(port->tx_target_fec_factor * k);
+    if (m > RS_PORT_LAYER_MAX_FRAGMENTS)
+        m = RS_PORT_LAYER_MAX_FRAGMENTS;
+    if (m < k)
+        m = k;
+    rs_stat_register(&port->tx_stats_fec_factor, (double)m / (double)k);
+
+    int len = port->group.block_len;
+    int stride = RS_PACKET_HEADROOM + len;
+    struct rs_buffer *buf =
+        m > k ? rs_buffer_new((m - k) * stride + k * len) : NULL;
+    if (buf) {
+        uint8_t *primary[RS_PORT_GROUP_MAX_FRAMES];
+        uint8_t *parity[RS_PORT_LAYER_MAX_FRAGMENTS];
+        unsigned int block_nums[RS_PORT_LAYER_MAX_FRAGMENTS];
+
+        /* Zero padded primary blocks behind the parity blocks */
+        for (int i = 0; i < k; i++) {
+            primary[i] = buf->data + (m - k) * stride + i * len;
+            memcpy(primary[i], port->group.blocks[i]->data + RS_PACKET_HEADROOM,
+                   port->group.block_lens[i]);
+            memset(primary[i] + port->group.block_lens[i], 0,
+                   len - port->group.block_lens[i]);
+        }
+        for (int j = 0; j < m - k; j++) {
+            parity[j] = buf->data + j * stride + RS_PACKET_HEADROOM;
+            block_nums[j] = k + j;
         }
+
+        /* XOR parity only if the other side decodes it */
+        struct rs_channel_layer *ch = rs_server_channel_layer_for_channel(
+            layer->server, port->bound_channel);
+        int xor_parity = m == k + 1 && ch &&
+                         rs_channel_layer_xor(ch, port->bound_channel);
+
+        rs_port_setup_tx_fec(port, k, m);
+        if (xor_parity)
+            rs_fec_xor((const uint8_t **)primary, k, parity[0], len);
+        else
+            rs_fec_encode(port->tx_fec, (const uint8_t **)primary, parity,
+                          block_nums, m - k, len);
+
+        for (int j = 0; j < m - k; j++) {
+            struct rs_port_layer_packet fragment;
+            rs_port_layer_packet_init(&fragment, rs_buffer_ref(buf), NULL,
+                                      parity[j], len);
+            fragment.super.payload_data_headroom = RS_PACKET_HEADROOM;
+            fragment.frag = k + j;
+            fragment.n_frag_decoded = k;
+            fragment.n_frag_encoded = m;
+            fragment.xor_parity = xor_parity;
+            _transmit_group_fragment(layer, port, &fragment);
+            rs_packet_destroy(&fragment.super);
+        }
+        rs_buffer_unref(buf);
+    }
+
+    for (int i = 0; i < k; i++) {
+        rs_buffer_unref(port->group.blocks[i]);
+        port->group.blocks[i] = NULL;
     }
+    port->group.k = 0;
+}
+
+/* Frames are sent as primary fragments right away and kept for the parity */
+static int _transmit_grouped(struct rs_port_layer *layer, struct rs_port *port,
+                             struct rs_packet *frame,
+                             const struct timespec *deadline) {
+    struct timespec now;
+    rs_clock_now(&now);
+    if (port->group.k &&
+        msec_diff(now, port->group.opened) >= port->group.latency_msec)
+        _group_close(layer, port);
 
+    struct rs_channel_layer *ch =
+        rs_server_channel_layer_for_channel(layer->server, port->bound_channel);
+    if (!ch) {
+        syslog(LOG_ERR, "Invalid channel: %d", port->bound_channel);
+        return -1;
+    }
+
+    /* Does not fit into one packet, or the other side can not tell group
+     * fragments: sent on its own */
+    int len = rs_packet_len(frame);
+    if (!rs_channel_layer_group(ch, port->bound_channel) ||
+        len + RS_PORT_LAYER_GROUP_LEN_PREFIX >
+            rs_channel_layer_max_packet_size(ch, port->bound_channel) ||
+        len > UINT16_MAX) {
+        _group_close(layer, port);
+
+        struct rs_port_layer_packet packed;
+        rs_port_layer_packet_init(&packed, NULL, frame, NULL, 0);
+        int res = _transmit(layer, &packed, port, NULL, deadline);
+        rs_packet_destroy(&packed.super);
+        return res;
+    }
+
+    struct rs_buffer *block = rs_buffer_new(
+        RS_PACKET_HEADROOM + RS_PORT_LAYER_GROUP_LEN_PREFIX + len);
+    if (!block)
+        return -1;
+    uint8_t *data = block->data + RS_PACKET_HEADROOM;
+    rs_store_be16(data, len);
+    uint8_t *b = data + RS_PORT_LAYER_GROUP_LEN_PREFIX;
+    int bl = len;
+    rs_packet_pack(frame, &b, &bl);
+
+    if (!port->group.k) {
+        /* Reserve seq, so that commands in between do not collide */
+        port->group.seq = ++port->tx_last_seq;
+        port->group.opened = now;
+        port->group.block_len = 0;
+        rs_timer_schedule(&layer->server->timers, &port->group.timer,
+                          port->group.latency_msec);
+    }
+
+    int k = port->group.k++;
+    port->group.blocks[k] = block;
+    port->group.block_lens[k] = RS_PORT_LAYER_GROUP_LEN_PREFIX + len;
+    if (port->group.block_lens[k] > port->group.block_len)
+        port->group.block_len = port->group.block_lens[k];
+
+    struct rs_port_layer_packet fragment;
+    rs_port_layer_packet_init(&fragment, rs_buffer_ref(block), NULL, data,
+                              RS_PORT_LAYER_GROUP_LEN_PREFIX + len);
+    fragment.super.payload_data_headroom = RS_PACKET_HEADROOM;
+    fragment.frag = k;
+    fragment.n_frag_decoded = k + 1;
+    fragment.n_frag_encoded = 0;
+    int res = _transmit_group_fragment(layer, port, &fragment);
+    rs_packet_destroy(&fragment.super);
+    if (res > 0)
+        rs_stats_register_tx(&port->stats, len);
+
+    if (port->group.k == port->group.max_k)
+        _group_close(layer, port);
+
+    return res;
+}
+
+int rs_port_layer_transmit(struct rs_port_layer *layer,
+                           struct rs_packet *send_packet, rs_port_id_t port,
+                           const struct timespec *ts) {
+
+    struct rs_port *p = layer->ports_by_id[port];
     if (!p) {
         syslog(LOG_ERR, "Unknown port: %d", port);
         return 0;
     }
 
+    struct timespec deadline;
+    if (p->latency_msec) {
+        if (ts)
+            deadline = *ts;
+        else
+            rs_clock_now(&deadline);
+        timespec_plus_ms(&deadline, p->latency_msec);
+
+        struct timespec now;
+        rs_clock_now(&now);
+        if (msec_diff(now, deadline) > 0)
+            return RS_PORT_LAYER_EXPIRED;
+    }
+
+    if (p->group.max_k)
+        return _transmit_grouped(layer, p, send_packet,
+                                 p->latency_msec ? &deadline : NULL);
+
     struct rs_port_layer_packet packed;
     rs_port_layer_packet_init(&packed, NULL, send_packet, NULL, 0);
 
-    int res = _transmit(layer, &packed, p, NULL);
+    int res =
+        _transmit(layer, &packed, p, NULL, p->latency_msec ? &deadline : NULL);
 
     rs_packet_destroy(&packed.super);
     return res;
 }
 
-#define RS_PORT_LAYER_INCOMPLETE 2
+/* seq is at most n behind ref (also if equal) */
+static inline int _seq_behind(rs_port_layer_seq_t seq, rs_port_layer_seq_t ref,
+                              int n) {
+    return (rs_port_layer_seq_t)(ref - seq) <= n;
+}
 
-static int _receive_fragmented(struct rs_port_layer *layer,
-                               struct rs_port_layer_packet *fragment,
-                               struct rs_port *port,
-                               struct rs_port_layer_packet **packet_ret) {
-    if (fragment->n_frag_encoded == 1) {
-        *packet_ret = fragment;
-        return 0;
+static inline int _seq_before(rs_port_layer_seq_t a, rs_port_layer_seq_t b) {
+    return (int16_t)(a - b) < 0;
+}
+
+static void _reassembly_release_fragments(struct rs_port *port,
+                                          struct rs_port_reassembly_block *block) {
+    for (int i = 0; i < block->n_frag_received; i++) {
+        rs_packet_destroy(&block->fragments[i]->super);
+        rs_port_layer_packet_free(block->fragments[i]);
+        block->fragments[i] = NULL;
     }
+    block->n_frag_received = 0;
+    port->reassembly.memory -= block->bytes;
+    block->bytes = 0;
+    memset(block->received, 0, sizeof(block->received));
+}
 
-    if (fragment->seq != port->frag_buffer.seq) {
-        port->frag_buffer.seq = fragment->seq;
-        port->frag_buffer.n_frag_received = 0;
-        for (int i = 0; i < port->frag_buffer.n_frag; i++) {
-            if (port->frag_buffer.fragments[i]) {
-                rs_packet_destroy(&port->frag_buffer.fragments[i]->super);
-                free(port->frag_buffer.fragments[i]);
-            }
-        }
-        port->frag_buffer.n_frag = fragment->n_frag_encoded;
-        port->frag_buffer.fragments =
-            realloc(port->frag_buffer.fragments,
-                    fragment->n_frag_encoded * sizeof(void *));
-        for (int i = 0; i < port->frag_buffer.n_frag; i++) {
-            port->frag_buffer.fragments[i] = NULL;
+/* Release fragments, segments and joined packet, keeps state and seq */
+static void _reassembly_release(struct rs_port *port,
+                                struct rs_port_reassembly_block *block) {
+    _reassembly_release_fragments(port, block);
+
+    if (block->segments) {
+        for (int i = 0; i < block->segment; i++) {
+            rs_packet_destroy(&block->segments[i]->super);
+            rs_port_layer_packet_free(block->segments[i]);
         }
+        free(block->segments);
+        block->segments = NULL;
     }
+    block->segment = 0;
 
-    int new_fragment = 1;
-    for (int i = 0; i < port->frag_buffer.n_frag_received; i++) {
-        if (port->frag_buffer.fragments[i]->frag == fragment->frag) {
-            new_fragment = 0;
-            break;
-        }
+    if (block->joined) {
+        rs_packet_destroy(&block->joined->super);
+        rs_port_layer_packet_free(block->joined);
+        block->joined = NULL;
     }
+}
 
-    if (new_fragment) {
-        port->frag_buffer.fragments[port->frag_buffer.n_frag_received] =
-            fragment;
-        port->frag_buffer.n_frag_received++;
+static void _reassembly_drop(struct rs_port *port,
+                             struct rs_port_reassembly_block *block) {
+    if (block->state == RS_PORT_BLOCK_INCOMPLETE ||
+        block->state == RS_PORT_BLOCK_READY) {
+        syslog(LOG_DEBUG, "port %d: dropping block %d", port->id, block->seq);
     }
+    _reassembly_release(port, block);
+    block->state = RS_PORT_BLOCK_DONE;
+}
 
-    if (port->frag_buffer.n_frag_received == fragment->n_frag_decoded) {
-        *packet_ret = calloc(1, sizeof(struct rs_port_layer_packet));
+/* Drop the oldest incomplete block other than except, 0 if there is none */
+static int _reassembly_evict_oldest(struct rs_port *port,
+                                    struct rs_port_reassembly_block *except) {
+    struct rs_port_reassembly_block *oldest = NULL;
+    for (int i = 0; i < port->reassembly.n_blocks; i++) {
+        struct rs_port_reassembly_block *b = &port->reassembly.blocks[i];
+        if (b == except || b->state != RS_PORT_BLOCK_INCOMPLETE)
+            continue;
+        if (!oldest || _seq_before(b->seq, oldest->seq))
+            oldest = b;
+    }
 
-        rs_stat_register(
-            &port->rx_stats_fec_factor,
-            (double)port->frag_buffer.fragments[0]->n_frag_encoded /
-                (double)port->frag_buffer.fragments[0]->n_frag_decoded);
-        int res = rs_port_layer_packet_join(*packet_ret, port,
-                                            port->frag_buffer.fragments,
-                                            port->frag_buffer.n_frag_received);
-        if (res) {
-            free(*packet_ret);
-            *packet_ret = NULL;
+    if (!oldest)
+        return 0;
+    _reassembly_drop(port, oldest);
+    return 1;
+}
+
+/* Block for the seq of fragment, set up if new. Drops fragment and returns
+ * NULL if it is outdated */
+static struct rs_port_reassembly_block *
+_reassembly_block(struct rs_port *port, struct rs_port_layer_packet *fragment) {
+    int n_blocks = port->reassembly.n_blocks;
+
+    /* Already delivered or given up on (far behind means the peer restarted)
+     */
+    if (port->reassembly.has_delivered &&
+        _seq_behind(fragment->seq, port->reassembly.delivered_seq,
+                    n_blocks)) {
+        _drop_fragment(fragment);
+        return NULL;
+    }
+
+    struct rs_port_reassembly_block *block =
+        &port->reassembly.blocks[fragment->seq % n_blocks];
+    if (block->state == RS_PORT_BLOCK_FREE || block->seq != fragment->seq) {
+        if (block->state != RS_PORT_BLOCK_FREE &&
+            _seq_behind(fragment->seq, block->seq, n_blocks)) {
+            /* Older than the window */
+            _drop_fragment(fragment);
+            return NULL;
         }
-        return res;
+
+        _reassembly_drop(port, block);
+        block->seq = fragment->seq;
+        block->state = RS_PORT_BLOCK_INCOMPLETE;
+        rs_clock_now(&block->first_ts);
+        block->n_frag_decoded = 0;
+        block->n_frag_encoded = 0;
+        block->n_segments = fragment->n_segments;
     }
 
-    return RS_PORT_LAYER_INCOMPLETE;
+    return block;
 }
 
-static int _receive(struct rs_port_layer *layer, struct rs_packet **packet_ret,
-                    rs_port_id_t *port_ret, rs_channel_t channel) {
-    struct rs_channel_layer *ch =
-        rs_server_channel_layer_for_channel(layer->server, channel);
-
-    if (!ch) {
-        syslog(LOG_ERR, "Could not find layer for channel %d", channel);
+/* Keep fragment in block, drops it and returns -1 on duplicates or if the
+ * memory cap is hit */
+static int _reassembly_store(struct rs_port *port,
+                             struct rs_port_reassembly_block *block,
+                             struct rs_port_layer_packet *fragment) {
+    if (block->received[fragment->frag / 64] &
+        (1ULL << (fragment->frag % 64))) {
+        _drop_fragment(fragment);
         return -1;
     }
 
-    struct rs_packet *packet = NULL;
-    struct rs_port_layer_packet *unpacked =
-        calloc(1, sizeof(struct rs_port_layer_packet));
+    int len = fragment->super.payload_data_len;
+    while (port->reassembly.memory + len > port->reassembly.memory_max &&
+           _reassembly_evict_oldest(port, block))
+        ;
+    if (port->reassembly.memory + len > port->reassembly.memory_max) {
+        syslog(LOG_DEBUG, "port %d: reassembly memory exhausted", port->id);
+        _drop_fragment(fragment);
+        return -1;
+    }
 
-retry:
-    switch (rs_channel_layer_receive(ch, &packet, &channel)) {
-    case 0:
-        if (rs_port_layer_packet_unpack(unpacked, packet)) {
-            /* packed that could not be unpacked */
-            syslog(LOG_ERR, "Could not unpack at port layer");
-            free(packet);
-            free(unpacked);
+    /* The fragment is kept beyond the next receive on the channel layer, so
+     * its payload may not be borrowed */
+    if (!fragment->super.payload_ownership) {
+        struct rs_buffer *copy = rs_buffer_new(len);
+        if (!copy) {
+            _drop_fragment(fragment);
             return -1;
         }
-        rs_packet_destroy(packet);
-        free(packet);
-        packet = NULL;
+        memcpy(copy->data, fragment->super.payload_data, len);
+        fragment->super.payload_ownership = copy;
+        fragment->super.payload_data = copy->data;
+    }
 
-        struct rs_port *port = NULL;
-        for (int i = 0; i < layer->n_ports; i++) {
-            if (layer->ports[i]->id == unpacked->port) {
-                port = layer->ports[i];
-            }
+    block->received[fragment->frag / 64] |= 1ULL << (fragment->frag % 64);
+    block->fragments[block->n_frag_received++] = fragment;
+    block->bytes += len;
+    port->reassembly.memory += len;
+    return 0;
+}
+
+/* Takes ownership of fragment, complete blocks become RS_PORT_BLOCK_READY */
+static void _reassembly_add(struct rs_port *port,
+                            struct rs_port_layer_packet *fragment) {
+    struct rs_port_reassembly_block *block = _reassembly_block(port, fragment);
+    if (!block)
+        return;
+
+    if (!block->n_frag_received) {
+        block->n_frag_decoded = fragment->n_frag_decoded;
+        block->n_frag_encoded = fragment->n_frag_encoded;
+    }
+
+    if (block->state != RS_PORT_BLOCK_INCOMPLETE ||
+        block->n_segments != fragment->n_segments ||
+        fragment->segment < block->segment) {
+        /* Inconsistent, or block / segment has already been decoded */
+        _drop_fragment(fragment);
+        return;
+    }
+
+    if (fragment->segment != block->segment) {
+        /* Segments are sent one after the other, the current one will not
+         * complete any more */
+        _reassembly_drop(port, block);
+        _drop_fragment(fragment);
+        return;
+    }
+
+    if (block->n_frag_decoded != fragment->n_frag_decoded ||
+        block->n_frag_encoded != fragment->n_frag_encoded ||
+        fragment->frag >= fragment->n_frag_encoded) {
+        _drop_invalid(port, fragment);
+        return;
+    }
+
+    if (_reassembly_store(port, block, fragment))
+        return;
+    if (block->n_frag_received < block->n_frag_decoded)
+        return;
+
+    rs_stat_register(&port->rx_stats_fec_factor,
+                     (double)block->n_frag_encoded /
+                         (double)block->n_frag_decoded);
+
+    struct rs_port_layer_packet *joined = rs_port_layer_packet_alloc();
+    if (rs_port_layer_packet_join(joined, port, block->fragments,
+                                  block->n_frag_received)) {
+        rs_port_layer_packet_free(joined);
+        _reassembly_drop(port, block);
+        return;
+    }
+
+    if (block->n_segments > 1) {
+        /* joined references the fragment buffers, continue with the next
+         * segment */
+        if (!block->segments)
+            block->segments = calloc(block->n_segments, sizeof(joined));
+        block->segments[block->segment++] = joined;
+        _reassembly_release_fragments(port, block);
+        if (block->segment < block->n_segments)
+            return;
+
+        joined = rs_port_layer_packet_alloc();
+        if (rs_port_layer_packet_join_segments(joined, block->segments,
+                                               block->n_segments)) {
+            rs_port_layer_packet_free(joined);
+            _reassembly_drop(port, block);
+            return;
         }
+    }
 
-        if (!port) {
-            syslog(LOG_ERR, "Received packet on unknown port");
-            goto retry;
+    /* joined references the fragment buffers */
+    _reassembly_release(port, block);
+    block->joined = joined;
+    block->state = RS_PORT_BLOCK_READY;
+}
+
+/* Frame carried by a primary fragment of a group, NULL if malformed */
+static struct rs_port_layer_packet *
+_group_frame(struct rs_port_layer_packet *fragment) {
+    uint8_t *data = fragment->super.payload_data;
+    int len = fragment->super.payload_data_len - RS_PORT_LAYER_GROUP_LEN_PREFIX;
+    if (len < 0 || rs_load_be16(data) > len)
+        return NULL;
+    len = rs_load_be16(data);
+
+    struct rs_port_layer_packet *frame = rs_port_layer_packet_alloc();
+    rs_port_layer_packet_init(
+        frame, rs_buffer_ref(fragment->super.payload_ownership), NULL,
+        data + RS_PORT_LAYER_GROUP_LEN_PREFIX, len);
+    frame->port = fragment->port;
+    frame->seq = fragment->seq;
+    frame->group = 1;
+    frame->has_stats = fragment->has_stats;
+    frame->stats = fragment->stats;
+    return frame;
+}
+
+/*
+ * Takes ownership of a fragment of a group. Primary fragments are returned as
+ * frame right away, frames recovered from parity become RS_PORT_BLOCK_READY
+ */
+static struct rs_port_layer_packet *
+_group_add(struct rs_port *port, struct rs_port_layer_packet *fragment) {
+    struct rs_port_reassembly_block *block = _reassembly_block(port, fragment);
+    if (!block)
+        return NULL;
+
+    int primary = fragment->n_frag_encoded == 0;
+    if (block->state != RS_PORT_BLOCK_INCOMPLETE ||
+        (primary && block->n_frag_decoded &&
+         fragment->frag >= block->n_frag_decoded) ||
+        (!primary && (fragment->frag < fragment->n_frag_decoded ||
+                      fragment->frag >= fragment->n_frag_encoded)) ||
+        (!primary && block->n_frag_decoded &&
+         (block->n_frag_decoded != fragment->n_frag_decoded ||
+          block->n_frag_encoded != fragment->n_frag_encoded))) {
+        if (block->state == RS_PORT_BLOCK_INCOMPLETE)
+            _drop_invalid(port, fragment);
+        else
+            _drop_fragment(fragment);
+        return NULL;
+    }
+
+    if (_reassembly_store(port, block, fragment))
+        return NULL;
+
+    struct rs_port_layer_packet *frame = NULL;
+    if (primary) {
+        frame = _group_frame(fragment);
+    } else {
+        block->n_frag_decoded = fragment->n_frag_decoded;
+        block->n_frag_encoded = fragment->n_frag_encoded;
+    }
+
+    /* Group parameters are only known from parity fragments */
+    int k = block->n_frag_decoded;
+    if (!k)
+        return frame;
+
+    int n_primary = 0;
+    for (int i = 0; i < block->n_frag_received; i++) {
+        if (block->fragments[i]->frag < k)
+            n_primary++;
+    }
+
+    if (n_primary == k) {
+        /* Everything delivered */
+        _reassembly_release(port, block);
+        block->state = RS_PORT_BLOCK_DONE;
+    } else if (block->n_frag_received >= k) {
+        rs_stat_register(&port->rx_stats_fec_factor,
+                         (double)block->n_frag_encoded / (double)k);
+
+        struct rs_port_layer_packet *joined = rs_port_layer_packet_alloc();
+        if (rs_port_layer_packet_join_group(joined, port, block->fragments,
+                                            block->n_frag_received, k,
+                                            block->n_frag_encoded)) {
+            rs_port_layer_packet_free(joined);
+            _reassembly_drop(port, block);
+        } else {
+            _reassembly_release(port, block);
+            block->joined = joined;
+            block->state = RS_PORT_BLOCK_READY;
         }
+    }
 
-        /*
-         * Handle earlier updates which have been missed (channel switched)
-         */
-        if (port->bound_channel != channel && !port->owner) {
-            syslog(LOG_ERR, "Appears the port has switched channels: %d",
-                   channel);
-            port->bound_channel = channel;
+    return frame;
+}
+
+/* Next block to deliver, or NULL */
+static struct rs_port_layer_packet *_reassembly_pop(struct rs_port *port) {
+    struct rs_port_reassembly_block *next = NULL;
+    for (int i = 0; i < port->reassembly.n_blocks; i++) {
+        struct rs_port_reassembly_block *b = &port->reassembly.blocks[i];
+        if (b->state == RS_PORT_BLOCK_READY &&
+            (!next || _seq_before(b->seq, next->seq)))
+            next = b;
+    }
+    if (!next)
+        return NULL;
+
+    if (port->reassembly.order == RS_PORT_DELIVER_IN_ORDER) {
+        for (int i = 0; i < port->reassembly.n_blocks; i++) {
+            struct rs_port_reassembly_block *b = &port->reassembly.blocks[i];
+            if (b->state == RS_PORT_BLOCK_INCOMPLETE &&
+                _seq_before(b->seq, next->seq))
+                return NULL;
         }
+    }
 
-        struct rs_port_layer_packet *result;
-        int res = _receive_fragmented(layer, unpacked, port, &result);
-        /* unpacked is possibly invalid by now, ownership n any case transferred
-         */
-        unpacked = calloc(1, sizeof(struct rs_port_layer_packet));
+    struct rs_port_layer_packet *res = next->joined;
+    next->joined = NULL;
+    next->state = RS_PORT_BLOCK_DONE;
+    port->reassembly.has_delivered = 1;
+    port->reassembly.delivered_seq = next->seq;
+
+    /* Drop complete blocks which are now outdated */
+    for (int i = 0; i < port->reassembly.n_blocks; i++) {
+        struct rs_port_reassembly_block *b = &port->reassembly.blocks[i];
+        if (b->state != RS_PORT_BLOCK_FREE && b->state != RS_PORT_BLOCK_DONE &&
+            _seq_before(b->seq, next->seq))
+            _reassembly_drop(port, b);
+    }
 
-        if (!res) {
-            if (result->seq == port->rx_last_seq) {
-                syslog(LOG_DEBUG, "Duplicate packet");
-                rs_packet_destroy(&result->super);
-                free(result);
+    return res;
+}
 
-                goto retry;
-            }
+/*
+ * Hand a complete packet to the caller (returns 0), or consume it
+ * (duplicates, commands). Takes ownership of result
+ */
+static int _deliver(struct rs_port_layer *layer, struct rs_port *port,
+                    struct rs_port_layer_packet *result,
+                    struct rs_packet **packet_ret, rs_port_id_t *port_ret) {
+    /* Frames of a group share seq */
+    if (!result->group && result->seq == port->rx_last_seq) {
+        syslog(LOG_DEBUG, "Duplicate packet");
+        rs_packet_destroy(&result->super);
+        rs_port_layer_packet_free(result);
+        return -1;
+    }
 
-            rs_stats_register_rx(&port->stats, result->payload_len,
-                                 result->seq - port->rx_last_seq - 1);
-            port->rx_last_seq = result->seq;
-
-            if (result->command) {
-                /* Received a command packet -> dispatch only after registering
-                 * stats */
-                rs_port_layer_main(layer, result);
-                rs_packet_destroy(&result->super);
-                free(result);
-                goto retry;
-            }
+    /* Blocks completing out of order are not counted as missed */
+    if (_seq_before(port->rx_last_seq, result->seq)) {
+        rs_stats_register_rx(&port->stats, result->payload_len,
+                             (rs_port_layer_seq_t)(result->seq -
+                                                   port->rx_last_seq - 1));
+        port->rx_last_seq = result->seq;
+    } else {
+        rs_stats_register_rx(&port->stats, result->payload_len, 0);
+    }
 
-            /* If the packet is a command handling the published stats is taken
-             * care of inside main, otherwise here */
-            rs_stats_register_published_stats(&port->stats, &result->stats);
+    if (result->command) {
+        /* Received a command packet -> dispatch only after registering
+         * stats */
+        rs_port_layer_main(layer, result);
+        rs_packet_destroy(&result->super);
+        rs_port_layer_packet_free(result);
+        return -1;
+    }
 
-            *port_ret = result->port;
+    /* If the packet is a command handling the published stats is taken
+     * care of inside main, otherwise here */
+    if (result->has_stats)
+        rs_stats_register_published_stats(&port->stats, &result->stats);
 
-            *packet_ret = calloc(1, sizeof(struct rs_packet));
-            rs_packet_init(*packet_ret, result->super.payload_ownership,
-                           result->super.payload_packet,
-                           result->super.payload_data,
-                           result->super.payload_data_len);
-            result->super.payload_ownership = NULL;
-            rs_packet_destroy(&result->super);
+    *port_ret = result->port;
 
-            if (result != unpacked) {
-                free(result);
-            }
+    *packet_ret = rs_packet_alloc();
+    rs_packet_init(*packet_ret, result->super.payload_ownership,
+                   result->super.payload_packet, result->super.payload_data,
+                   result->super.payload_data_len);
+    (*packet_ret)->payload_iov = result->super.payload_iov;
+    result->super.payload_ownership = NULL;
+    result->super.payload_iov = NULL;
+    rs_packet_destroy(&result->super);
+    rs_port_layer_packet_free(result);
 
-            free(unpacked);
-            return 0;
-        } else {
-            goto retry;
+    return 0;
+}
+
+/*
+ * Keep a received aggregate (takes ownership of packet) to split it into its
+ * port layer packets, returns 0 if packet is no aggregate
+ */
+static int _aggregate_begin(struct rs_port_layer *layer,
+                            struct rs_packet *packet, rs_channel_t channel) {
+    if (packet->payload_data_len < 1 ||
+        packet->payload_data[0] != RS_PORT_LAYER_PACKET_AGGREGATE_MARKER)
+        return 0;
+
+    /* Packets of the aggregate are handled beyond the next receive on the
+     * channel layer, so its payload may not be borrowed */
+    struct rs_buffer *buf = packet->payload_ownership;
+    uint8_t *data = packet->payload_data + 1;
+    int len = packet->payload_data_len - 1;
+    if (!buf) {
+        buf = rs_buffer_new(len);
+        if (buf) {
+            memcpy(buf->data, data, len);
+            data = buf->data;
         }
+    }
+    packet->payload_ownership = NULL;
+    rs_packet_destroy(packet);
+    rs_packet_free(packet);
+
+    rs_buffer_unref(layer->rx_aggregate.buf);
+    layer->rx_aggregate.buf = buf;
+    layer->rx_aggregate.next = data;
+    layer->rx_aggregate.left = len;
+    layer->rx_aggregate.channel = channel;
+    return 1;
+}
 
-        break;
-    case RS_CHANNEL_LAYER_EOF:
-        /* No more packets */
-        free(unpacked);
-        return RS_PORT_LAYER_EOF;
-    case RS_CHANNEL_LAYER_IRR:
-        /* Received a packet we do not care about */
+/* Next packet of the received aggregate, NULL once all are handled */
+static struct rs_packet *_aggregate_next(struct rs_port_layer *layer,
+                                         rs_channel_t *channel) {
+    if (!layer->rx_aggregate.buf)
+        return NULL;
+
+    uint32_t len;
+    int l = rs_load_varint(layer->rx_aggregate.next, layer->rx_aggregate.left,
+                           &len);
+    if (l < 0 || len > layer->rx_aggregate.left - l) {
+        if (layer->rx_aggregate.left)
+            syslog(LOG_ERR, "Could not split aggregate at port layer");
+        rs_buffer_unref(layer->rx_aggregate.buf);
+        layer->rx_aggregate.buf = NULL;
+        return NULL;
+    }
+
+    struct rs_packet *packet = rs_packet_alloc();
+    rs_packet_init(packet, rs_buffer_ref(layer->rx_aggregate.buf), NULL,
+                   layer->rx_aggregate.next + l, len);
+    layer->rx_aggregate.next += l + len;
+    layer->rx_aggregate.left -= l + len;
+    *channel = layer->rx_aggregate.channel;
+    return packet;
+}
+
+/*
+ * Unpack and dispatch a packet received on channel (takes ownership).
+ * Returns 0 if a packet was placed in the args, 1 if there is none (yet) and
+ * negative values on errors
+ */
+static int _receive_packet(struct rs_port_layer *layer,
+                           struct rs_packet *packet, rs_channel_t channel,
+                           struct rs_packet **packet_ret,
+                           rs_port_id_t *port_ret) {
+    struct rs_port_layer_packet *unpacked = rs_port_layer_packet_alloc();
+    if (rs_port_layer_packet_unpack(unpacked, packet)) {
+        /* packed that could not be unpacked */
+        syslog(LOG_ERR, "Could not unpack at port layer");
+        rs_packet_destroy(packet);
+        rs_packet_free(packet);
+        rs_port_layer_packet_free(unpacked);
+        return -1;
+    }
+    rs_packet_destroy(packet);
+    rs_packet_free(packet);
+
+    struct rs_port *port = layer->ports_by_id[unpacked->port];
+    if (!port) {
+        syslog(LOG_ERR, "Received packet on unknown port");
+        _drop_fragment(unpacked);
+        return 1;
+    }
+
+    /*
+     * Handle earlier updates which have been missed (channel switched)
+     */
+    if (port->bound_channel != channel && !port->owner) {
+        syslog(LOG_ERR, "Appears the port has switched channels: %d",
+               channel);
+        port->bound_channel = channel;
+    }
+
+    /* Ownership of unpacked is transferred in any case */
+    struct rs_port_layer_packet *result = NULL;
+    if (unpacked->group) {
+        result = _group_add(port, unpacked);
+        if (!result)
+            result = _reassembly_pop(port);
+    } else if (unpacked->n_frag_encoded == 1 && unpacked->n_segments == 1) {
+        result = unpacked;
+    } else {
+        _reassembly_add(port, unpacked);
+        result = _reassembly_pop(port);
+    }
+
+    if (result && !_deliver(layer, port, result, packet_ret, port_ret))
+        return 0;
+    return 1;
+}
+
+/* Receives on channel until a packet is delivered, the channel layer has no
+ * more packets or *budget channel layer packets are used up */
+static int _receive(struct rs_port_layer *layer, struct rs_packet **packet_ret,
+                    rs_port_id_t *port_ret, rs_channel_t channel,
+                    int *budget) {
+    struct rs_channel_layer *ch =
+        rs_server_channel_layer_for_channel(layer->server, channel);
+
+    if (!ch) {
+        syslog(LOG_ERR, "Could not find layer for channel %d", channel);
+        return -1;
+    }
+
+    struct rs_packet *packet = NULL;
+    rs_channel_t packet_channel;
+    int res;
+
+retry:
+    /* Rest of an aggregate first, before the channel layer receives again */
+    if ((packet = _aggregate_next(layer, &packet_channel))) {
+        if (!_receive_packet(layer, packet, packet_channel, packet_ret,
+                             port_ret))
+            return 0;
         goto retry;
-        break;
-    case RS_CHANNEL_LAYER_BADFCS:
-        /* Received a packet with bad fcs */
+    }
+
+    /* Then the rest of the last batch */
+    if (layer->rx_batch.at < layer->rx_batch.n) {
+        packet = layer->rx_batch.packets[layer->rx_batch.at];
+        packet_channel = layer->rx_batch.channels[layer->rx_batch.at];
+        layer->rx_batch.at++;
+
+        if (_aggregate_begin(layer, packet, packet_channel))
+            goto retry;
+
+        res = _receive_packet(layer, packet, packet_channel, packet_ret,
+                              port_ret);
+        if (res <= 0)
+            return res;
         goto retry;
-        break;
-    default:
+    }
+
+    if (*budget <= 0)
+        return RS_PORT_LAYER_EOF;
+
+    int n = *budget;
+    res = rs_channel_layer_receive_batch(ch, layer->rx_batch.packets,
+                                         layer->rx_batch.channels, &n,
+                                         channel);
+    layer->rx_batch.n = n;
+    layer->rx_batch.at = 0;
+    (*budget) -= n ? n : 1;
+
+    if (res < 0) {
         /* Exception */
-        free(unpacked);
         return -1;
     }
+    if (res == RS_CHANNEL_LAYER_EOF && !n) {
+        /* No more packets */
+        return RS_PORT_LAYER_EOF;
+    }
+    goto retry;
+}
+
+/* Distinct bound channels of the ports */
+static void _rx_channels_update(struct rs_port_layer *layer) {
+    layer->n_rx_channels = 0;
+    for (int i = 0; i < layer->n_ports; i++) {
+        rs_channel_t channel = layer->ports[i]->bound_channel;
+        int known = 0;
+        for (int j = 0; j < layer->n_rx_channels; j++) {
+            if (layer->rx_channels[j] == channel) {
+                known = 1;
+                break;
+            }
+        }
+        if (!known)
+            layer->rx_channels[layer->n_rx_channels++] = channel;
+    }
 }
 
 int rs_port_layer_receive(struct rs_port_layer *layer,
                           struct rs_packet **packet, rs_port_id_t *port) {
 
-    int haserr = 0;
     for (int i = 0; i < layer->n_ports; i++) {
-        /* Possibly multiple receives on same channel, should not be an issue
-         * though */
-        int res = _receive(layer, packet, port, layer->ports[i]->bound_channel);
+        /* Blocks held back for in-order delivery */
+        struct rs_port_layer_packet *ready;
+        while ((ready = _reassembly_pop(layer->ports[i]))) {
+            if (!_deliver(layer, layer->ports[i], ready, packet, port))
+                return 0;
+        }
+    }
+
+    /* Start of a pass over all channels */
+    if (layer->rx_channel_at < 0) {
+        _rx_channels_update(layer);
+        layer->rx_channel_at = 0;
+        layer->rx_budget = RS_PORT_RX_BATCH;
+        layer->rx_error = 0;
+        layer->rx_pending = 0;
+    }
+
+    while (layer->rx_channel_at < layer->n_rx_channels) {
+        int res = _receive(layer, packet, port,
+                           layer->rx_channels[layer->rx_channel_at],
+                           &layer->rx_budget);
         if (!res)
             return 0;
-        if (res < 0) {
-            haserr = 1;
-        }
+        if (res < 0)
+            layer->rx_error = 1;
+        else if (layer->rx_budget <= 0)
+            layer->rx_pending = 1;
+
+        layer->rx_channel_at++;
+        layer->rx_budget = RS_PORT_RX_BATCH;
     }
 
-    if (haserr)
+    layer->rx_channel_at = -1;
+    if (layer->rx_error)
         return -1;
     return RS_PORT_LAYER_EOF;
 }
@@ -485,7 +1819,7 @@ static void _send_command(struct rs_port_layer *layer, struct rs_port *port,
                               RS_PORT_CMD_DUMMY_SIZE);
     memcpy(packet.command_payload, command_payload,
            RS_PORT_LAYER_COMMAND_LENGTH);
-    packet.command = command;
+    rs_port_layer_packet_set_command(&packet, command);
 
     /* Possibly route the packet */
     struct rs_port *original_port = NULL;
@@ -500,16 +1834,159 @@ static void _send_command(struct rs_port_layer *layer, struct rs_port *port,
         port = port->route_cmd.route_via;
     }
 
-    _transmit(layer, &packet, port, original_port);
+    _transmit(layer, &packet, port, original_port, NULL);
 
     rs_packet_destroy(&packet.super);
 }
 
+/* Probability that more than m - k of m fragments are lost, if each one is
+ * lost independently with p */
+static double _fec_residual_loss(int k, int m, double p) {
+    if (p <= 0.)
+        return 0.;
+    if (p >= 1.)
+        return 1.;
+
+    double decodable = 0.;
+    for (int i = 0; i <= m - k; i++) {
+        decodable += exp(lgamma(m + 1) - lgamma(i + 1) - lgamma(m - i + 1) +
+                         i * log(p) + (m - i) * log(1. - p));
+    }
+    return decodable >= 1. ? 0. : 1. - decodable;
+}
+
+static void _fec_control(struct rs_port_layer *layer, struct rs_port *port) {
+    struct rs_channel_layer *ch =
+        rs_server_channel_layer_for_channel(layer->server, port->bound_channel);
+    if (!ch)
+        return;
+    struct rs_channel_info *info =
+        &ch->channels[rs_channel_layer_extract(ch, port->bound_channel)];
+
+    /* Nothing published by the peer in the last interval */
+    if (rs_stat_current(&port->stats.other_rx_stat_bits) <= 0.)
+        return;
+
+    /* Fragment loss on the channel and frame loss after FEC on the port */
+    double p = rs_stat_current(&info->stats.other_rx_stat_missed);
+    double residual = rs_stat_current(&port->stats.other_rx_stat_missed);
+    double target = port->fec_control.target_loss;
+
+    double burst = port->fec_control.burst;
+    if (residual > target)
+        burst *= 1.5;
+    else if (residual < 0.5 * target)
+        burst *= 0.9;
+    if (burst < 1.)
+        burst = 1.;
+    if (burst > RS_PORT_FEC_BURST_MAX)
+        burst = RS_PORT_FEC_BURST_MAX;
+    port->fec_control.burst = burst;
+
+    double p_eff = p * burst;
+    if (p_eff > 0.5)
+        p_eff = 0.5;
+
+    /* Evaluated on the block size currently in use */
+    int k = port->tx_fec_k ? port->tx_fec_k : 1;
+    double factor = port->fec_control.min_factor;
+    while (factor < port->fec_control.max_factor) {
+        int m = round(factor * k);
+        if (m > RS_PORT_LAYER_MAX_FRAGMENTS)
+            m = RS_PORT_LAYER_MAX_FRAGMENTS;
+        if (_fec_residual_loss(k, m, p_eff) <= target)
+            break;
+        factor += RS_PORT_FEC_CONTROL_STEP;
+    }
+    if (factor > port->fec_control.max_factor)
+        factor = port->fec_control.max_factor;
+
+    /* Back off slowly */
+    if (factor < port->tx_target_fec_factor - RS_PORT_FEC_CONTROL_STEP)
+        factor = port->tx_target_fec_factor - RS_PORT_FEC_CONTROL_STEP;
+
+    if (fabs(factor - port->tx_target_fec_factor) > 1e-6) {
+        syslog(LOG_DEBUG,
+               "port %d: FEC factor %.2f (loss %.4f, residual %.4f, burst "
+               "%.2f)",
+               port->id, factor, p, residual, burst);
+        port->tx_target_fec_factor = factor;
+    }
+}
+
+static void _rate_switch(struct rs_port_layer *layer, struct rs_port *port,
+                         rs_channel_t channel, struct timespec now) {
+    syslog(LOG_NOTICE, "port %d: rate adaptation switching to channel %d",
+           port->id, channel);
+    if (!rs_port_layer_switch_channel(layer, port->id, channel))
+        port->rate_control.switched_ts = now;
+}
+
+static void _rate_control(struct rs_port_layer *layer, struct rs_port *port,
+                          struct timespec now) {
+    if (!port->owner ||
+        port->cmd_switch_state.state != RS_PORT_CMD_SWITCH_NONE ||
+        msec_diff(now, port->rate_control.switched_ts) <
+            RS_PORT_RATE_SETTLE_MSEC)
+        return;
+
+    struct rs_channel_layer *ch =
+        rs_server_channel_layer_for_channel(layer->server, port->bound_channel);
+    if (!ch)
+        return;
+    struct rs_channel_info *info =
+        &ch->channels[rs_channel_layer_extract(ch, port->bound_channel)];
+
+    /* Nothing published by the peer counts as complete loss */
+    double goodput = rs_stat_current(&port->stats.other_rx_stat_bits);
+    double loss = goodput > 0.
+                      ? rs_stat_current(&info->stats.other_rx_stat_missed)
+                      : 1.;
+    double busy = rs_stat_current(&info->tx_stat_dt) * 1000. / RS_STAT_DT_MSEC;
+
+    if (port->rate_control.probing) {
+        port->rate_control.probing = 0;
+        if (loss > RS_PORT_RATE_LOSS_DOWN ||
+            goodput < 0.9 * port->rate_control.probe_goodput) {
+            port->rate_control.probe_msec *= 2;
+            if (port->rate_control.probe_msec > RS_PORT_RATE_PROBE_MAX_MSEC)
+                port->rate_control.probe_msec = RS_PORT_RATE_PROBE_MAX_MSEC;
+            _rate_switch(layer, port, port->rate_control.probe_from, now);
+            return;
+        }
+        port->rate_control.probe_msec = RS_PORT_RATE_PROBE_MSEC;
+    }
+
+    if (loss > RS_PORT_RATE_LOSS_DOWN) {
+        if (++port->rate_control.n_bad >= RS_PORT_RATE_DOWN_N) {
+            port->rate_control.n_bad = 0;
+            rs_channel_t down =
+                rs_channel_layer_rate_step(ch, port->bound_channel, -1);
+            if (down)
+                _rate_switch(layer, port, down, now);
+        }
+        return;
+    }
+    port->rate_control.n_bad = 0;
+
+    if (loss < RS_PORT_RATE_LOSS_UP && busy > RS_PORT_RATE_BUSY &&
+        msec_diff(now, port->rate_control.switched_ts) >=
+            port->rate_control.probe_msec) {
+        rs_channel_t up = rs_channel_layer_rate_step(ch, port->bound_channel, 1);
+        if (up) {
+            port->rate_control.probing = 1;
+            port->rate_control.probe_from = port->bound_channel;
+            port->rate_control.probe_goodput = goodput;
+            _rate_switch(layer, port, up, now);
+        }
+    }
+}
+
 void rs_port_layer_main(struct rs_port_layer *layer,
                         struct rs_port_layer_packet *received) {
 
     struct timespec now;
-    clock_gettime(CLOCK_REALTIME, &now);
+    rs_clock_now(&now);
     if (received) {
         /* Handle routed commands */
         assert(sizeof(rs_port_id_t) == 1);
@@ -521,18 +1998,12 @@ void rs_port_layer_main(struct rs_port_layer *layer,
             received->command_payload[RS_PORT_LAYER_COMMAND_LENGTH - 1] = 0;
         }
 
-        struct rs_port *port = NULL;
-        for (int i = 0; i < layer->n_ports; i++) {
-            if (layer->ports[i]->id == received->port) {
-                port = layer->ports[i];
-                break;
-            }
-        }
-
+        struct rs_port *port = layer->ports_by_id[received->port];
         if (!port)
             return;
 
-        rs_stats_register_published_stats(&port->stats, &received->stats);
+        if (received->has_stats)
+            rs_stats_register_published_stats(&port->stats, &received->stats);
 
         if (received->command == RS_PORT_CMD_HEARTBEAT) {
             /* heartbeat */
@@ -553,6 +2024,8 @@ void rs_port_layer_main(struct rs_port_layer *layer,
                              (RS_PORT_CMD_SWITCH_N_BROADCAST - n_broadcasts) *
                                  RS_PORT_CMD_SWITCH_DT_BROADCAST_MSEC);
             port->cmd_switch_state.new_channel = channel;
+            rs_timer_schedule(&layer->server->timers,
+                              &port->cmd_switch_state.timer, 0);
 
         } else if (received->command == RS_PORT_CMD_REQUEST_SWITCH_CHANNEL) {
             /* request switch channel */
@@ -581,92 +2054,184 @@ void rs_port_layer_main(struct rs_port_layer *layer,
             }
         }
 
-        /* Switch channel */
+        /* Abandon blocks which did not complete within the latency budget */
         for (int i = 0; i < layer->n_ports; i++) {
-            if (layer->ports[i]->cmd_switch_state.state ==
-                RS_PORT_CMD_SWITCH_NONE)
+            struct rs_port *port = layer->ports[i];
+            if (!port->latency_msec)
                 continue;
-
-            if ((layer->ports[i]->cmd_switch_state.state ==
-                     RS_PORT_CMD_SWITCH_OWNING ||
-                 layer->ports[i]->cmd_switch_state.state ==
-                     RS_PORT_CMD_SWITCH_REQUESTING) &&
-
-                layer->ports[i]->cmd_switch_state.n_broadcasts <
-                    RS_PORT_CMD_SWITCH_N_BROADCAST &&
-
-                msec_diff(now, layer->ports[i]->cmd_switch_state.begin) >
-                    layer->ports[i]->cmd_switch_state.n_broadcasts *
-                        RS_PORT_CMD_SWITCH_DT_BROADCAST_MSEC) {
-                /* broadcast switch or request */
-
-                assert(sizeof(rs_channel_t) == 2);
-                uint8_t cmd[RS_PORT_LAYER_COMMAND_LENGTH] = {
-                    /* new channel id */
-                    (uint8_t)(layer->ports[i]->cmd_switch_state.new_channel >>
-                              8),
-                    (uint8_t)layer->ports[i]->cmd_switch_state.new_channel,
-                    /* broadcast number */
-                    layer->ports[i]->cmd_switch_state.n_broadcasts, 0, 0, 0, 0,
-                    0};
-
-                layer->ports[i]->cmd_switch_state.n_broadcasts++;
-                _send_command(layer, layer->ports[i],
-                              layer->ports[i]->cmd_switch_state.state ==
-                                      RS_PORT_CMD_SWITCH_OWNING
-                                  ? RS_PORT_CMD_SWITCH_CHANNEL
-                                  : RS_PORT_CMD_REQUEST_SWITCH_CHANNEL,
-                              cmd);
-
-            } else if (msec_diff(now, layer->ports[i]->cmd_switch_state.at) >
-                       0) {
-                /* finish switch or request */
-
-                if (layer->ports[i]->cmd_switch_state.state ==
-                        RS_PORT_CMD_SWITCH_FOLLOWING ||
-                    layer->ports[i]->cmd_switch_state.state ==
-                        RS_PORT_CMD_SWITCH_OWNING) {
-
-                    layer->ports[i]->bound_channel =
-                        layer->ports[i]->cmd_switch_state.new_channel;
-                }
-
-                layer->ports[i]->cmd_switch_state.state =
-                    RS_PORT_CMD_SWITCH_NONE;
+            for (int j = 0; j < port->reassembly.n_blocks; j++) {
+                struct rs_port_reassembly_block *b =
+                    &port->reassembly.blocks[j];
+                if (b->state == RS_PORT_BLOCK_INCOMPLETE &&
+                    msec_diff(now, b->first_ts) > port->latency_msec)
+                    _reassembly_drop(port, b);
             }
         }
 
-        /* Heartbeats */
-        for (int i = 0; i < layer->n_ports; i++) {
+        /* Send aggregates which reached their latency */
+        for (int i = 0; i < layer->n_tx_aggregates; i++) {
+            if (layer->tx_aggregates[i].n &&
+                msec_diff(now, layer->tx_aggregates[i].deadline) >= 0)
+                _aggregate_flush(layer, &layer->tx_aggregates[i]);
+        }
 
-            long msec = msec_diff(now, layer->ports[i]->tx_last_ts);
+        /* Queued fragments the rate caps held back */
+        rs_port_layer_flush(layer);
+    }
+}
 
-            if (msec >= RS_PORT_CMD_HEARTBEAT_MSEC) {
-                uint8_t cmd[RS_PORT_LAYER_COMMAND_LENGTH] = {0, 0, 0, 0,
-                                                             0, 0, 0, 0};
-                _send_command(layer, layer->ports[i], RS_PORT_CMD_HEARTBEAT,
-                              cmd);
-            }
+/*
+ ************************************************************************
+ * Timers on server->timers
+ */
+static void _heartbeat_timer(struct rs_timer *timer, void *arg) {
+    struct rs_port_layer *layer = arg;
+    struct rs_port *port = rs_container_of(rs_port, heartbeat_timer, timer);
+
+    struct timespec now;
+    rs_clock_now(&now);
+    long msec = msec_diff(now, port->tx_last_ts);
+    if (msec >= RS_PORT_CMD_HEARTBEAT_MSEC) {
+        uint8_t cmd[RS_PORT_LAYER_COMMAND_LENGTH] = {0, 0, 0, 0, 0, 0, 0, 0};
+        _send_command(layer, port, RS_PORT_CMD_HEARTBEAT, cmd);
+        msec = 0;
+    }
+
+    /* Not moved on every transmit, rearmed for the remaining time instead */
+    rs_timer_schedule(&layer->server->timers, timer,
+                      RS_PORT_CMD_HEARTBEAT_MSEC - msec);
+}
+
+static void _switch_timer(struct rs_timer *timer, void *arg) {
+    struct rs_port_layer *layer = arg;
+    struct rs_port *port =
+        rs_container_of(rs_port, cmd_switch_state.timer, timer);
+
+    if (port->cmd_switch_state.state == RS_PORT_CMD_SWITCH_NONE)
+        return;
+
+    struct timespec now;
+    rs_clock_now(&now);
+
+    int broadcasting =
+        (port->cmd_switch_state.state == RS_PORT_CMD_SWITCH_OWNING ||
+         port->cmd_switch_state.state == RS_PORT_CMD_SWITCH_REQUESTING) &&
+        port->cmd_switch_state.n_broadcasts < RS_PORT_CMD_SWITCH_N_BROADCAST;
+
+    if (broadcasting && msec_diff(now, port->cmd_switch_state.begin) >=
+                            port->cmd_switch_state.n_broadcasts *
+                                RS_PORT_CMD_SWITCH_DT_BROADCAST_MSEC) {
+        /* broadcast switch or request */
+
+        assert(sizeof(rs_channel_t) == 2);
+        uint8_t cmd[RS_PORT_LAYER_COMMAND_LENGTH] = {
+            /* new channel id */
+            (uint8_t)(port->cmd_switch_state.new_channel >> 8),
+            (uint8_t)port->cmd_switch_state.new_channel,
+            /* broadcast number */
+            port->cmd_switch_state.n_broadcasts, 0, 0, 0, 0, 0};
+
+        port->cmd_switch_state.n_broadcasts++;
+        _send_command(layer, port,
+                      port->cmd_switch_state.state == RS_PORT_CMD_SWITCH_OWNING
+                          ? RS_PORT_CMD_SWITCH_CHANNEL
+                          : RS_PORT_CMD_REQUEST_SWITCH_CHANNEL,
+                      cmd);
+
+    } else if (!broadcasting &&
+               msec_diff(now, port->cmd_switch_state.at) >= 0) {
+        /* finish switch or request */
+
+        if (port->cmd_switch_state.state == RS_PORT_CMD_SWITCH_FOLLOWING ||
+            port->cmd_switch_state.state == RS_PORT_CMD_SWITCH_OWNING) {
+
+            port->bound_channel = port->cmd_switch_state.new_channel;
         }
+
+        port->cmd_switch_state.state = RS_PORT_CMD_SWITCH_NONE;
+        return;
     }
+
+    /* Next broadcast, or the end of the switch */
+    broadcasting =
+        (port->cmd_switch_state.state == RS_PORT_CMD_SWITCH_OWNING ||
+         port->cmd_switch_state.state == RS_PORT_CMD_SWITCH_REQUESTING) &&
+        port->cmd_switch_state.n_broadcasts < RS_PORT_CMD_SWITCH_N_BROADCAST;
+    long next = broadcasting
+                    ? port->cmd_switch_state.n_broadcasts *
+                              RS_PORT_CMD_SWITCH_DT_BROADCAST_MSEC -
+                          msec_diff(now, port->cmd_switch_state.begin)
+                    : msec_diff(port->cmd_switch_state.at, now);
+    rs_timer_schedule(&layer->server->timers, timer, next);
 }
 
-int rs_port_layer_switch_channel(struct rs_port_layer *layer, rs_port_id_t port,
-                                 rs_channel_t new_channel) {
-    struct rs_port *p = NULL;
+static void _fec_control_timer(struct rs_timer *timer, void *arg) {
+    struct rs_port_layer *layer = arg;
+    struct rs_port *port =
+        rs_container_of(rs_port, fec_control.timer, timer);
+
+    _fec_control(layer, port);
+    rs_timer_schedule(&layer->server->timers, timer, RS_PORT_FEC_CONTROL_MSEC);
+}
+
+static void _rate_control_timer(struct rs_timer *timer, void *arg) {
+    struct rs_port_layer *layer = arg;
+    struct rs_port *port =
+        rs_container_of(rs_port, rate_control.timer, timer);
+
+    struct timespec now;
+    rs_clock_now(&now);
+    _rate_control(layer, port, now);
+    rs_timer_schedule(&layer->server->timers, timer,
+                      RS_PORT_RATE_CONTROL_MSEC);
+}
+
+static void _group_timer(struct rs_timer *timer, void *arg) {
+    struct rs_port_layer *layer = arg;
+    struct rs_port *port = rs_container_of(rs_port, group.timer, timer);
+
+    _group_close(layer, port);
+}
+
+static void _timeout_min(int *timeout, long msec) {
+    if (msec < 0)
+        msec = 0;
+    if (*timeout < 0 || msec < *timeout)
+        *timeout = msec;
+}
+
+int rs_port_layer_timeout(struct rs_port_layer *layer) {
+    if (layer->rx_pending || layer->rx_batch.at < layer->rx_batch.n ||
+        layer->rx_aggregate.buf)
+        return 0;
+
+    struct timespec now;
+    rs_clock_now(&now);
+
+    int timeout = -1;
+    for (int i = 0; i < layer->n_tx_aggregates; i++) {
+        if (layer->tx_aggregates[i].n)
+            _timeout_min(&timeout,
+                         msec_diff(layer->tx_aggregates[i].deadline, now));
+    }
     for (int i = 0; i < layer->n_ports; i++) {
-        if (layer->ports[i]->id == port) {
-            p = layer->ports[i];
-            break;
-        }
+        /* Tokens are refilled continuously */
+        if (layer->ports[i]->sched.queue_n)
+            _timeout_min(&timeout, 1);
     }
+    return timeout;
+}
+
+int rs_port_layer_switch_channel(struct rs_port_layer *layer, rs_port_id_t port,
+                                 rs_channel_t new_channel) {
+    struct rs_port *p = layer->ports_by_id[port];
     if (!p) {
         syslog(LOG_ERR, "Unknown port");
         return -1;
     }
 
     p->cmd_switch_state.n_broadcasts = 0;
-    clock_gettime(CLOCK_REALTIME, &p->cmd_switch_state.begin);
+    rs_clock_now(&p->cmd_switch_state.begin);
     p->cmd_switch_state.new_channel = new_channel;
     p->cmd_switch_state.at = p->cmd_switch_state.begin;
     timespec_plus_ms(&p->cmd_switch_state.at,
@@ -678,19 +2243,14 @@ int rs_port_layer_switch_channel(struct rs_port_layer *layer, rs_port_id_t port,
     } else {
         p->cmd_switch_state.state = RS_PORT_CMD_SWITCH_REQUESTING;
     }
+    rs_timer_schedule(&layer->server->timers, &p->cmd_switch_state.timer, 0);
 
     return 0;
 }
 
 int rs_port_layer_update_port(struct rs_port_layer *layer, rs_port_id_t port,
                               double fec_factor) {
-    struct rs_port *p = NULL;
-    for (int i = 0; i < layer->n_ports; i++) {
-        if (layer->ports[i]->id == port) {
-            p = layer->ports[i];
-            break;
-        }
-    }
+    struct rs_port *p = layer->ports_by_id[port];
     if (!p) {
         syslog(LOG_ERR, "Unknown port");
         return -1;
@@ -699,6 +2259,12 @@ int rs_port_layer_update_port(struct rs_port_layer *layer, rs_port_id_t port,
     if (!p->owner)
         return -1;
 
+    /* A fixed factor takes over from the controller */
+    if (p->fec_control.enabled) {
+        syslog(LOG_NOTICE, "port %d: adaptive FEC disabled by command", p->id);
+        p->fec_control.enabled = 0;
+        rs_timer_cancel(&layer->server->timers, &p->fec_control.timer);
+    }
     p->tx_target_fec_factor = fec_factor;
 
     return 0;
@@ -708,5 +2274,6 @@ void rs_port_layer_stats_printf(struct rs_port_layer *layer) {
     for (int i = 0; i < layer->n_ports; i++) {
         printf("-------- %04X --------\n", layer->ports[i]->id);
         rs_stats_printf(&layer->ports[i]->stats);
+        rs_stat_printf(&layer->ports[i]->rx_stats_invalid);
     }
 }
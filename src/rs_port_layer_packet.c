@@ -7,48 +7,157 @@
 #include <syslog.h>
 #include <unistd.h>
 
+#include "rs_fec.h"
 #include "rs_packet.h"
 #include "rs_port_layer_packet.h"
 #include "rs_util.h"
 
 static struct rs_packet_vtable vtable;
 
-int rs_port_layer_packet_len_header(struct rs_packet *super) {
-    struct rs_port_layer_packet *packet = rs_cast(rs_port_layer_packet, super);
-    return sizeof(rs_port_id_t) + sizeof(uint8_t) + sizeof(uint32_t) +
-           sizeof(rs_port_layer_seq_t) + 3 * sizeof(rs_port_layer_frag_t) +
-           rs_stats_packed_len(&packet->stats) +
-           (packet->command != 0
-                ? RS_PORT_LAYER_COMMAND_LENGTH * sizeof(uint8_t)
-                : 0);
+/* Fields which are needed once per packet, primary fragments of a group
+ * (n_frag_encoded == 0) are frames on their own */
+static int _carries_once(struct rs_port_layer_packet *packet) {
+    return packet->n_frag_encoded <= 1 ||
+           packet->frag <= packet->n_frag_encoded - packet->n_frag_decoded;
+}
+
+static uint8_t _compact_flags(struct rs_port_layer_packet *packet) {
+    uint8_t flags = 0;
+    if (packet->command != 0)
+        flags |= RS_PORT_LAYER_COMPACT_COMMAND;
+    if (packet->n_frag_encoded != 1) {
+        flags |= RS_PORT_LAYER_COMPACT_FRAG;
+        if (_carries_once(packet))
+            flags |= RS_PORT_LAYER_COMPACT_PAYLOAD_LEN;
+    }
+    if (packet->has_stats && _carries_once(packet))
+        flags |= RS_PORT_LAYER_COMPACT_STATS;
+    if (packet->n_segments != 1)
+        flags |= RS_PORT_LAYER_COMPACT_SEGMENT;
+    if (packet->xor_parity)
+        flags |= RS_PORT_LAYER_COMPACT_XOR;
+    if (packet->group)
+        flags |= RS_PORT_LAYER_COMPACT_GROUP;
+    return flags;
+}
+
+/* Flags in the most significant byte of payload_len of the full header */
+static uint8_t _full_flags(struct rs_port_layer_packet *packet) {
+    uint8_t flags = 0;
+    if (packet->n_segments > 1)
+        flags |= RS_PORT_LAYER_COMPACT_SEGMENT;
+    if (packet->xor_parity)
+        flags |= RS_PORT_LAYER_COMPACT_XOR;
+    if (packet->group)
+        flags |= RS_PORT_LAYER_COMPACT_GROUP;
+    return flags;
+}
+
+static void _update_len_header(struct rs_port_layer_packet *packet) {
+    int len;
+    if (packet->compact) {
+        uint8_t flags = _compact_flags(packet);
+        len = RS_PORT_LAYER_PACKET_COMPACT_LEN;
+        if (flags & RS_PORT_LAYER_COMPACT_COMMAND)
+            len += 1 + RS_PORT_LAYER_COMMAND_LENGTH;
+        if (flags & RS_PORT_LAYER_COMPACT_FRAG)
+            len += 3;
+        if (flags & RS_PORT_LAYER_COMPACT_PAYLOAD_LEN)
+            len += rs_varint_len(packet->payload_len);
+        if (flags & RS_PORT_LAYER_COMPACT_STATS)
+            len += RS_STATS_PACKED_LEN;
+        if (flags & RS_PORT_LAYER_COMPACT_SEGMENT)
+            len += 2;
+    } else {
+        len = RS_PORT_LAYER_PACKET_HEADER_LEN +
+              (packet->command != 0 ? RS_PORT_LAYER_COMMAND_LENGTH : 0);
+        if (_full_flags(packet) & RS_PORT_LAYER_COMPACT_SEGMENT)
+            len += 2;
+    }
+    packet->super.len_header = len;
+}
+
+static void _pack_header_compact(struct rs_port_layer_packet *packet,
+                                 uint8_t *b) {
+    uint8_t flags = _compact_flags(packet);
+    b[0] = RS_PORT_LAYER_PACKET_COMPACT_MARKER;
+    b[1] = flags;
+    b[2] = packet->port;
+    rs_store_be16(b + 3, packet->seq);
+    b += RS_PORT_LAYER_PACKET_COMPACT_LEN;
+
+    if (flags & RS_PORT_LAYER_COMPACT_COMMAND) {
+        *(b++) = packet->command;
+        memcpy(b, packet->command_payload, RS_PORT_LAYER_COMMAND_LENGTH);
+        b += RS_PORT_LAYER_COMMAND_LENGTH;
+    }
+    if (flags & RS_PORT_LAYER_COMPACT_FRAG) {
+        *(b++) = packet->frag;
+        *(b++) = packet->n_frag_decoded;
+        *(b++) = packet->n_frag_encoded;
+    }
+    if (flags & RS_PORT_LAYER_COMPACT_PAYLOAD_LEN)
+        b += rs_store_varint(b, packet->payload_len);
+    if (flags & RS_PORT_LAYER_COMPACT_STATS) {
+        rs_stats_packed_store(&packet->stats, b);
+        b += RS_STATS_PACKED_LEN;
+    }
+    if (flags & RS_PORT_LAYER_COMPACT_SEGMENT) {
+        *(b++) = packet->segment;
+        *(b++) = packet->n_segments;
+    }
 }
 
 void rs_port_layer_packet_pack_header(struct rs_packet *super, uint8_t **buffer,
                                       int *buffer_len) {
     struct rs_port_layer_packet *packet = rs_cast(rs_port_layer_packet, super);
 
-    PACK(buffer, buffer_len, uint8_t, packet->command);
-    PACK(buffer, buffer_len, rs_port_id_t, packet->port);
-    PACK(buffer, buffer_len, rs_port_layer_seq_t, packet->seq);
-    PACK(buffer, buffer_len, uint32_t, packet->payload_len);
-    PACK(buffer, buffer_len, rs_port_layer_frag_t, packet->frag);
-    PACK(buffer, buffer_len, rs_port_layer_frag_t, packet->n_frag_decoded);
-    PACK(buffer, buffer_len, rs_port_layer_frag_t, packet->n_frag_encoded);
-
-    if (rs_stats_packed_pack(&packet->stats, buffer, buffer_len))
-        goto pack_err;
-
-    if (packet->command != 0) {
-        for (int i = 0; i < RS_PORT_LAYER_COMMAND_LENGTH; i++) {
-            PACK(buffer, buffer_len, uint8_t, packet->command_payload[i]);
+    if (*buffer_len < super->len_header)
+        return;
+
+    uint8_t *b = *buffer;
+    if (packet->compact) {
+        _pack_header_compact(packet, b);
+    } else {
+        uint8_t flags = _full_flags(packet);
+        b[0] = packet->command;
+        b[1] = packet->port;
+        rs_store_be16(b + 2, packet->seq);
+        rs_store_be32(b + 4, packet->payload_len);
+        b[4] = flags;
+        b[8] = packet->frag;
+        b[9] = packet->n_frag_decoded;
+        b[10] = packet->n_frag_encoded;
+        rs_stats_packed_store(&packet->stats, b + 11);
+        b += RS_PORT_LAYER_PACKET_HEADER_LEN;
+
+        if (flags & RS_PORT_LAYER_COMPACT_SEGMENT) {
+            *(b++) = packet->segment;
+            *(b++) = packet->n_segments;
         }
+        if (packet->command != 0)
+            memcpy(b, packet->command_payload, RS_PORT_LAYER_COMMAND_LENGTH);
     }
 
-pack_err:;
+    (*buffer) += super->len_header;
+    (*buffer_len) -= super->len_header;
+}
+
+void rs_port_layer_packet_set_command(struct rs_port_layer_packet *packet,
+                                      uint8_t command) {
+    packet->command = command;
+    _update_len_header(packet);
+}
+
+void rs_port_layer_packet_set_format(struct rs_port_layer_packet *packet,
+                                     int compact, int has_stats) {
+    packet->compact = compact;
+    packet->has_stats = compact ? has_stats : 1;
+    _update_len_header(packet);
 }
 
 void rs_port_layer_packet_init(struct rs_port_layer_packet *packet,
-                               void *payload_ownership,
+                               struct rs_buffer *payload_ownership,
                                struct rs_packet *payload_packet,
                                uint8_t *payload_data, int payload_data_len) {
     rs_packet_init(&packet->super, payload_ownership, payload_packet,
@@ -60,7 +169,12 @@ void rs_port_layer_packet_init(struct rs_port_layer_packet *packet,
     packet->frag = 0;
     packet->n_frag_decoded = 1;
     packet->n_frag_encoded = 1;
+    packet->xor_parity = 0;
+    packet->segment = 0;
+    packet->n_segments = 1;
+    packet->group = 0;
     memset(packet->command_payload, 0, sizeof(packet->command_payload));
+    rs_port_layer_packet_set_format(packet, 0, 1);
 
     packet->payload_len =
         rs_packet_len(&packet->super) - rs_packet_len_header(&packet->super);
@@ -74,33 +188,110 @@ int rs_port_layer_packet_unpack(struct rs_port_layer_packet *packet,
                               from_packet->payload_data,
                               from_packet->payload_data_len);
 
-    UNPACK(&packet->super.payload_data, &packet->super.payload_data_len,
-           uint8_t, &packet->command);
-    UNPACK(&packet->super.payload_data, &packet->super.payload_data_len,
-           rs_port_id_t, &packet->port);
-    UNPACK(&packet->super.payload_data, &packet->super.payload_data_len,
-           rs_port_layer_seq_t, &packet->seq);
-    UNPACK(&packet->super.payload_data, &packet->super.payload_data_len,
-           uint32_t, &packet->payload_len);
-    UNPACK(&packet->super.payload_data, &packet->super.payload_data_len,
-           rs_port_layer_frag_t, &packet->frag);
-    UNPACK(&packet->super.payload_data, &packet->super.payload_data_len,
-           rs_port_layer_frag_t, &packet->n_frag_decoded);
-    UNPACK(&packet->super.payload_data, &packet->super.payload_data_len,
-           rs_port_layer_frag_t, &packet->n_frag_encoded);
-
-    if (rs_stats_packed_unpack(&packet->stats, &packet->super.payload_data,
-                               &packet->super.payload_data_len))
+    uint8_t *b = packet->super.payload_data;
+    int len = packet->super.payload_data_len;
+    if (len < 1)
         goto unpack_err;
 
-    /* Possibly set command_payload */
-    if (packet->command != 0) {
-        for (int i = 0; i < RS_PORT_LAYER_COMMAND_LENGTH; i++) {
-            UNPACK(&packet->super.payload_data, &packet->super.payload_data_len,
-                   uint8_t, &packet->command_payload[i]);
+    if (b[0] == RS_PORT_LAYER_PACKET_COMPACT_MARKER) {
+        if (len < RS_PORT_LAYER_PACKET_COMPACT_LEN)
+            goto unpack_err;
+
+        uint8_t flags = b[1];
+        packet->payload_len = 0;
+        packet->port = b[2];
+        packet->seq = rs_load_be16(b + 3);
+        b += RS_PORT_LAYER_PACKET_COMPACT_LEN;
+        len -= RS_PORT_LAYER_PACKET_COMPACT_LEN;
+
+        if (flags & RS_PORT_LAYER_COMPACT_COMMAND) {
+            if (len < 1 + RS_PORT_LAYER_COMMAND_LENGTH)
+                goto unpack_err;
+            packet->command = *(b++);
+            memcpy(packet->command_payload, b, RS_PORT_LAYER_COMMAND_LENGTH);
+            b += RS_PORT_LAYER_COMMAND_LENGTH;
+            len -= 1 + RS_PORT_LAYER_COMMAND_LENGTH;
+        }
+        if (flags & RS_PORT_LAYER_COMPACT_FRAG) {
+            if (len < 3)
+                goto unpack_err;
+            packet->frag = b[0];
+            packet->n_frag_decoded = b[1];
+            packet->n_frag_encoded = b[2];
+            b += 3;
+            len -= 3;
+        }
+        if (flags & RS_PORT_LAYER_COMPACT_PAYLOAD_LEN) {
+            int l = rs_load_varint(b, len, &packet->payload_len);
+            if (l < 0)
+                goto unpack_err;
+            b += l;
+            len -= l;
+        }
+        if (flags & RS_PORT_LAYER_COMPACT_STATS) {
+            if (len < RS_STATS_PACKED_LEN)
+                goto unpack_err;
+            rs_stats_packed_load(&packet->stats, b);
+            b += RS_STATS_PACKED_LEN;
+            len -= RS_STATS_PACKED_LEN;
+        }
+        if (flags & RS_PORT_LAYER_COMPACT_SEGMENT) {
+            if (len < 2)
+                goto unpack_err;
+            packet->segment = b[0];
+            packet->n_segments = b[1];
+            b += 2;
+            len -= 2;
+        }
+
+        packet->compact = 1;
+        packet->has_stats = !!(flags & RS_PORT_LAYER_COMPACT_STATS);
+        packet->xor_parity = !!(flags & RS_PORT_LAYER_COMPACT_XOR);
+        packet->group = !!(flags & RS_PORT_LAYER_COMPACT_GROUP);
+        packet->super.len_header = b - packet->super.payload_data;
+
+        /* Derived */
+        if (packet->n_frag_encoded == 1)
+            packet->payload_len = len;
+    } else {
+        if (len < RS_PORT_LAYER_PACKET_HEADER_LEN)
+            goto unpack_err;
+
+        uint8_t flags = b[4];
+        packet->port = b[1];
+        packet->seq = rs_load_be16(b + 2);
+        packet->payload_len = rs_load_be32(b + 4) & 0xFFFFFF;
+        packet->frag = b[8];
+        packet->n_frag_decoded = b[9];
+        packet->n_frag_encoded = b[10];
+        rs_stats_packed_load(&packet->stats, b + 11);
+        b += RS_PORT_LAYER_PACKET_HEADER_LEN;
+        len -= RS_PORT_LAYER_PACKET_HEADER_LEN;
+
+        if (flags & RS_PORT_LAYER_COMPACT_SEGMENT) {
+            if (len < 2)
+                goto unpack_err;
+            packet->segment = b[0];
+            packet->n_segments = b[1];
+            b += 2;
+            len -= 2;
+        }
+        packet->xor_parity = !!(flags & RS_PORT_LAYER_COMPACT_XOR);
+        packet->group = !!(flags & RS_PORT_LAYER_COMPACT_GROUP);
+
+        /* Possibly set command_payload, sets the header length */
+        rs_port_layer_packet_set_command(packet,
+                                         packet->super.payload_data[0]);
+        if (packet->command != 0) {
+            if (len < RS_PORT_LAYER_COMMAND_LENGTH)
+                goto unpack_err;
+            memcpy(packet->command_payload, b, RS_PORT_LAYER_COMMAND_LENGTH);
         }
     }
 
+    packet->super.payload_data += packet->super.len_header;
+    packet->super.payload_data_len -= packet->super.len_header;
+
     /* Successfully unpacked --> steal data and destroy from_packet */
     from_packet->payload_ownership = NULL;
     rs_packet_destroy(from_packet);
@@ -113,14 +304,14 @@ unpack_err:
 
 int rs_port_layer_packet_split(struct rs_port_layer_packet *packet,
                                struct rs_port *port,
-                               struct rs_port_layer_packet ***split,
-                               int max_size_per_packet, double fec_factor) {
+                               struct rs_port_layer_packet **split,
+                               int max_size_per_packet, double fec_factor,
+                               int xor_parity) {
     int len_header = rs_packet_len_header(&packet->super);
     int len = rs_packet_len(&packet->super) - len_header;
 
     if (len <= max_size_per_packet && (fec_factor <= 1.001)) {
-        *split = calloc(1, sizeof(void *));
-        **split = packet;
+        split[0] = packet;
         return 1;
     }
 
@@ -135,13 +326,20 @@ int rs_port_layer_packet_split(struct rs_port_layer_packet *packet,
         if(!new_k) new_k = 1;
         int new_m = round(fec_factor * new_k);
 
-        if (new_m > 255) {
-            new_k = 255;
-            new_m = 255;
+        if (new_k > RS_PORT_LAYER_MAX_FRAGMENTS) {
             syslog(LOG_ERR,
-                   "port %d: max_packet_size to small or app layer frame_size "
-                   "too big\n",
-                   port->id);
+                   "port %d: dropping frame of %d bytes, needs more than %d "
+                   "fragments and the other side does not reassemble "
+                   "segments",
+                   port->id, len, RS_PORT_LAYER_MAX_FRAGMENTS);
+            return 0;
+        }
+        if (new_m > RS_PORT_LAYER_MAX_FRAGMENTS) {
+            syslog(LOG_WARNING,
+                   "port %d: FEC limited to k=%d / m=%d for a frame of %d "
+                   "bytes, the other side does not reassemble segments",
+                   port->id, new_k, RS_PORT_LAYER_MAX_FRAGMENTS, len);
+            new_m = RS_PORT_LAYER_MAX_FRAGMENTS;
         }
 
         if (new_k != port->tx_fec_k || new_m != port->tx_fec_m) {
@@ -153,69 +351,212 @@ int rs_port_layer_packet_split(struct rs_port_layer_packet *packet,
 
     int packet_len = ceil((double)len / (double)port->tx_fec_k);
 
-    /* Pack into buf with primary block 0 starting at buf + len_header also
-     * allocating memory for secondary blocks starting at buf + len_header +
-     * k*packet_len */
-    int buf_len = len_header + packet_len * port->tx_fec_m;
-    uint8_t *buf = calloc(buf_len, sizeof(uint8_t));
+    /* Flat payload, only a chain of packets needs to be packed first */
+    uint8_t *payload = packet->super.payload_data;
+    struct rs_buffer *payload_buf = NULL;
+    struct rs_packet *payload_packet = packet->super.payload_packet;
+    if (payload_packet) {
+        if (!payload_packet->payload_packet &&
+            !rs_packet_len_header(payload_packet)) {
+            payload = payload_packet->payload_data;
+        } else {
+            payload_buf = rs_buffer_new(len);
+            if (!payload_buf)
+                return 0;
+
+            uint8_t *b = payload_buf->data;
+            int bl = len;
+            rs_packet_pack(payload_packet, &b, &bl);
+            payload = payload_buf->data;
+        }
+    }
 
-    uint8_t *b = buf;
-    int bl = buf_len;
-    rs_packet_pack(&packet->super, &b, &bl);
+    /* Every block is preceded by RS_PACKET_HEADROOM, so that the headers of
+     * the fragment can be prepended in place on transmit */
+    int stride = RS_PACKET_HEADROOM + packet_len;
+    struct rs_buffer *buf = rs_buffer_new(stride * port->tx_fec_m);
+    if (!buf) {
+        rs_buffer_unref(payload_buf);
+        return 0;
+    }
+
+    /* Primary blocks, last ones padded */
+    for (int i = 0; i < port->tx_fec_k; i++) {
+        uint8_t *block = buf->data + RS_PACKET_HEADROOM + stride * i;
+        int n = len - packet_len * i;
+        if (n > packet_len)
+            n = packet_len;
+        if (n < 0)
+            n = 0;
+
+        memcpy(block, payload + packet_len * i, n);
+        memset(block + n, 0, packet_len - n);
+    }
+    rs_buffer_unref(payload_buf);
 
     /* Encode secondary blocks */
-    uint8_t **primary_blocks = calloc(port->tx_fec_k, sizeof(void *));
-    uint8_t **secondary_blocks =
-        calloc(port->tx_fec_m - port->tx_fec_k, sizeof(void *));
-    unsigned int *block_nums =
-        calloc(port->tx_fec_m - port->tx_fec_k, sizeof(unsigned int));
+    uint8_t *primary_blocks[RS_PORT_LAYER_MAX_FRAGMENTS];
+    uint8_t *secondary_blocks[RS_PORT_LAYER_MAX_FRAGMENTS];
+    unsigned int block_nums[RS_PORT_LAYER_MAX_FRAGMENTS];
 
     for (int i = 0; i < port->tx_fec_k; i++) {
-        primary_blocks[i] = buf + len_header + packet_len * i;
+        primary_blocks[i] = buf->data + RS_PACKET_HEADROOM + stride * i;
     }
     for (int i = port->tx_fec_k, j = 0; i < port->tx_fec_m; i++, j++) {
-        secondary_blocks[j] = buf + len_header + packet_len * i;
+        secondary_blocks[j] = buf->data + RS_PACKET_HEADROOM + stride * i;
         block_nums[j] = i;
     }
-    fec_encode(port->tx_fec, (const uint8_t **)primary_blocks, secondary_blocks,
-               block_nums, port->tx_fec_m - port->tx_fec_k, packet_len);
-    free(primary_blocks);
-    free(secondary_blocks);
-    free(block_nums);
-
-    /* Allocate packet array */
-    *split = calloc(port->tx_fec_m, sizeof(void *));
-
-    /* Fill packet array */
+    xor_parity = xor_parity && port->tx_fec_m == port->tx_fec_k + 1;
+    if (xor_parity)
+        rs_fec_xor((const uint8_t **)primary_blocks, port->tx_fec_k,
+                   secondary_blocks[0], packet_len);
+    else
+        rs_fec_encode(port->tx_fec, (const uint8_t **)primary_blocks,
+                      secondary_blocks, block_nums,
+                      port->tx_fec_m - port->tx_fec_k, packet_len);
+
+    /* Fill packet array, every fragment references buf */
     for (int j = 0; j < port->tx_fec_m; j++) {
-        (*split)[j] = calloc(1, sizeof(struct rs_port_layer_packet));
-        rs_port_layer_packet_init((*split)[j], j == 0 ? buf : NULL, NULL,
-                                  buf + len_header + (packet_len * j),
+        split[j] = rs_port_layer_packet_alloc();
+        rs_port_layer_packet_init(split[j], rs_buffer_ref(buf), NULL,
+                                  buf->data + RS_PACKET_HEADROOM + stride * j,
                                   packet_len);
-
-        (*split)[j]->command = packet->command;
-        (*split)[j]->port = packet->port;
-        (*split)[j]->payload_len = len;
-        (*split)[j]->seq = packet->seq;
-        (*split)[j]->frag = j;
-        (*split)[j]->n_frag_decoded = port->tx_fec_k;
-        (*split)[j]->n_frag_encoded = port->tx_fec_m;
-        (*split)[j]->stats = packet->stats;
-        memcpy((*split)[j]->command_payload, packet->command_payload,
+        split[j]->super.payload_data_headroom = RS_PACKET_HEADROOM;
+
+        rs_port_layer_packet_set_command(split[j], packet->command);
+        split[j]->port = packet->port;
+        split[j]->payload_len = len;
+        split[j]->seq = packet->seq;
+        split[j]->frag = j;
+        split[j]->n_frag_decoded = port->tx_fec_k;
+        split[j]->n_frag_encoded = port->tx_fec_m;
+        split[j]->xor_parity = xor_parity;
+        split[j]->segment = packet->segment;
+        split[j]->n_segments = packet->n_segments;
+        split[j]->stats = packet->stats;
+        memcpy(split[j]->command_payload, packet->command_payload,
                RS_PORT_LAYER_COMMAND_LENGTH);
+        rs_port_layer_packet_set_format(split[j], packet->compact,
+                                        packet->has_stats);
     }
+    rs_buffer_unref(buf);
 
     return port->tx_fec_m;
 }
 
+/*
+ * Decode the missing primary blocks of k = port->rx_fec_k into *recovered
+ * (NULL if none is missing), output[i] is the i-th missing block. Primary
+ * blocks shorter than packet_len are zero padded. Returns the number of
+ * missing blocks or -1
+ */
+static int _decode_missing(struct rs_port *port,
+                           struct rs_port_layer_packet **split, int n_split,
+                           int packet_len,
+                           struct rs_port_layer_packet **primary,
+                           struct rs_buffer **recovered, uint8_t **output) {
+    int k = port->rx_fec_k;
+    for (int i = 0; i < k; i++)
+        primary[i] = NULL;
+    for (int i = 0; i < n_split; i++) {
+        if (split[i]->frag < k)
+            primary[split[i]->frag] = split[i];
+    }
+
+    const uint8_t *input[RS_PORT_LAYER_MAX_FRAGMENTS];
+    unsigned int block_nums[RS_PORT_LAYER_MAX_FRAGMENTS];
+    int n_missing = 0;
+    int n_short = 0;
+    int xor_parity = 1;
+    for (int i = 0, j = 0; i < k; i++) {
+        if (primary[i]) {
+            input[i] = primary[i]->super.payload_data;
+            block_nums[i] = i;
+            if (primary[i]->super.payload_data_len < packet_len)
+                n_short++;
+            continue;
+        }
+
+        while (j < n_split && split[j]->frag < k)
+            j++;
+        if (j == n_split) {
+            syslog(LOG_ERR, "Not enough fragments to join on port %d",
+                   split[0]->port);
+            return -1;
+        }
+        input[i] = split[j]->super.payload_data;
+        block_nums[i] = split[j]->frag;
+        xor_parity = xor_parity && split[j]->xor_parity;
+        j++;
+        n_missing++;
+    }
+
+    *recovered = NULL;
+    if (!n_missing)
+        return 0;
+
+    *recovered = rs_buffer_new((n_missing + n_short) * packet_len);
+    if (!*recovered)
+        return -1;
+    for (int i = 0; i < n_missing; i++)
+        output[i] = (*recovered)->data + i * packet_len;
+
+    /* Padded copies behind the output blocks */
+    uint8_t *pad = (*recovered)->data + n_missing * packet_len;
+    for (int i = 0; i < k; i++) {
+        int len = primary[i] ? primary[i]->super.payload_data_len : packet_len;
+        if (len < packet_len) {
+            memcpy(pad, input[i], len);
+            memset(pad + len, 0, packet_len - len);
+            input[i] = pad;
+            pad += packet_len;
+        }
+    }
+
+    /* Marked by the sender per block, a single parity block (m = k + 1) so at
+     * most one block is missing */
+    if (xor_parity && n_missing == 1)
+        rs_fec_xor(input, k, output[0], packet_len);
+    else
+        rs_fec_decode(port->rx_fec, input, output, block_nums, packet_len);
+    return n_missing;
+}
+
+static void _init_joined(struct rs_port_layer_packet *joined,
+                         struct rs_port_layer_packet **split, int n_split,
+                         struct rs_buffer *iov, uint32_t payload_len) {
+    struct rs_port_layer_packet *with_stats = NULL;
+    for (int i = 0; i < n_split && !with_stats; i++) {
+        if (split[i]->has_stats)
+            with_stats = split[i];
+    }
+
+    rs_port_layer_packet_init(joined, NULL, NULL, NULL, 0);
+    joined->super.payload_iov = iov;
+    joined->super.payload_data_len = payload_len;
+    joined->payload_len = payload_len;
+    rs_port_layer_packet_set_command(joined, split[0]->command);
+    joined->port = split[0]->port;
+    joined->seq = split[0]->seq;
+    joined->frag = 0;
+    joined->n_frag_decoded = 1;
+    joined->n_frag_encoded = 1;
+    joined->has_stats = with_stats != NULL;
+    if (with_stats)
+        joined->stats = with_stats->stats;
+    memcpy(joined->command_payload, split[0]->command_payload,
+           RS_PORT_LAYER_COMMAND_LENGTH);
+}
+
 int rs_port_layer_packet_join(struct rs_port_layer_packet *joined,
                               struct rs_port *port,
                               struct rs_port_layer_packet **split,
                               int n_split) {
 
-    /* No packed packets here */
+    /* No packed packets here, fragments are owned (see _reassembly_add) */
     for (int i = 0; i < n_split; i++) {
         assert(split[i]->super.payload_data);
+        assert(split[i]->super.payload_ownership);
     }
 
     /* Infer / read FEC parameters */
@@ -224,78 +565,127 @@ int rs_port_layer_packet_join(struct rs_port_layer_packet *joined,
                          split[0]->n_frag_encoded);
     assert(n_split >= port->rx_fec_k);
 
-    /* Allocate packet index array */
-    unsigned int *block_nums = calloc(port->rx_fec_k, sizeof(unsigned int));
-    for (int i = 0; i < port->rx_fec_k; i++)
-        block_nums[i] = port->rx_fec_m + 1;
-
-    /* Allocate output buffer and place received primary and secondary packets
-     * inside */
-    uint8_t *buf = calloc(packet_len * port->rx_fec_k, sizeof(uint8_t));
+    /* payload_len may only be present on some fragments */
+    uint32_t payload_len = 0;
     for (int i = 0; i < n_split; i++) {
-        if (split[i]->frag < port->rx_fec_k) {
-            memcpy(buf + split[i]->frag * packet_len,
-                   split[i]->super.payload_data, packet_len);
-            block_nums[split[i]->frag] = split[i]->frag;
-        }
+        if (split[i]->payload_len > payload_len)
+            payload_len = split[i]->payload_len;
+    }
+    if (payload_len > (uint32_t)packet_len * port->rx_fec_k) {
+        syslog(LOG_ERR, "Invalid payload length on port %d", split[0]->port);
+        return -1;
     }
-    for (int i = 0; i < n_split; i++) {
-        if (split[i]->frag >= port->rx_fec_k) {
-            int index = -1;
-            for (int k = 0; k < port->rx_fec_k; k++) {
-                if (block_nums[k] >= port->rx_fec_m) {
-                    index = k;
-                    break;
-                }
-            }
-            if (index >= port->rx_fec_k)
-                break;
 
-            memcpy(buf + index * packet_len, split[i]->super.payload_data,
-                   packet_len);
-            block_nums[index] = split[i]->frag;
+    /* Only the missing primary blocks are decoded, directly into recovered */
+    struct rs_port_layer_packet *primary[RS_PORT_LAYER_MAX_FRAGMENTS];
+    uint8_t *output[RS_PORT_LAYER_MAX_FRAGMENTS];
+    struct rs_buffer *recovered;
+    if (_decode_missing(port, split, n_split, packet_len, primary, &recovered,
+                        output) < 0)
+        return -1;
+
+    /* The frame references the primary blocks, no copy */
+    struct rs_buffer *iov = rs_packet_iov_new(port->rx_fec_k);
+    if (!iov) {
+        rs_buffer_unref(recovered);
+        return -1;
+    }
+    int remaining = payload_len;
+    for (int i = 0, j = 0; i < port->rx_fec_k && remaining > 0; i++) {
+        int len = remaining < packet_len ? remaining : packet_len;
+        if (primary[i]) {
+            rs_packet_iov_append(
+                iov, rs_buffer_ref(primary[i]->super.payload_ownership),
+                primary[i]->super.payload_data, len);
+        } else {
+            rs_packet_iov_append(iov, rs_buffer_ref(recovered), output[j++],
+                                 len);
         }
+        remaining -= len;
     }
+    rs_buffer_unref(recovered);
 
-    /* Decode */
-    uint8_t **input = calloc(port->rx_fec_k, sizeof(void *));
-
-    uint8_t *output_buf = calloc(port->rx_fec_k * packet_len, sizeof(uint8_t));
-    uint8_t **output = calloc(port->rx_fec_k, sizeof(void *));
-
-    for (int i = 0; i < port->rx_fec_k; i++)
-        input[i] = buf + i * packet_len;
-    for (int i = 0; i < port->rx_fec_k; i++)
-        output[i] = output_buf + i * packet_len;
+    _init_joined(joined, split, n_split, iov, payload_len);
+    return 0;
+}
 
-    fec_decode(port->rx_fec, (const uint8_t **)input, output, block_nums,
-               packet_len);
-    free(output);
-    free(input);
+int rs_port_layer_packet_join_segments(struct rs_port_layer_packet *joined,
+                                       struct rs_port_layer_packet **segments,
+                                       int n_segments) {
+    int n_iov = 0;
+    for (int i = 0; i < n_segments; i++) {
+        struct rs_buffer *iov = segments[i]->super.payload_iov;
+        n_iov += iov ? rs_packet_iov(iov)->n : 1;
+    }
 
-    /* Write output back to buf */
-    for (int i = 0, j = 0; i < port->rx_fec_k; i++) {
-        if (block_nums[i] >= port->rx_fec_k) {
-            memcpy(buf + i * packet_len, output_buf + j * packet_len,
-                   packet_len * sizeof(uint8_t));
-            j++;
+    struct rs_buffer *iov = rs_packet_iov_new(n_iov);
+    if (!iov)
+        return -1;
+
+    uint32_t payload_len = 0;
+    for (int i = 0; i < n_segments; i++) {
+        struct rs_packet *s = &segments[i]->super;
+        if (s->payload_iov) {
+            struct rs_packet_iov *from = rs_packet_iov(s->payload_iov);
+            for (int j = 0; j < from->n; j++) {
+                rs_packet_iov_append(iov, rs_buffer_ref(from->ownership[j]),
+                                     from->iov[j].iov_base,
+                                     from->iov[j].iov_len);
+            }
+        } else {
+            rs_packet_iov_append(iov, rs_buffer_ref(s->payload_ownership),
+                                 s->payload_data, s->payload_data_len);
         }
+        payload_len += s->payload_data_len;
     }
-    free(output_buf);
-    free(block_nums);
 
-    /* Setup returned packet */
-    rs_port_layer_packet_init(joined, buf, NULL, buf, split[0]->payload_len);
-    joined->command = split[0]->command;
-    joined->port = split[0]->port;
-    joined->seq = split[0]->seq;
-    joined->frag = 0;
-    joined->n_frag_decoded = 1;
-    joined->n_frag_encoded = 1;
-    joined->stats = split[0]->stats;
-    memcpy(joined->command_payload, split[0]->command_payload,
-           RS_PORT_LAYER_COMMAND_LENGTH);
+    _init_joined(joined, segments, n_segments, iov, payload_len);
+    return 0;
+}
+
+int rs_port_layer_packet_join_group(struct rs_port_layer_packet *joined,
+                                    struct rs_port *port,
+                                    struct rs_port_layer_packet **split,
+                                    int n_split, int k, int m) {
+    /* Parity blocks have the full length */
+    int packet_len = -1;
+    for (int i = 0; i < n_split; i++) {
+        if (split[i]->frag >= k)
+            packet_len = split[i]->super.payload_data_len;
+    }
+    if (packet_len < RS_PORT_LAYER_GROUP_LEN_PREFIX)
+        return -1;
+
+    rs_port_setup_rx_fec(port, k, m);
+
+    struct rs_port_layer_packet *primary[RS_PORT_LAYER_MAX_FRAGMENTS];
+    uint8_t *output[RS_PORT_LAYER_MAX_FRAGMENTS];
+    struct rs_buffer *recovered;
+    int n_missing = _decode_missing(port, split, n_split, packet_len, primary,
+                                    &recovered, output);
+    if (n_missing < 0)
+        return -1;
+
+    /* Only recovered frames, the received ones have been delivered */
+    struct rs_buffer *iov = rs_packet_iov_new(n_missing);
+    if (!iov) {
+        rs_buffer_unref(recovered);
+        return -1;
+    }
+    uint32_t payload_len = 0;
+    for (int i = 0; i < n_missing; i++) {
+        int len = rs_load_be16(output[i]);
+        if (len > packet_len - RS_PORT_LAYER_GROUP_LEN_PREFIX)
+            continue;
+
+        rs_packet_iov_append(iov, rs_buffer_ref(recovered),
+                             output[i] + RS_PORT_LAYER_GROUP_LEN_PREFIX, len);
+        payload_len += len;
+    }
+    rs_buffer_unref(recovered);
 
+    _init_joined(joined, split, n_split, iov, payload_len);
+    joined->group = 1;
     return 0;
 }
 
@@ -303,5 +693,4 @@ static struct rs_packet_vtable vtable = {
     .destroy = &rs_packet_base_destroy,
     .len = &rs_packet_base_len,
     .pack = &rs_packet_base_pack,
-    .len_header = &rs_port_layer_packet_len_header,
     .pack_header = &rs_port_layer_packet_pack_header};
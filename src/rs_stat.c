@@ -16,7 +16,7 @@ void rs_stat_init(struct rs_stat *stat, int aggregate, const char *title,
     memset(stat->data, 0.0, RS_STAT_N * sizeof(double));
     memset(stat->n_data, 0, RS_STAT_N * sizeof(int));
 
-    clock_gettime(CLOCK_REALTIME, &stat->t0);
+    rs_clock_now(&stat->t0);
     stat->t0.tv_nsec %= 1000000L;
     stat->aggregate = aggregate;
     stat->title = title;
@@ -26,7 +26,7 @@ void rs_stat_init(struct rs_stat *stat, int aggregate, const char *title,
 
 void rs_stat_register(struct rs_stat *stat, double value) {
     struct timespec now;
-    clock_gettime(CLOCK_REALTIME, &now);
+    rs_clock_now(&now);
     long millis = msec_diff(now, stat->t0);
     int idx = millis / RS_STAT_DT_MSEC;
     if (idx < 0) {
@@ -58,7 +58,7 @@ void rs_stat_register(struct rs_stat *stat, double value) {
 
 void rs_stat_flush(struct rs_stat *stat) {
     struct timespec now;
-    clock_gettime(CLOCK_REALTIME, &now);
+    rs_clock_now(&now);
     long millis = msec_diff(now, stat->t0);
     int idx = millis / RS_STAT_DT_MSEC;
     if (idx < 0) {
@@ -147,7 +147,7 @@ void rs_stat_printf(struct rs_stat *stat) {
     rs_stat_flush(stat);
 
     struct timespec now;
-    clock_gettime(CLOCK_REALTIME, &now);
+    rs_clock_now(&now);
     long millis = msec_diff(now, stat->t0);
     int idx = millis / RS_STAT_DT_MSEC;
 
@@ -168,7 +168,7 @@ double rs_stat_current(struct rs_stat *stat) {
     rs_stat_flush(stat);
 
     struct timespec now;
-    clock_gettime(CLOCK_REALTIME, &now);
+    rs_clock_now(&now);
     long millis = msec_diff(now, stat->t0);
     int idx = millis / RS_STAT_DT_MSEC;
 
@@ -248,30 +248,30 @@ void rs_stats_packed_init(struct rs_stats_packed *packed,
 
 int rs_stats_packed_pack(struct rs_stats_packed *packed, uint8_t **buffer,
                          int *buffer_len) {
-    PACK(buffer, buffer_len, uint16_t, packed->tx_bits);
-    PACK(buffer, buffer_len, uint16_t, packed->rx_bits);
-    PACK(buffer, buffer_len, uint16_t, packed->rx_missed);
+    if (*buffer_len < RS_STATS_PACKED_LEN)
+        return -1;
 
-    return 0;
+    rs_stats_packed_store(packed, *buffer);
+    (*buffer) += RS_STATS_PACKED_LEN;
+    (*buffer_len) -= RS_STATS_PACKED_LEN;
 
-pack_err:
-    return -1;
+    return 0;
 }
 
 int rs_stats_packed_len(struct rs_stats_packed *packed) {
-    return 3 * sizeof(uint16_t);
+    return RS_STATS_PACKED_LEN;
 }
 
 int rs_stats_packed_unpack(struct rs_stats_packed *unpacked, uint8_t **buffer,
                            int *buffer_len) {
-    UNPACK(buffer, buffer_len, uint16_t, &unpacked->tx_bits);
-    UNPACK(buffer, buffer_len, uint16_t, &unpacked->rx_bits);
-    UNPACK(buffer, buffer_len, uint16_t, &unpacked->rx_missed);
+    if (*buffer_len < RS_STATS_PACKED_LEN)
+        return -1;
 
-    return 0;
+    rs_stats_packed_load(unpacked, *buffer);
+    (*buffer) += RS_STATS_PACKED_LEN;
+    (*buffer_len) -= RS_STATS_PACKED_LEN;
 
-unpack_err:
-    return -1;
+    return 0;
 }
 
 void rs_stats_place(struct rs_stats *stats, double *into) {
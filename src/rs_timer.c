@@ -0,0 +1,166 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "rs_timer.h"
+
+#define RS_TIMER_WHEEL_MASK (RS_TIMER_WHEEL_SLOTS - 1)
+
+/* Ticks spanned by levels 0..l */
+#define RS_TIMER_WHEEL_SPAN(l)                                                 \
+    ((uint64_t)1 << (RS_TIMER_WHEEL_BITS * ((l) + 1)))
+
+static inline int _slot(uint64_t expires, int level) {
+    return (expires >> (RS_TIMER_WHEEL_BITS * level)) & RS_TIMER_WHEEL_MASK;
+}
+
+static void _link(struct rs_timer_wheel *wheel, struct rs_timer *timer) {
+    if (timer->expires < wheel->tick)
+        timer->expires = wheel->tick;
+    uint64_t delta = timer->expires - wheel->tick;
+
+    int level = 0;
+    while (level < RS_TIMER_WHEEL_LEVELS - 1 &&
+           delta >= RS_TIMER_WHEEL_SPAN(level))
+        level++;
+    if (delta >= RS_TIMER_WHEEL_SPAN(level)) {
+        timer->expires = wheel->tick + RS_TIMER_WHEEL_SPAN(level) - 1;
+    }
+
+    struct rs_timer **head = &wheel->slots[level][_slot(timer->expires, level)];
+    timer->next = *head;
+    if (*head)
+        (*head)->pprev = &timer->next;
+    *head = timer;
+    timer->pprev = head;
+}
+
+static void _unlink(struct rs_timer *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next)
+        timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/* Move the timers of slot index of level one level down (or further),
+ * returns index */
+static int _cascade(struct rs_timer_wheel *wheel, int level, int index) {
+    struct rs_timer *timer = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+    while (timer) {
+        struct rs_timer *next = timer->next;
+        _link(wheel, timer);
+        timer = next;
+    }
+    return index;
+}
+
+static void _tick(struct rs_timer_wheel *wheel) {
+    int index = _slot(wheel->tick, 0);
+    if (!index) {
+        for (int l = 1; l < RS_TIMER_WHEEL_LEVELS; l++) {
+            if (_cascade(wheel, l, _slot(wheel->tick, l)))
+                break;
+        }
+    }
+
+    /* Detach the slot first, so that callbacks rescheduling with a delay of
+     * 0 fire on the next tick */
+    struct rs_timer *timer = wheel->slots[0][index];
+    wheel->slots[0][index] = NULL;
+    if (timer)
+        timer->pprev = &timer;
+    wheel->tick++;
+
+    while (timer) {
+        struct rs_timer *fired = timer;
+        _unlink(fired);
+        wheel->n_scheduled--;
+        fired->callback(fired, fired->arg);
+    }
+}
+
+void rs_timer_wheel_init(struct rs_timer_wheel *wheel) {
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+    wheel->n_scheduled = 0;
+    wheel->tick = rs_timer_now_msec();
+}
+
+void rs_timer_wheel_advance(struct rs_timer_wheel *wheel) {
+    uint64_t now = rs_timer_now_msec();
+
+    while (wheel->tick <= now) {
+        if (!wheel->n_scheduled) {
+            wheel->tick = now + 1;
+            break;
+        }
+        _tick(wheel);
+    }
+}
+
+int rs_timer_wheel_timeout(struct rs_timer_wheel *wheel) {
+    if (!wheel->n_scheduled)
+        return -1;
+
+    /* Called at the end of a loop iteration, which may have taken a while */
+    struct timespec ts;
+    rs_clock_precise(&ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000L;
+    uint64_t at = UINT64_MAX;
+
+    /* Level 0 holds exact expiries, timers on higher levels are cascaded
+     * when the level below wraps, which is the earliest they may fire */
+    for (int i = 0; i < RS_TIMER_WHEEL_SLOTS; i++) {
+        uint64_t tick = wheel->tick + i;
+        if (wheel->slots[0][_slot(tick, 0)]) {
+            at = tick;
+            break;
+        }
+    }
+    for (int l = 1; l < RS_TIMER_WHEEL_LEVELS; l++) {
+        uint64_t granularity = (uint64_t)1 << (RS_TIMER_WHEEL_BITS * l);
+        uint64_t tick = (wheel->tick + granularity - 1) & ~(granularity - 1);
+        for (int i = 0; i < RS_TIMER_WHEEL_SLOTS && tick < at;
+             i++, tick += granularity) {
+            if (wheel->slots[l][_slot(tick, l)]) {
+                at = tick;
+                break;
+            }
+        }
+    }
+
+    if (at <= now)
+        return 0;
+    if (at - now > INT32_MAX)
+        return INT32_MAX;
+    return at - now;
+}
+
+void rs_timer_init(struct rs_timer *timer, rs_timer_callback_t callback,
+                   void *arg) {
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->arg = arg;
+}
+
+void rs_timer_schedule(struct rs_timer_wheel *wheel, struct rs_timer *timer,
+                       long msec) {
+    if (rs_timer_scheduled(timer)) {
+        _unlink(timer);
+        wheel->n_scheduled--;
+    }
+
+    uint64_t now = rs_timer_now_msec();
+    timer->expires = now + (msec > 0 ? msec : 0);
+    _link(wheel, timer);
+    wheel->n_scheduled++;
+}
+
+void rs_timer_cancel(struct rs_timer_wheel *wheel, struct rs_timer *timer) {
+    if (!rs_timer_scheduled(timer))
+        return;
+    _unlink(timer);
+    wheel->n_scheduled--;
+}
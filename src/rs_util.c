@@ -0,0 +1,6 @@
+#include <time.h>
+
+#include "rs_util.h"
+
+__thread struct timespec rs_clock_cached;
+__thread int rs_clock_cached_valid = 0;